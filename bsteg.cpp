@@ -1,34 +1,110 @@
 #include <iostream>
+#include <chrono>
+#include <optional>
+#include <utility>
 #include <getopt.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "src/steg.hpp"
+#include "src/lsb.hpp"
+#include "src/stream.hpp"
+#include "src/parallel.hpp"
+#include "src/batch.hpp"
+#include "src/buffer_pool.hpp"
+#include "src/serve.hpp"
+#include "src/shard.hpp"
+#include "src/update.hpp"
 
-#define OPTIONS "i:d:o:b:vh"
+#define OPTIONS "i:d:o:b:c:Ck:t:mHsz:r:B:S:pVvh"
+// Long options without a short form
+#define OPTION_STATS 256
+#define OPTION_COUNTERS 257
+#define OPTION_CHANNELS 258
+#define OPTION_SHARD 259
+#define OPTION_UPDATE 260
 
 static option cli_options[] = {
 	{"image", 	required_argument, 	NULL, 'i'},
 	{"data", 	required_argument, 	NULL, 'd'},
 	{"output", 	required_argument, 	NULL, 'o'},
 	{"bits", 	required_argument, 	NULL, 'b'},
+	{"compress", 	required_argument, 	NULL, 'c'},
+	{"checksum", 	no_argument, 		NULL, 'C'},
+	{"kernel", 	required_argument, 	NULL, 'k'},
+	{"threads", 	required_argument, 	NULL, 't'},
+	{"mmap", 	no_argument, 		NULL, 'm'},
+	{"huge-pages",	no_argument,		NULL, 'H'},
+	{"stream", 	no_argument, 		NULL, 's'},
+	{"data-size",	required_argument,	NULL, 'z'},
+	{"range",	required_argument,	NULL, 'r'},
+	{"batch",	required_argument,	NULL, 'B'},
+	{"serve",	required_argument,	NULL, 'S'},
+	{"probe",	no_argument,		NULL, 'p'},
+	{"verify",	no_argument,		NULL, 'V'},
 	{"verbose",	no_argument,		NULL, 'v'},
+	{"stats",	optional_argument,	NULL, OPTION_STATS},
+	{"counters",	no_argument,		NULL, OPTION_COUNTERS},
+	{"channels",	required_argument,	NULL, OPTION_CHANNELS},
+	{"shard",	no_argument,		NULL, OPTION_SHARD},
+	{"update",	no_argument,		NULL, OPTION_UPDATE},
 	{"help", 	no_argument, 		NULL, 'h'},
 	{0, 0, 0, 0}
 };
 
 uint8_t verbose = 0;
 
+// Phase totals are printed to standard error however the program exits, as text or as JSON
+static bool stats_json = false;
+static std::chrono::steady_clock::time_point start_time;
+
+static void report_stats() {
+	
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+	
+	if(stats_json)
+		trace_report_json(std::cerr, seconds);
+	else
+		trace_report(std::cerr, seconds);
+
+}
+
+// Print one line describing an image and any data encoded in it, reading only the pages holding the headers
+static void print_probe(const char *image_filename, uint8_t channels) {
+	
+	// Described before anything is printed, so an unreadable image only gets its error line
+	std::string description = probe_image(bmp_file::open_lazy(image_filename), channels);
+	
+	std::cout << image_filename << '\t' << description << '\n';
+
+}
+
 int32_t main(int32_t argc, char **argv) {
 	
 	int32_t opt;
 	
-	std::string input_image_filename, input_data_filename, output_file_filename;
+	std::string input_image_filename, input_data_filename, output_file_filename, batch_filename, serve_socket;
+	bool probe_images = false;
+	bool verify_data = false;
+	bool shard_payload = false;
+	bool update_image = false;
 	uint8_t n_bits = 0;
+	lz_level compression = lz_level::none;
+	bool checksums = false;
+	uint8_t channels = CHANNELS_ALL;
+	bool hardware_counters = false;
+	bool map_images = false;
+	bool stream_images = false;
+	int64_t data_size = -1;
+	bool extract_part = false;
+	uint64_t range_offset = 0, range_length = 0;
 	
 	// Parse command-line arguments
 	while((opt = getopt_long(argc, argv, OPTIONS, cli_options, NULL)) != -1) {
 		
 		switch(opt) {
-			
+		
 			case 'i':
 			
 				input_image_filename = optarg;
@@ -55,23 +131,185 @@ int32_t main(int32_t argc, char **argv) {
 				
 				break;
 				
+			case 'c':
+			
+				if(!lz_parse_level(optarg, compression)) {
+					std::cerr << "Unknown compression level \"" << optarg << "\", expected none, fast, or max.\n";
+					return 1;
+				}
+				
+				break;
+				
+			case 'C':
+			
+				checksums = true;
+				break;
+				
+			case 'k': {
+				
+				lsb_kernel kernel;
+				
+				if(!lsb_parse_kernel(optarg, kernel)) {
+					std::cerr << "Unknown kernel \"" << optarg << "\", expected scalar, sse, avx2, or avx512.\n";
+					return 5;
+				}
+				
+				try {
+					lsb_set_kernel(kernel);
+				}
+				catch(const std::runtime_error &e) {
+					std::cerr << e.what() << '\n';
+					return 5;
+				}
+				
+				break;
+			
+			}
+			
+			case 't':
+			
+				set_thread_count(std::strtoul(optarg, nullptr, 0));
+				break;
+				
+			case 'm':
+			
+				map_images = true;
+				break;
+				
+			case 'H':
+			
+				buffer_pool::global().set_huge_pages(true);
+				break;
+				
+			case 's':
+			
+				stream_images = true;
+				break;
+				
+			case 'z':
+			
+				data_size = std::strtoll(optarg, nullptr, 0);
+				break;
+				
+			case 'r': {
+				
+				char *range_end;
+				
+				range_offset = std::strtoull(optarg, &range_end, 0);
+				bool valid_range = range_end != optarg && *range_end == ':';
+				
+				if(valid_range) {
+					char *length_start = range_end + 1;
+					range_length = std::strtoull(length_start, &range_end, 0);
+					valid_range = range_end != length_start && !*range_end;
+				}
+				
+				if(!valid_range) {
+					std::cerr << "Invalid range \"" << optarg << "\", expected <offset>:<length>.\n";
+					return 1;
+				}
+				
+				extract_part = true;
+				break;
+			
+			}
+			
+			case 'B':
+			
+				batch_filename = optarg;
+				break;
+				
+			case 'S':
+			
+				serve_socket = optarg;
+				break;
+				
+			case 'p':
+			
+				probe_images = true;
+				break;
+				
+			case 'V':
+			
+				verify_data = true;
+				break;
+				
 			case 'v':
 			
 				verbose++;
 				break;
 				
+			case OPTION_STATS:
+			
+				if(optarg && std::strcmp(optarg, "json") && std::strcmp(optarg, "text")) {
+					std::cerr << "Invalid stats format, use text or json.\n";
+					return 1;
+				}
+				
+				stats_json = optarg && !std::strcmp(optarg, "json");
+				verbose = std::max<uint8_t>(verbose, 1);
+				break;
+				
+			case OPTION_COUNTERS:
+			
+				hardware_counters = true;
+				break;
+				
+			case OPTION_CHANNELS:
+			
+				if(!parse_channels(optarg, channels)) {
+					std::cerr << "Unknown channels \"" << optarg << "\", expected any of b, g, r, and a.\n";
+					return 1;
+				}
+				
+				break;
+				
+			case OPTION_SHARD:
+			
+				shard_payload = true;
+				break;
+				
+			case OPTION_UPDATE:
+			
+				update_image = true;
+				break;
+				
 			case 'h':
 			
 				std::cout << argv[0] << " help\n" <<
 					"Least-Significant Bit(s) Bitmap Steganography command-line utility\n" <<
 					"Used to store a file of any type inside the n least-significant bits of a standard 24-bit RGB or 32-bit sRGB bitmap (more to come later)\n" <<
 					"Usage:\n\t" <<
-						argv[0] << " [-i|--image] <image_filename> ([-d|--data] <data_filename>) [-o|--output] <output_filename>  ([-b|--bits] <bit_count>) ([-v|--verbose]) ([-h|--help])\n\t" <<
+						argv[0] << " [-i|--image] <image_filename> ([-d|--data] <data_filename>) [-o|--output] <output_filename>  ([-b|--bits] <bit_count>) ([-c|--compress] <level>) ([-C|--checksum]) ([-k|--kernel] <kernel>) ([-t|--threads] <thread_count>) ([-m|--mmap]) ([-H|--huge-pages]) ([-s|--stream] ([-z|--data-size] <bytes>)) ([-r|--range] <offset>:<length>) ([--channels] <channels>) ([-v|--verbose]) ([--stats[=<format>]]) ([--counters]) ([-h|--help])\n\t" <<
+						argv[0] << " [-V|--verify] [-i|--image] <image_filename> ([-s|--stream]) ([-m|--mmap]) ([--channels] <channels>) ([-t|--threads] <thread_count>)\n\t" <<
+						argv[0] << " [-p|--probe] ([-i|--image] <image_filename>) ([--channels] <channels>) <image_filename>...\n\t" <<
+						argv[0] << " [-B|--batch] <job_filename> ([-t|--threads] <thread_count>) ([-k|--kernel] <kernel>) ([-m|--mmap]) ([-H|--huge-pages])\n\t" <<
+						argv[0] << " [-S|--serve] <socket_filename> ([-t|--threads] <thread_count>) ([-k|--kernel] <kernel>) ([-m|--mmap]) ([-H|--huge-pages])\n\t" <<
+						argv[0] << " [--update] [-i|--image] <image_filename> [-d|--data] <data_filename> ([-b|--bits] <bit_count>) ([-c|--compress] <level>) ([-C|--checksum]) ([--channels] <channels>)\n\t" <<
+						argv[0] << " [--shard] ([-d|--data] <data_filename>) [-o|--output] <output_filename> ([-b|--bits] <bit_count>) ([-c|--compress] <level>) ([-C|--checksum]) ([--channels] <channels>) ([-t|--threads] <thread_count>) ([-m|--mmap]) ([-i|--image] <image_filename>) <image_filename>...\n\t" <<
 						"-i -> Specify a bitmap image to use either to encode data into or decode data from.\n\t" <<
 						"-d -> Specify the data file to encode into the image file. If omitted, the input image will be decoded.\n\t" <<
-						"-o -> Specify an output file to write either the encoded bitmap or the decoded data file.\n\t" <<
+						"-o -> Specify an output file to write either the encoded bitmap or the decoded data file. Use - to write the decoded data (or the streamed encoded bitmap) to standard output.\n\t" <<
 						"-b -> Set the number of least significant bits to use in encoding. If omitted, the program will determine the smallest number of LSBs that can be used for the specified image and data set.\n\t" <<
-						"-v -> Enable verbose output (not yet implemented).\n\t" <<
+						"-c -> Compress the data before encoding it, with a level of none, fast, or max. Data that doesn't get smaller is encoded as it is. Decoding always decompresses. If omitted, none is used.\n\t" <<
+						"-C -> Follow every 64 KiB chunk of the encoded data with a CRC32C, so corruption is detected when decoding instead of producing bad data.\n\t" <<
+						"-k -> Pin the encode/decode kernel to one of scalar, sse, avx2, or avx512. If omitted, the widest kernel supported by this CPU is used.\n\t" <<
+						"-t -> Set the number of threads used to encode or decode a large image. If omitted or 0, one thread per hardware thread is used. Small images always use a single thread.\n\t" <<
+						"-m -> Memory-map image files instead of reading them. When encoding, the output file is created as a copy of the input image and modified in place.\n\t" <<
+						"-H -> Back large pixel buffers with transparent huge pages where the kernel allows it, cutting page faults on large images.\n\t" <<
+						"-s -> Stream the image through a fixed-size window instead of loading it whole, when encoding or decoding. The data file may be - to read it from standard input.\n\t" <<
+						"-z -> Set the number of data bytes to hide when streaming. If omitted, the size of the data file is used.\n\t" <<
+						"-r -> Decode only length data bytes starting at offset, reading only the parts of the image holding them.\n\t" <<
+						"--channels -> Hide data only in the given channels of each pixel, any of b, g, r, and a, such as bgr to leave the alpha of a 32-bit image untouched. The same channels must be given again to decode. If omitted, every byte of each pixel is used. Not supported with -s.\n\t" <<
+						"--update -> Replace the data encoded in the image with the data file, in place, writing only the 4 KiB blocks of the image that change. The image's bit count is kept unless -b is given, and the same -c, -C, and --channels options apply as when encoding.\n\t" <<
+						"--shard -> Spread the data over every image given, in parts sized to what each image holds, encoded in parallel at the same bit count. -o then names the directory the encoded images are written to, under the names of their covers. Without -d, the parts are decoded from the images, given in any order, and reassembled in the output file.\n\t" <<
+						"-B -> Run every job listed in a file, or on standard input for -. Each line holds one job's -i, -d, -o, and -b options. With -B, -t sets the number of jobs run at once.\n\t" <<
+						"-S -> Serve encode, decode, and probe requests on a Unix domain socket until interrupted, see src/serve.hpp for the protocol. With -S, -t also sets the number of connections served at once.\n\t" <<
+						"-p -> Print the bit count, data size, and capacity at each bit count of every image given, one tab-separated line per image. Only the headers are read.\n\t" <<
+						"-V -> Decode the image and check the data against its CRCs without writing it anywhere. Exits with 9 if the data is corrupt.\n\t" <<
+						"-v -> Print the time, bytes, and throughput of each phase (header, read, compress, embed, extract, write) to standard error once done. Given twice, also print progress messages as the phases run.\n\t" <<
+						"--stats -> Print the phase totals of -v, as text (the default) or with --stats=json.\n\t" <<
+						"--counters -> Add the cycles, instructions, and cache misses of each phase to the totals, where perf_event_open is allowed.\n\t" <<
 						"-h -> Show help text.\n";
 				
 				return 0;
@@ -80,9 +318,197 @@ int32_t main(int32_t argc, char **argv) {
 			
 				std::cerr << "Unknown argument received. Use -h for program help.\n";
 				return 1;
+		
+		}
+	
+	}
+	
+	// Spans are only recorded once asked for, otherwise tracing stays out of the way
+	if(verbose) {
+		
+		start_time = std::chrono::steady_clock::now();
+		
+		trace_enable(hardware_counters);
+		trace_set_verbose(verbose > 1);
+		
+		std::atexit(report_stats);
+	
+	}
+	
+	// Describe each image without decoding anything
+	if(probe_images) {
+		
+		std::vector<const char *> probe_filenames;
+		if(!input_image_filename.empty())
+			probe_filenames.push_back(input_image_filename.c_str());
+		for(int32_t arg = optind; arg < argc; arg++)
+			probe_filenames.push_back(argv[arg]);
+		
+		if(probe_filenames.empty()) {
+			std::cerr << "No input image supplied.\n";
+			return 3;
+		}
+		
+		// Keep going past images that can't be read, reporting them as they come up
+		int32_t status = 0;
+		for(const char *image_filename : probe_filenames) {
+			try {
+				print_probe(image_filename, channels);
+			}
+			catch(const std::runtime_error &e) {
+				std::cout << image_filename << "\terror=" << e.what() << '\n';
+				status = 6;
+			}
+		}
+		
+		return status;
+	
+	}
+	
+	// Answer requests from other processes instead of running a single job
+	if(!serve_socket.empty()) {
+		
+		serve_options options;
+		options.map_images = map_images;
+		
+		try {
+			return serve(serve_socket.c_str(), options);
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 8;
+		}
+	
+	}
+	
+	// Run a list of jobs instead of a single one
+	if(!batch_filename.empty()) {
+		
+		std::fstream batch_file;
+		if(batch_filename != "-") {
+			batch_file.open(batch_filename, std::ios::in);
+			if(!batch_file.is_open()) {
+				std::cerr << "Unable to open job file for reading.\n";
+				return 6;
+			}
+		}
+		
+		std::vector<batch_job> jobs = read_batch(batch_filename == "-" ? std::cin : batch_file);
+		
+		batch_options options;
+		options.map_images = map_images;
+		
+		auto start = std::chrono::steady_clock::now();
+		std::vector<batch_result> results = run_batch(jobs, options);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		
+		return report_batch(std::cout, jobs, results, seconds) ? 8 : 0;
+	
+	}
+	
+	// Spread the data over several images, or gather it back from them
+	if(shard_payload) {
+		
+		std::vector<std::string> image_filenames;
+		if(!input_image_filename.empty())
+			image_filenames.push_back(input_image_filename);
+		for(int32_t arg = optind; arg < argc; arg++)
+			image_filenames.push_back(argv[arg]);
+		
+		if(image_filenames.empty()) {
+			std::cerr << "No input image supplied.\n";
+			return 3;
+		}
+		
+		if(output_file_filename.empty()) {
+			std::cerr << "No output filename supplied.\n";
+			return 4;
+		}
+		
+		if(stream_images) {
+			std::cerr << "Sharding is not supported when streaming.\n";
+			return 6;
+		}
+		
+		shard_options options;
+		options.bits = n_bits;
+		options.compression = compression;
+		options.checked = checksums;
+		options.channels = channels;
+		options.map_images = map_images;
+		
+		// Decode, writing each part to its offset in the output file
+		if(input_data_filename.empty()) {
+			
+			if(output_file_filename == "-") {
+				std::cerr << "Sharded data is reassembled in place, so it can't be written to standard output.\n";
+				return 7;
+			}
+			
+			int output_fd = open(output_file_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(output_fd < 0) {
+				std::cerr << "Unable to open output file for writing.\n";
+				return 7;
+			}
+			
+			// Parts are written out before the set is known to be whole, so a failed reassembly removes them again
+			try {
+				shard_extract(image_filenames, output_fd, options);
+			}
+			catch(const std::runtime_error &e) {
+				discard_output(output_fd, output_file_filename.c_str());
+				std::cerr << e.what() << '\n';
+				return 8;
+			}
+			
+			close(output_fd);
+			return 0;
+		
+		}
+		
+		struct stat output_stat;
+		if(stat(output_file_filename.c_str(), &output_stat) || !S_ISDIR(output_stat.st_mode)) {
+			std::cerr << "Output directory not found.\n";
+			return 7;
+		}
+		
+		// Each encoded image keeps the file name of its cover
+		std::vector<std::string> output_filenames;
+		for(const std::string &image_filename : image_filenames) {
+			
+			std::string output_filename = output_file_filename + '/' + image_filename.substr(image_filename.find_last_of('/') + 1);
+			
+			if(std::find(output_filenames.begin(), output_filenames.end(), output_filename) != output_filenames.end()) {
+				std::cerr << "Cover images need different file names to be written to one directory.\n";
+				return 1;
+			}
 			
+			output_filenames.push_back(output_filename);
+		
+		}
+		
+		std::fstream input_data_file(input_data_filename, std::ios::in | std::ios::binary);
+		if(!input_data_file.is_open()) {
+			std::cerr << "Unable to open data file for reading.\n";
+			return 6;
+		}
+		
+		input_data_file.seekg(0, std::ios::end);
+		std::vector<uint8_t> input_data_vector(input_data_file.tellg());
+		input_data_file.seekg(0);
+		input_data_file.read((char *)input_data_vector.data(), input_data_vector.size());
+		input_data_file.close();
+		
+		try {
+			shard_hide(image_filenames, output_filenames, std::span<const uint8_t>(input_data_vector), options);
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 8;
 		}
 		
+		return 0;
+	
 	}
 	
 	if(input_image_filename.empty()) {
@@ -90,26 +516,255 @@ int32_t main(int32_t argc, char **argv) {
 		return 3;
 	}
 	
+	// Streaming moves whole rows of pixel bytes through its windows, selecting channels needs the image whole
+	if(stream_images && channels != CHANNELS_ALL) {
+		std::cerr << "Channels can't be selected when streaming.\n";
+		return 6;
+	}
+	
+	// Decode and check the data without writing it anywhere
+	if(verify_data) {
+		
+		data_sink discard = [](const uint8_t *, size_t) {};
+		
+		try {
+			
+			const bmp_file header_image = bmp_file::open_lazy(input_image_filename.c_str());
+			bool checked = read_header(header_image.view(channels)).flags & STEG_FLAG_CHECKED;
+			
+			uint64_t verified_bytes;
+			
+			if(stream_images) {
+				
+				std::fstream input_image_file(input_image_filename, std::ios::in | std::ios::binary);
+				if(!input_image_file.is_open()) {
+					std::cerr << "Unable to open image file for reading.\n";
+					return 6;
+				}
+				
+				verified_bytes = stream_extract(input_image_file, discard);
+			
+			}
+			else {
+				
+				const bmp_file input_image = map_images ? bmp_file::map(input_image_filename.c_str(), bmp_file::map_mode::read) : bmp_file(input_image_filename.c_str());
+				
+				verified_bytes = extract_data(input_image.view(channels), discard);
+			
+			}
+			
+			std::cout << "Verified " << verified_bytes << " data bytes" << (checked ? "" : ", but the image has no CRCs so only the header and sizes were checked") << ".\n";
+		
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 9;
+		}
+		
+		return 0;
+	
+	}
+	
+	// Re-encode the image in place, rewriting only what changes
+	if(update_image) {
+		
+		if(input_data_filename.empty()) {
+			std::cerr << "No data file supplied.\n";
+			return 6;
+		}
+		
+		std::fstream input_data_file(input_data_filename, std::ios::in | std::ios::binary);
+		if(!input_data_file.is_open()) {
+			std::cerr << "Unable to open data file for reading.\n";
+			return 6;
+		}
+		
+		input_data_file.seekg(0, std::ios::end);
+		std::vector<uint8_t> input_data_vector(input_data_file.tellg());
+		input_data_file.seekg(0);
+		input_data_file.read((char *)input_data_vector.data(), input_data_vector.size());
+		input_data_file.close();
+		
+		try {
+			update_hide(input_image_filename.c_str(), std::span<const uint8_t>(input_data_vector), n_bits, compression, checksums, channels);
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 8;
+		}
+		
+		return 0;
+	
+	}
+	
 	if(output_file_filename.empty()) {
 		std::cerr << "No output filename supplied.\n";
 		return 4;
 	}
 	
-	bmp_file input_image(input_image_filename.c_str());
-	
 	// Decode
 	if(input_data_filename.empty()) {
 		
-		// Extract data from the input image
-		std::vector<uint8_t> decoded_data = extract_data(input_image);
+		// The image is opened ahead of the output, so one that can't be read leaves no output behind
+		// Only the image rows holding a range are read, from a lazily opened or mapped image
+		std::optional<bmp_file> input_image;
+		std::fstream input_image_file;
+		const_pixel_view pixels;
+		
+		// A range has to lie within the encoded data set
+		std::vector<uint8_t> range_data;
+		
+		try {
+			
+			if(extract_part)
+				input_image.emplace(map_images ? bmp_file::map(input_image_filename.c_str(), bmp_file::map_mode::read) : bmp_file::open_lazy(input_image_filename.c_str()));
+			else if(stream_images) {
+				input_image_file.open(input_image_filename, std::ios::in | std::ios::binary);
+				if(!input_image_file.is_open())
+					throw std::runtime_error("Unable to open image file for reading.");
+			}
+			else
+				input_image.emplace(map_images ? bmp_file::map(input_image_filename.c_str(), bmp_file::map_mode::read) : bmp_file(input_image_filename.c_str()));
+			
+			if(input_image)
+				pixels = std::as_const(*input_image).view(channels);
+			
+			if(extract_part) {
+				
+				uint64_t data_size = extracted_size(pixels);
+				if(range_offset > data_size || range_length > data_size - range_offset)
+					throw std::runtime_error("Requested range is outside the encoded data set.");
+				
+				range_data.resize(range_length);
+			
+			}
+		
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 6;
+		}
+		
+		// The range is held whole anyway, so it's extracted before the output is opened and corrupt data leaves none behind
+		if(extract_part) {
+			try {
+				extract_range(pixels, range_offset, range_data);
+			}
+			catch(const std::runtime_error &e) {
+				std::cerr << e.what() << '\n';
+				return 9;
+			}
+		}
+		
+		// Open the output file for writing, or use standard output
+		int output_fd = output_file_filename == "-" ? STDOUT_FILENO : open(output_file_filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(output_fd < 0) {
+			std::cerr << "Unable to open output file for writing.\n";
+			return 7;
+		}
 		
-		// Open an output file for writing
-		std::fstream output_file(output_file_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+		if(extract_part)
+			fd_sink(output_fd)(range_data.data(), range_data.size());
+		else {
+			
+			// Corrupt data is only found once the data ahead of it has been written out, which is then removed again
+			try {
+				
+				// Decoded data is written out a block at a time as it is extracted, never held whole
+				if(stream_images)
+					stream_extract(input_image_file, fd_sink(output_fd));
+				else
+					extract_data(pixels, fd_sink(output_fd));
+			
+			}
+			catch(const std::runtime_error &e) {
+				std::cerr << e.what() << '\n';
+				if(output_fd != STDOUT_FILENO)
+					discard_output(output_fd, output_file_filename.c_str());
+				return 9;
+			}
 		
-		// Write decoded data and close
-		output_file.write((char *)decoded_data.data(), decoded_data.size());
-		output_file.close();
+		}
 		
+		if(output_fd != STDOUT_FILENO)
+			close(output_fd);
+	
+	}
+	// Encode one window of pixels at a time, pulling the data in as it is needed
+	else if(stream_images) {
+		
+		// The size written ahead of the data has to be known before any of it is read, which rules out compression,
+		// and chunks are only framed in memory
+		if(compression != lz_level::none || checksums) {
+			std::cerr << "Compression and checksums are not supported when stream encoding.\n";
+			return 6;
+		}
+		
+		std::fstream input_image_file(input_image_filename, std::ios::in | std::ios::binary);
+		if(!input_image_file.is_open()) {
+			std::cerr << "Unable to open image file for reading.\n";
+			return 6;
+		}
+		
+		std::fstream input_data_file;
+		if(input_data_filename != "-")
+			input_data_file.open(input_data_filename, std::ios::in | std::ios::binary);
+		
+		std::istream &input_data = input_data_filename == "-" ? std::cin : input_data_file;
+		
+		// The data size is written ahead of the data, so it has to be known before any of the data is read
+		struct stat data_stat;
+		if(data_size < 0 && input_data_filename != "-" && !stat(input_data_filename.c_str(), &data_stat) && S_ISREG(data_stat.st_mode))
+			data_size = data_stat.st_size;
+		
+		if(data_size < 0) {
+			std::cerr << "Unable to determine the data size, use -z to set it.\n";
+			return 6;
+		}
+		
+		// A cover file is checked from its headers before the output is opened, so data that doesn't fit leaves no output behind
+		struct stat cover_stat;
+		if(!stat(input_image_filename.c_str(), &cover_stat) && S_ISREG(cover_stat.st_mode)) {
+			try {
+				stream_bits(bmp_file::open_lazy(input_image_filename.c_str()).size(), data_size, n_bits);
+			}
+			catch(const std::runtime_error &e) {
+				std::cerr << e.what() << '\n';
+				return 8;
+			}
+		}
+		
+		std::fstream output_file;
+		if(output_file_filename != "-") {
+			output_file.open(output_file_filename, std::ios::out | std::ios::binary | std::ios::trunc);
+			if(!output_file.is_open()) {
+				std::cerr << "Unable to open output file for writing.\n";
+				return 7;
+			}
+		}
+		
+		std::ostream &output = output_file_filename == "-" ? std::cout : output_file;
+		
+		// The payload can still end early, leaving part of an image written, which is removed again
+		try {
+			stream_hide(input_image_file, output, input_data, data_size, n_bits);
+			output.flush();
+		}
+		catch(const std::runtime_error &e) {
+			
+			std::cerr << e.what() << '\n';
+			
+			if(output_file_filename != "-") {
+				output_file.close();
+				struct stat output_stat;
+				if(!stat(output_file_filename.c_str(), &output_stat) && S_ISREG(output_stat.st_mode))
+					unlink(output_file_filename.c_str());
+			}
+			
+			return 8;
+		
+		}
+	
 	}
 	// Encode
 	else {
@@ -132,16 +787,43 @@ int32_t main(int32_t argc, char **argv) {
 		// Close the file since we now have its contents in memory
 		input_data_file.close();
 		
-		// Hide the data and write to the output file
 		// If a bit count was specified, use that
-		if(n_bits) 
-			hide_data(input_image, input_data_vector, n_bits).write(output_file_filename.c_str());
-		// Otherwise, find the minimum bit count that will allow this data set to fit in this image and use that
-		else 
-			hide_data(input_image, input_data_vector).write(output_file_filename.c_str());
+		// Otherwise, find the minimum bit count that will allow this data set, compressed if asked, to fit in this image and use that
+		try {
+			
+			if(map_images) {
+				
+				// When mapping, the output file starts as a copy of the input image and is encoded in place
+				// The copy only replaces the output once it has been encoded, so data that doesn't fit leaves no output behind
+				replacement_file output_file(output_file_filename.c_str());
+				bmp_file output_image = bmp_file::map_copy(input_image_filename.c_str(), output_file.path());
+				
+				hide_data(output_image.view(channels), std::span<const uint8_t>(input_data_vector), n_bits, compression, checksums);
+				output_image.sync();
+				output_file.commit();
+			
+			}
+			// The pipeline moves whole rows of pixel bytes, so selected channels are encoded into the image read whole
+			else if(channels != CHANNELS_ALL) {
+				
+				bmp_file output_image(input_image_filename.c_str());
+				
+				hide_data(output_image.view(channels), std::span<const uint8_t>(input_data_vector), n_bits, compression, checksums);
+				output_image.write(output_file_filename.c_str());
+			
+			}
+			// Otherwise read, encode, and write the image a block at a time with the three overlapping
+			else
+				pipeline_hide(input_image_filename.c_str(), output_file_filename.c_str(), std::span<const uint8_t>(input_data_vector), n_bits, compression, checksums);
 		
+		}
+		catch(const std::runtime_error &e) {
+			std::cerr << e.what() << '\n';
+			return 8;
+		}
+	
 	}
 	
 	return 0;
-	
+
 }
\ No newline at end of file
@@ -0,0 +1,273 @@
+#include <iostream>
+#include <chrono>
+#include <filesystem>
+#include <cmath>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "src/steg.hpp"
+#include "src/lsb.hpp"
+#include "src/parallel.hpp"
+
+/*/
+ *	Benchmarks for the encode, decode, read, and write paths
+ *
+ *	Synthetic 24 and 32 BPP covers are generated at each requested size, with and without row padding, and every
+ *	bit count from 1 to 7 is encoded and decoded with a data set filling the cover. Each measurement is the best of
+ *	several runs and is reported against the cover's pixel bytes, as JSON on standard output.
+ *
+/*/
+
+#define OPTIONS "s:b:r:k:t:d:h"
+
+static option cli_options[] = {
+	{"sizes", 	required_argument, 	NULL, 's'},
+	{"bits", 	required_argument, 	NULL, 'b'},
+	{"repeats", 	required_argument, 	NULL, 'r'},
+	{"kernel", 	required_argument, 	NULL, 'k'},
+	{"threads", 	required_argument, 	NULL, 't'},
+	{"directory",	required_argument,	NULL, 'd'},
+	{"help", 	no_argument, 		NULL, 'h'},
+	{0, 0, 0, 0}
+};
+
+struct bench_case {
+	
+	uint16_t bpp;
+	uint32_t width;
+	uint32_t height;
+	
+	bool padded() const {
+		return (this->width * (this->bpp >> 3)) % 4;
+	}
+
+};
+
+// Parse a comma-separated list of numbers
+static std::vector<double> parse_list(const char *list) {
+	
+	std::vector<double> values;
+	std::stringstream list_s_str(list);
+	std::string value;
+	
+	while(std::getline(list_s_str, value, ','))
+		if(!value.empty())
+			values.push_back(std::strtod(value.c_str(), nullptr));
+	
+	return values;
+
+}
+
+// Fill a buffer with reproducible noise, so covers and data sets don't compress into cache-friendly patterns
+static void fill_noise(uint8_t *dst, size_t len, uint64_t seed) {
+	
+	uint64_t state = seed * 0x9E3779B97F4A7C15ull + 1;
+	
+	for(size_t i = 0; i < len; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		dst[i] = state >> 32;
+	}
+
+}
+
+// Best time out of repeats runs of an operation
+template <typename Operation>
+static double best_time(uint32_t repeats, Operation operation) {
+	
+	double best = 0;
+	
+	for(uint32_t run = 0; run < repeats; run++) {
+		
+		auto start = std::chrono::steady_clock::now();
+		operation();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		
+		if(!run || seconds < best)
+			best = seconds;
+	
+	}
+	
+	return best;
+
+}
+
+static void print_result(const bench_case &b_case, const char *operation, int16_t bits, size_t bytes, double seconds, bool &first) {
+	
+	std::cout << (first ? "\n" : ",\n") <<
+		"\t\t{\"bpp\": " << b_case.bpp <<
+		", \"width\": " << b_case.width <<
+		", \"height\": " << b_case.height <<
+		", \"megapixels\": " << (double)b_case.width * b_case.height / 1e6 <<
+		", \"padded\": " << (b_case.padded() ? "true" : "false") <<
+		", \"operation\": \"" << operation << '"' <<
+		", \"bits\": ";
+	
+	if(bits)
+		std::cout << bits;
+	else
+		std::cout << "null";
+	
+	std::cout <<
+		", \"bytes\": " << bytes <<
+		", \"seconds\": " << seconds <<
+		", \"mb_per_s\": " << bytes / seconds / 1e6 <<
+		", \"ns_per_byte\": " << seconds * 1e9 / bytes << '}';
+	
+	first = false;
+
+}
+
+int32_t main(int32_t argc, char **argv) {
+	
+	int32_t opt;
+	
+	std::vector<double> sizes = {1, 16, 100};
+	std::vector<double> bit_counts = {1, 2, 3, 4, 5, 6, 7};
+	uint32_t repeats = 3;
+	std::filesystem::path directory = std::filesystem::temp_directory_path();
+	
+	while((opt = getopt_long(argc, argv, OPTIONS, cli_options, NULL)) != -1) {
+		
+		switch(opt) {
+		
+			case 's':
+			
+				sizes = parse_list(optarg);
+				break;
+				
+			case 'b':
+			
+				bit_counts = parse_list(optarg);
+				break;
+				
+			case 'r':
+			
+				repeats = std::max<uint32_t>(std::strtoul(optarg, nullptr, 0), 1);
+				break;
+				
+			case 'k': {
+				
+				lsb_kernel kernel;
+				
+				if(!lsb_parse_kernel(optarg, kernel)) {
+					std::cerr << "Unknown kernel \"" << optarg << "\", expected scalar, sse, avx2, or avx512.\n";
+					return 5;
+				}
+				
+				try {
+					lsb_set_kernel(kernel);
+				}
+				catch(const std::runtime_error &e) {
+					std::cerr << e.what() << '\n';
+					return 5;
+				}
+				
+				break;
+			
+			}
+			
+			case 't':
+			
+				set_thread_count(std::strtoul(optarg, nullptr, 0));
+				break;
+				
+			case 'd':
+			
+				directory = optarg;
+				break;
+				
+			case 'h':
+			
+				std::cout << argv[0] << " help\n" <<
+					"Benchmarks encoding, decoding, reading, and writing synthetic bitmaps, printing the results as JSON\n" <<
+					"Usage:\n\t" <<
+						argv[0] << " ([-s|--sizes] <megapixels,...>) ([-b|--bits] <bit_count,...>) ([-r|--repeats] <runs>) ([-k|--kernel] <kernel>) ([-t|--threads] <thread_count>) ([-d|--directory] <directory>) ([-h|--help])\n\t" <<
+						"-s -> Set the cover sizes to generate, in megapixels. If omitted, 1, 16, and 100 are used.\n\t" <<
+						"-b -> Set the bit counts to encode and decode with. If omitted, every bit count from 1 to 7 is used.\n\t" <<
+						"-r -> Set the number of runs of each measurement, the fastest of which is reported. If omitted, 3 runs are used.\n\t" <<
+						"-k -> Pin the encode/decode kernel to one of scalar, sse, avx2, or avx512. If omitted, the widest kernel supported by this CPU is used.\n\t" <<
+						"-t -> Set the number of threads used to encode or decode. If omitted or 0, one thread per hardware thread is used.\n\t" <<
+						"-d -> Set the directory the covers are written to and read from. If omitted, the system temporary directory is used.\n\t" <<
+						"-h -> Show help text.\n";
+				
+				return 0;
+				
+			default:
+			
+				std::cerr << "Unknown argument received. Use -h for program help.\n";
+				return 1;
+		
+		}
+	
+	}
+	
+	// Each size is benchmarked as an unpadded and a padded 24 BPP cover and a 32 BPP cover, all close to square
+	std::vector<bench_case> cases;
+	for(double megapixels : sizes) {
+		
+		uint32_t width = std::max<uint32_t>(std::sqrt(megapixels * 1e6) / 4, 1) * 4;
+		uint32_t height = std::max<uint32_t>(megapixels * 1e6 / width, 1);
+		
+		cases.push_back({24, width, height});
+		cases.push_back({24, width + 1, height});
+		cases.push_back({32, width, height});
+	
+	}
+	
+	std::filesystem::path cover_path = directory / ("bsteg_bench_" + std::to_string(getpid()) + ".bmp");
+	
+	std::cout << "{\n" <<
+		"\t\"kernel\": \"" << lsb_kernel_name(lsb_get_kernel()) << "\",\n" <<
+		"\t\"threads\": " << get_thread_count() << ",\n" <<
+		"\t\"repeats\": " << repeats << ",\n" <<
+		"\t\"results\": [";
+	
+	bool first = true;
+	
+	for(const bench_case &b_case : cases) {
+		
+		bmp_file image(b_case.width, b_case.height, b_case.bpp == 32);
+		std::span<uint8_t> pixels = image.pixels();
+		size_t image_bytes = pixels.size();
+		
+		fill_noise(pixels.data(), image_bytes, image_bytes);
+		
+		// Reading and writing don't depend on the bit count, so they are measured once per cover
+		print_result(b_case, "write", 0, image_bytes, best_time(repeats, [&]() { image.write(cover_path.c_str()); }), first);
+		print_result(b_case, "read", 0, image_bytes, best_time(repeats, [&]() { image.read(cover_path.c_str()); }), first);
+		
+		pixels = image.pixels();
+		
+		for(double bit_count : bit_counts) {
+			
+			uint8_t bits = bit_count;
+			if(!bits || bits > 7)
+				continue;
+			
+			std::vector<uint8_t> data(data_capacity(image_bytes, bits));
+			fill_noise(data.data(), data.size(), bits);
+			
+			std::vector<uint8_t> decoded(data.size());
+			
+			print_result(b_case, "encode", bits, image_bytes, best_time(repeats, [&]() { hide_data(image, std::span<const uint8_t>(data), bits); }), first);
+			print_result(b_case, "decode", bits, image_bytes, best_time(repeats, [&]() { extract_data(image, std::span<uint8_t>(decoded)); }), first);
+			
+			if(decoded != data) {
+				std::cerr << "Decoded data does not match the encoded data at " << (uint16_t)bits << " bits.\n";
+				std::filesystem::remove(cover_path);
+				return 8;
+			}
+		
+		}
+	
+	}
+	
+	std::cout << "\n\t]\n}\n";
+	
+	std::filesystem::remove(cover_path);
+	
+	return 0;
+
+}
\ No newline at end of file
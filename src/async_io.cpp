@@ -0,0 +1,374 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#if __has_include(<linux/io_uring.h>)
+	#include <linux/io_uring.h>
+	#define HAVE_IO_URING
+#endif
+
+#include "async_io.hpp"
+
+// Threads used when io_uring isn't available, one can read while the other writes
+#define ASYNC_IO_THREADS 2
+
+// Largest single transfer, read/write return at most about this much anyway
+#define ASYNC_IO_MAX_TRANSFER ((size_t)1 << 30)
+
+async_io::async_io(unsigned depth, bool use_uring) {
+	
+	depth = std::max(depth, 1u);
+	
+	this->requests.resize(depth);
+	for(uint32_t id = depth; id--;)
+		this->free_requests.push_back(id);
+	
+	if(use_uring && this->setup_uring(depth))
+		return;
+	
+	for(uint8_t t = 0; t < ASYNC_IO_THREADS; t++)
+		this->workers.emplace_back(&async_io::work, this);
+
+}
+
+async_io::~async_io() {
+	
+	// The kernel or the workers may still be using the buffers, so everything in flight has to finish first
+	try {
+		for(; this->in_flight; this->in_flight--)
+			this->uring() ? this->uring_complete() : this->thread_complete();
+	} catch(const std::exception &) {}
+	
+	if(this->uring()) {
+		this->close_uring();
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->stopping = true;
+	}
+	
+	this->queued.notify_all();
+	for(std::thread &worker : this->workers)
+		worker.join();
+
+}
+
+bool async_io::uring() const {
+	return this->ring_fd >= 0;
+}
+
+void async_io::read(int fd, uint8_t *dst, size_t len, uint64_t offset, uint64_t tag) {
+	this->submit(fd, dst, len, offset, false, tag);
+}
+
+void async_io::write(int fd, const uint8_t *src, size_t len, uint64_t offset, uint64_t tag) {
+	this->submit(fd, const_cast<uint8_t *>(src), len, offset, true, tag);
+}
+
+void async_io::submit(int fd, uint8_t *buffer, size_t len, uint64_t offset, bool writing, uint64_t tag) {
+	
+	if(this->free_requests.empty())
+		throw std::runtime_error("Too many I/O requests in flight.");
+	
+	uint32_t id = this->free_requests.back();
+	this->free_requests.pop_back();
+	
+	request &r = this->requests[id];
+	r.fd = fd;
+	r.buffer = buffer;
+	r.len = len;
+	r.offset = offset;
+	r.writing = writing;
+	r.tag = tag;
+	r.done = 0;
+	r.error = 0;
+	
+	this->in_flight++;
+	
+	if(this->uring()) {
+		this->uring_submit(id);
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->queue.push_back(id);
+	}
+	
+	this->queued.notify_one();
+
+}
+
+uint64_t async_io::wait() {
+	
+	if(!this->in_flight)
+		throw std::runtime_error("No I/O requests in flight.");
+	
+	uint32_t id = this->uring() ? this->uring_complete() : this->thread_complete();
+	this->in_flight--;
+	
+	return this->finish(id);
+
+}
+
+uint64_t async_io::finish(uint32_t id) {
+	
+	const request &r = this->requests[id];
+	this->free_requests.push_back(id);
+	
+	if(r.error < 0)
+		throw std::runtime_error("Image file is truncated.");
+	if(r.error)
+		throw std::runtime_error(r.writing ? "Unable to write image file." : "Unable to read image file.");
+	
+	return r.tag;
+
+}
+
+/* io_uring */
+
+#ifdef HAVE_IO_URING
+
+static int uring_setup(unsigned entries, io_uring_params *params) {
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+bool async_io::setup_uring(unsigned depth) {
+	
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	
+	int ring_fd = uring_setup(depth, &params);
+	if(ring_fd < 0)
+		return false;
+	
+	this->ring_fd = ring_fd;
+	
+	this->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	this->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	
+	// Newer kernels map both rings together
+	bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single_map)
+		this->sq_map_size = this->cq_map_size = std::max(this->sq_map_size, this->cq_map_size);
+	
+	void *sq_map = mmap(nullptr, this->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if(sq_map == MAP_FAILED) {
+		this->close_uring();
+		return false;
+	}
+	
+	this->sq_map = sq_map;
+	
+	void *cq_map = single_map ? sq_map : mmap(nullptr, this->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if(cq_map == MAP_FAILED) {
+		this->close_uring();
+		return false;
+	}
+	
+	this->cq_map = cq_map;
+	
+	this->sqe_map_size = params.sq_entries * sizeof(io_uring_sqe);
+	void *sqe_map = mmap(nullptr, this->sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+	if(sqe_map == MAP_FAILED) {
+		this->close_uring();
+		return false;
+	}
+	
+	this->sqe_map = sqe_map;
+	
+	uint8_t *sq = static_cast<uint8_t *>(sq_map);
+	this->sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	this->sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	this->sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	
+	uint8_t *cq = static_cast<uint8_t *>(cq_map);
+	this->cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	this->cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	this->cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	this->cqes = cq + params.cq_off.cqes;
+	
+	return true;
+
+}
+
+void async_io::close_uring() {
+	
+	if(this->sqe_map)
+		munmap(this->sqe_map, this->sqe_map_size);
+	if(this->cq_map && this->cq_map != this->sq_map)
+		munmap(this->cq_map, this->cq_map_size);
+	if(this->sq_map)
+		munmap(this->sq_map, this->sq_map_size);
+	
+	this->sqe_map = this->cq_map = this->sq_map = nullptr;
+	
+	close(this->ring_fd);
+	this->ring_fd = -1;
+
+}
+
+void async_io::uring_submit(uint32_t id) {
+	
+	request &r = this->requests[id];
+	r.iov.base = r.buffer + r.done;
+	r.iov.len = std::min(r.len - r.done, ASYNC_IO_MAX_TRANSFER);
+	
+	// Only this thread touches the tail, the kernel only has to see the entry before the new tail
+	unsigned tail = *this->sq_tail;
+	unsigned index = tail & *this->sq_mask;
+	
+	io_uring_sqe *sqe = static_cast<io_uring_sqe *>(this->sqe_map) + index;
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = r.writing ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = r.fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&r.iov);
+	sqe->len = 1;
+	sqe->off = r.offset + r.done;
+	sqe->user_data = id;
+	
+	this->sq_array[index] = index;
+	__atomic_store_n(this->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	
+	while(uring_enter(this->ring_fd, 1, 0, 0) < 0) {
+		if(errno != EINTR && errno != EAGAIN)
+			throw std::runtime_error("Unable to queue I/O request.");
+	}
+
+}
+
+uint32_t async_io::uring_complete() {
+	
+	for(;;) {
+		
+		unsigned head = *this->cq_head;
+		
+		if(head == __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+			
+			if(uring_enter(this->ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+				throw std::runtime_error("Unable to wait for I/O requests.");
+			
+			continue;
+		
+		}
+		
+		const io_uring_cqe *cqe = static_cast<const io_uring_cqe *>(this->cqes) + (head & *this->cq_mask);
+		uint32_t id = cqe->user_data;
+		int result = cqe->res;
+		
+		__atomic_store_n(this->cq_head, head + 1, __ATOMIC_RELEASE);
+		
+		request &r = this->requests[id];
+		
+		if(result == -EINTR || result == -EAGAIN) {
+			this->uring_submit(id);
+			continue;
+		}
+		
+		// Reading nothing means the file ended early, writing nothing would otherwise be resubmitted forever
+		if(result < 0)
+			r.error = -result;
+		else if(!result)
+			r.error = r.writing ? EIO : -1;
+		else if((r.done += result) < r.len) {
+			this->uring_submit(id);
+			continue;
+		}
+		
+		return id;
+	
+	}
+
+}
+
+#else
+
+bool async_io::setup_uring(unsigned) {
+	return false;
+}
+
+void async_io::close_uring() {}
+
+void async_io::uring_submit(uint32_t) {}
+
+uint32_t async_io::uring_complete() {
+	return 0;
+}
+
+#endif
+
+/* Thread fallback */
+
+void async_io::work() {
+	
+	for(;;) {
+		
+		uint32_t id;
+		
+		{
+			std::unique_lock<std::mutex> guard(this->lock);
+			this->queued.wait(guard, [this] { return this->stopping || !this->queue.empty(); });
+			
+			if(this->queue.empty())
+				return;
+			
+			id = this->queue.front();
+			this->queue.pop_front();
+		}
+		
+		request &r = this->requests[id];
+		
+		while(r.done < r.len) {
+			
+			size_t len = std::min(r.len - r.done, ASYNC_IO_MAX_TRANSFER);
+			ssize_t result = r.writing ? pwrite(r.fd, r.buffer + r.done, len, r.offset + r.done) : pread(r.fd, r.buffer + r.done, len, r.offset + r.done);
+			
+			if(result < 0 && errno == EINTR)
+				continue;
+			
+			if(result < 0)
+				r.error = errno ? errno : EIO;
+			else if(!result)
+				r.error = r.writing ? EIO : -1;
+			
+			if(result <= 0)
+				break;
+			
+			r.done += result;
+		
+		}
+		
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->completions.push_back(id);
+		}
+		
+		this->completed.notify_one();
+	
+	}
+
+}
+
+uint32_t async_io::thread_complete() {
+	
+	std::unique_lock<std::mutex> guard(this->lock);
+	this->completed.wait(guard, [this] { return !this->completions.empty(); });
+	
+	uint32_t id = this->completions.front();
+	this->completions.pop_front();
+	
+	return id;
+
+}
\ No newline at end of file
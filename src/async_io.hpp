@@ -0,0 +1,110 @@
+#ifndef ASYNC_IO_HPP
+#define ASYNC_IO_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/*/
+ *	Asynchronous positioned reads and writes
+ *
+ *	Requests go to io_uring, set up through the raw system calls so no library is needed. Where io_uring isn't
+ *	available (an old kernel, or a sandbox blocking the calls) they go to a pair of threads doing pread/pwrite
+ *	instead. Either way every request is carried out in full, short transfers being continued until done.
+ *
+ *	Buffers must stay valid until their request completes, the destructor waits for everything still in flight.
+ *
+/*/
+
+class async_io {
+
+public:
+
+	// Room for depth requests in flight at once, use_uring false always uses the threads
+	async_io(unsigned depth, bool use_uring = true);
+	~async_io();
+	
+	async_io(const async_io &) = delete;
+	async_io &operator=(const async_io &) = delete;
+	
+	bool uring() const;
+	
+	// Queue a read or write of len bytes at offset, tag identifies the request once it completes
+	void read(int fd, uint8_t *dst, size_t len, uint64_t offset, uint64_t tag);
+	void write(int fd, const uint8_t *src, size_t len, uint64_t offset, uint64_t tag);
+	
+	// Wait for a request to complete and return its tag, throws if it failed
+	uint64_t wait();
+
+private:
+
+	struct request {
+		
+		int fd{-1};
+		uint8_t *buffer{nullptr};
+		size_t len{0};
+		uint64_t offset{0};
+		bool writing{false};
+		uint64_t tag{0};
+		
+		size_t done{0};
+		// errno of a failed transfer, or -1 if a read ran past the end of the file
+		int error{0};
+		
+		// io_uring takes its transfers as iovecs, which have to live as long as the request
+		struct {
+			void *base;
+			size_t len;
+		} iov;
+	
+	};
+	
+	std::vector<request> requests;
+	std::vector<uint32_t> free_requests;
+	size_t in_flight{0};
+	
+	void submit(int fd, uint8_t *buffer, size_t len, uint64_t offset, bool writing, uint64_t tag);
+	uint64_t finish(uint32_t id);
+	
+	/* io_uring */
+	
+	int ring_fd{-1};
+	
+	void *sq_map{nullptr};
+	size_t sq_map_size{0};
+	void *cq_map{nullptr};
+	size_t cq_map_size{0};
+	void *sqe_map{nullptr};
+	size_t sqe_map_size{0};
+	
+	unsigned *sq_tail{nullptr};
+	unsigned *sq_mask{nullptr};
+	unsigned *sq_array{nullptr};
+	unsigned *cq_head{nullptr};
+	unsigned *cq_tail{nullptr};
+	unsigned *cq_mask{nullptr};
+	void *cqes{nullptr};
+	
+	bool setup_uring(unsigned depth);
+	void close_uring();
+	void uring_submit(uint32_t id);
+	uint32_t uring_complete();
+	
+	/* Thread fallback */
+	
+	std::vector<std::thread> workers;
+	std::mutex lock;
+	std::condition_variable queued, completed;
+	std::deque<uint32_t> queue, completions;
+	bool stopping{false};
+	
+	void work();
+	uint32_t thread_complete();
+
+};
+
+#endif
\ No newline at end of file
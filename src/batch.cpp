@@ -0,0 +1,366 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <iomanip>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "batch.hpp"
+#include "steg.hpp"
+#include "stream.hpp"
+#include "parallel.hpp"
+
+// A job failure along with the exit code the command line would have returned for it
+class job_error : public std::runtime_error {
+
+public:
+
+	job_error(int32_t status, const std::string &message) : std::runtime_error(message), status(status) {}
+	
+	int32_t status;
+
+};
+
+std::vector<batch_job> read_batch(std::istream &input) {
+	
+	std::vector<batch_job> jobs;
+	std::string line;
+	size_t line_number = 0;
+	
+	while(std::getline(input, line)) {
+		
+		line_number++;
+		
+		std::istringstream tokens(line);
+		std::string option;
+		
+		// Skip blank lines and comments
+		if(!(tokens >> option) || option[0] == '#')
+			continue;
+		
+		batch_job job;
+		job.line = line_number;
+		
+		do {
+			
+			std::string value;
+			
+			if(option != "-i" && option != "-d" && option != "-o" && option != "-b") {
+				job.parse_error = "Unknown argument \"" + option + "\".";
+				break;
+			}
+			
+			if(!(tokens >> std::quoted(value))) {
+				job.parse_error = "Missing value for " + option + ".";
+				break;
+			}
+			
+			if(option == "-i")
+				job.image = value;
+			else if(option == "-d")
+				job.data = value;
+			else if(option == "-o")
+				job.output = value;
+			else
+				job.bits = std::min<unsigned long>(std::strtoul(value.c_str(), nullptr, 0), UINT8_MAX);
+		
+		} while(tokens >> option);
+		
+		jobs.push_back(job);
+	
+	}
+	
+	return jobs;
+
+}
+
+// Size of a file, or 0 if it can't be found
+static uint64_t file_size(const std::string &filename) {
+	
+	struct stat file_stat;
+	
+	if(filename.empty() || stat(filename.c_str(), &file_stat))
+		return 0;
+	
+	return file_stat.st_size;
+
+}
+
+static void run_job(const batch_job &job, bool map_images, batch_result &result) {
+	
+	if(!job.parse_error.empty())
+		throw job_error(1, job.parse_error);
+	
+	if(job.bits > 7)
+		throw job_error(2, "Only up to 7 least-significant bits are supported for writing.");
+	
+	if(job.image.empty())
+		throw job_error(3, "No input image supplied.");
+	
+	if(job.output.empty())
+		throw job_error(4, "No output filename supplied.");
+	
+	result.image_bytes = file_size(job.image);
+	
+	try {
+		
+		// Decode
+		if(job.data.empty()) {
+			
+			bmp_file input_image = map_images ? bmp_file::map(job.image.c_str(), bmp_file::map_mode::read) : bmp_file(job.image.c_str());
+			
+			int output_fd = open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(output_fd < 0)
+				throw job_error(7, "Unable to open output file for writing.");
+			
+			// Corrupt data is only found once the data ahead of it has been written out, which is then removed again
+			try {
+				result.data_bytes = extract_data(input_image, fd_sink(output_fd));
+			}
+			catch(const std::runtime_error &e) {
+				discard_output(output_fd, job.output.c_str());
+				throw job_error(9, e.what());
+			}
+			catch(...) {
+				close(output_fd);
+				throw;
+			}
+			
+			close(output_fd);
+		
+		}
+		// Encode
+		else {
+			
+			std::fstream input_data_file(job.data, std::ios::in | std::ios::binary);
+			if(!input_data_file.is_open())
+				throw job_error(6, "Unable to open data file for reading.");
+			
+			// Pooled and left uninitialized, since it is read over straight away
+			pixel_buffer input_data_vector(file_size(job.data));
+			if(!input_data_file.read((char *)input_data_vector.data(), input_data_vector.size()))
+				throw job_error(6, "Unable to read data file.");
+			
+			input_data_file.close();
+			
+			if(map_images) {
+				
+				replacement_file output_file(job.output.c_str());
+				bmp_file output_image = bmp_file::map_copy(job.image.c_str(), output_file.path());
+				
+				if(job.bits)
+					hide_data(output_image, std::span<const uint8_t>(input_data_vector), job.bits);
+				else
+					hide_data(output_image, std::span<const uint8_t>(input_data_vector));
+				
+				output_image.sync();
+				output_file.commit();
+			
+			}
+			else
+				pipeline_hide(job.image.c_str(), job.output.c_str(), std::span<const uint8_t>(input_data_vector), job.bits);
+			
+			result.data_bytes = input_data_vector.size();
+		
+		}
+	
+	}
+	catch(const job_error &) {
+		throw;
+	}
+	// Anything else went wrong in reading, encoding/decoding, or writing the image
+	catch(const std::exception &e) {
+		throw job_error(8, e.what());
+	}
+
+}
+
+// Limits the memory taken by the jobs in flight, a job larger than the whole budget runs on its own
+class memory_budget {
+
+public:
+
+	memory_budget(uint64_t limit) : limit(limit) {}
+	
+	void acquire(uint64_t bytes) {
+		
+		std::unique_lock<std::mutex> guard(this->lock);
+		this->released.wait(guard, [this, bytes]() { return !this->in_use || this->in_use + bytes <= this->limit; });
+		
+		this->in_use += bytes;
+	
+	}
+	
+	void release(uint64_t bytes) {
+		
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->in_use -= bytes;
+		}
+		
+		this->released.notify_all();
+	
+	}
+
+private:
+
+	uint64_t limit;
+	uint64_t in_use{0};
+	
+	std::mutex lock;
+	std::condition_variable released;
+
+};
+
+// Per-worker job queues, a worker takes from the back of its own and from the front of the others'
+class job_queues {
+
+public:
+
+	job_queues(size_t job_count, size_t workers) : queues(workers) {
+		
+		// Deal the jobs out in contiguous runs so neighbouring jobs tend to start on the same worker
+		for(size_t job = 0; job < job_count; job++)
+			this->queues[job * workers / job_count].jobs.push_front(job);
+	
+	}
+	
+	bool next(size_t worker, size_t &job) {
+		
+		for(size_t offset = 0; offset < this->queues.size(); offset++) {
+			
+			queue &source = this->queues[(worker + offset) % this->queues.size()];
+			std::lock_guard<std::mutex> guard(source.lock);
+			
+			if(source.jobs.empty())
+				continue;
+			
+			if(!offset) {
+				job = source.jobs.back();
+				source.jobs.pop_back();
+			}
+			else {
+				job = source.jobs.front();
+				source.jobs.pop_front();
+			}
+			
+			return true;
+		
+		}
+		
+		return false;
+	
+	}
+
+private:
+
+	struct queue {
+		std::mutex lock;
+		std::deque<size_t> jobs;
+	};
+	
+	std::vector<queue> queues;
+
+};
+
+std::vector<batch_result> run_batch(const std::vector<batch_job> &jobs, const batch_options &options) {
+	
+	std::vector<batch_result> results(jobs.size());
+	if(jobs.empty())
+		return results;
+	
+	size_t workers = std::min<size_t>(options.workers ? options.workers : get_thread_count(), jobs.size());
+	
+	memory_budget budget(options.memory_limit);
+	job_queues queues(jobs.size(), workers);
+	
+	auto work = [&](size_t worker) {
+		
+		// Jobs are the unit of parallelism here, so each one runs on a single thread
+		serial_scope serial;
+		
+		size_t job;
+		
+		while(queues.next(worker, job)) {
+			
+			// An image is held whole in memory, unless it is pipelined through a few blocks when encoding without mapping
+			uint64_t image_memory = file_size(jobs[job].image);
+			if(!jobs[job].data.empty() && !options.map_images)
+				image_memory = std::min<uint64_t>(image_memory, PIPELINE_DEPTH * PIPELINE_BLOCK_BYTES);
+			
+			uint64_t memory = std::min(image_memory + file_size(jobs[job].data), options.memory_limit);
+			
+			budget.acquire(memory);
+			
+			auto start = std::chrono::steady_clock::now();
+			
+			try {
+				run_job(jobs[job], options.map_images, results[job]);
+			}
+			catch(const job_error &e) {
+				results[job].status = e.status;
+				results[job].error = e.what();
+			}
+			
+			results[job].seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			
+			budget.release(memory);
+		
+		}
+	
+	};
+	
+	std::vector<std::thread> threads;
+	for(size_t worker = 1; worker < workers; worker++)
+		threads.emplace_back(work, worker);
+	
+	work(0);
+	
+	for(std::thread &thread : threads)
+		thread.join();
+	
+	return results;
+
+}
+
+// Throughput in MB/s, 0 when no time was measured
+static double megabytes_per_second(uint64_t bytes, double seconds) {
+	return seconds > 0 ? bytes / seconds / 1e6 : 0;
+}
+
+size_t report_batch(std::ostream &output, const std::vector<batch_job> &jobs, const std::vector<batch_result> &results, double seconds) {
+	
+	size_t failed = 0;
+	uint64_t image_bytes = 0, data_bytes = 0;
+	double job_seconds = 0;
+	
+	output << std::fixed << std::setprecision(3);
+	
+	for(size_t job = 0; job < jobs.size(); job++) {
+		
+		const batch_result &result = results[job];
+		
+		output << "line " << jobs[job].line << ": " << (jobs[job].data.empty() ? "decode " : "encode ") << jobs[job].image << " -> " << jobs[job].output << ": ";
+		
+		if(result.status) {
+			output << "failed (" << result.status << ") " << result.error << '\n';
+			failed++;
+			continue;
+		}
+		
+		output << "ok, " << result.data_bytes << " data bytes, " << result.image_bytes << " image bytes in " << result.seconds << " s (" << megabytes_per_second(result.image_bytes, result.seconds) << " MB/s)\n";
+		
+		image_bytes += result.image_bytes;
+		data_bytes += result.data_bytes;
+		job_seconds += result.seconds;
+	
+	}
+	
+	output << jobs.size() - failed << " of " << jobs.size() << " jobs succeeded, " << data_bytes << " data bytes, " << image_bytes << " image bytes in " << seconds << " s (" << megabytes_per_second(image_bytes, seconds) << " MB/s, " << megabytes_per_second(image_bytes, job_seconds) << " MB/s per job)\n";
+	
+	return failed;
+
+}
\ No newline at end of file
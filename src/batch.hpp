@@ -0,0 +1,72 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/*/
+ *	Batch mode, running many encode/decode jobs in one process
+ *
+ *	Each non-empty line of a job list is one job, written with the same short options as the command line:
+ *		-i <image> [-d <data>] -o <output> [-b <bits>]
+ *	Lines starting with # are ignored, and names containing spaces may be put in double quotes.
+ *	A job without -d decodes its image, one with -d encodes into it.
+ *
+ *	Jobs are spread over a work-stealing pool: every worker starts with its own share of the jobs and takes
+ *	jobs from the others once it runs out. A job only starts once the memory it is expected to need fits
+ *	within the batch's memory budget alongside the jobs already running.
+ *
+/*/
+
+#define BATCH_MEMORY_BYTES (1024ull * 1024 * 1024)
+
+struct batch_job {
+	
+	size_t line{0};
+	
+	std::string image;
+	std::string data;
+	std::string output;
+	uint8_t bits{0};
+	
+	// Set instead of the fields above when the line can't be parsed
+	std::string parse_error;
+
+};
+
+struct batch_result {
+	
+	// 0 on success, otherwise the exit code the single-job command line would have used
+	int32_t status{0};
+	std::string error;
+	
+	// Image bytes and data bytes handled by the job, and the time it took
+	uint64_t image_bytes{0};
+	uint64_t data_bytes{0};
+	double seconds{0};
+
+};
+
+struct batch_options {
+	
+	// Concurrent jobs, 0 selects the number of hardware threads
+	unsigned workers{0};
+	uint64_t memory_limit{BATCH_MEMORY_BYTES};
+	bool map_images{false};
+
+};
+
+// Parse a job list, one job per line
+std::vector<batch_job> read_batch(std::istream &input);
+
+// Run every job, returning one result per job in the same order
+// A failing job is recorded in its result and does not stop the others
+std::vector<batch_result> run_batch(const std::vector<batch_job> &jobs, const batch_options &options = {});
+
+// Print each job's status and throughput followed by the totals, returns the number of failed jobs
+size_t report_batch(std::ostream &output, const std::vector<batch_job> &jobs, const std::vector<batch_result> &results, double seconds);
+
+#endif
\ No newline at end of file
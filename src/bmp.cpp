@@ -1,4 +1,14 @@
+#include <atomic>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
 #include "bmp.hpp"
+#include "parallel.hpp"
+#include "trace.hpp"
 
 /* bmp_file_header */
 
@@ -13,7 +23,7 @@ std::string bmp_file_header::to_string() const {
 	s_str << "Offset at: " << std::hex << this->offset_data << '\n';
 	
 	return s_str.str();
-	
+
 }
 
 /* bmp_info_header */
@@ -35,7 +45,7 @@ std::string bmp_info_header::to_string() const {
 	s_str << "Colors important: " << this->colors_important << '\n';
 	
 	return s_str.str();
-	
+
 }
 
 /* bmp_color_header */
@@ -57,7 +67,7 @@ std::string bmp_color_header::to_string() const {
 	s_str << (uint16_t)this->unused[15] << '\n';
 	
 	return s_str.str();
-	
+
 }
 
 bool bmp_color_header::operator==(const bmp_color_header &color_header) const {
@@ -85,6 +95,7 @@ bmp_file::bmp_file(int32_t bmp_width, int32_t bmp_height, bool has_alpha) {
 	
 	// Set the default size of the info header and the default pixel data offset
 	this->info_header.size = sizeof(bmp_info_header);
+	this->layout = has_alpha ? pixel_format::bgra32 : pixel_format::bgr24;
 	this->file_header.offset_data = sizeof(bmp_file_header) + sizeof(bmp_info_header);
 	
 	// Check if we will be using an alpha channel
@@ -95,30 +106,31 @@ bmp_file::bmp_file(int32_t bmp_width, int32_t bmp_height, bool has_alpha) {
 		this->file_header.offset_data += sizeof(bmp_color_header);
 		
 		// Set our bits per pixel, compression, and row stride accordingly
-		this->info_header.bit_count = 32;
+		this->info_header.bit_count = bgra32_format::bits;
 		this->info_header.compression = 3;
-		this->row_stride = abs_width * 4;
+		this->row_stride = abs_width * bgra32_format::bytes;
 		
 		// Set our data size to the number of bytes needed for each row and our absolute height
-		this->data.resize(this->row_stride * abs_height);
-		
+		// Pixel buffers are left uninitialized, so a new image is explicitly cleared to black
+		this->data.resize((size_t)this->row_stride * abs_height, 0);
+	
 	}
 	else {
 		
-		this->info_header.bit_count = 24;
+		this->info_header.bit_count = bgr24_format::bits;
 		this->info_header.compression = 0;
-		this->row_stride = abs_width * 3;
+		this->row_stride = abs_width * bgr24_format::bytes;
 		
-		this->data.resize(this->row_stride * abs_height);
+		this->data.resize((size_t)this->row_stride * abs_height, 0);
 		
 		// Add padding bytes to our file size based on the height and how many padding bytes are needed for each row
 		this->file_header.file_size += this->info_header.height * (ROUNDUP(this->row_stride, STRIDE_ALIGN) - this->row_stride);
-		
+	
 	}
 	
 	// Add the size of the pixel data and the headers to the file suzem which up to this point was zero or the length of our padding bytes
 	this->file_header.file_size += this->data.size() + this->file_header.offset_data;
-	
+
 }
 
 // Read a BMP file into memory
@@ -126,124 +138,465 @@ bmp_file::bmp_file(const char *read_file) {
 	this->read(read_file);
 }
 
-int8_t bmp_file::read(const char *read_file) {
+bmp_file bmp_file::map(const char *map_file, map_mode mode) {
 	
-	// Attempt to open file for binary reading
-	std::fstream input_file{read_file, std::ios::in | std::ios::binary};
-	if(!input_file.is_open())
-		throw std::runtime_error("Unable to open image file for reading.");
+	// Mapping reads no pixels, so all of it counts as header work
+	trace_span trace(trace_phase::header);
 	
-	// Read the file header, throw an error if the wrong file type is found
-	input_file.read((char *)&this->file_header, sizeof(bmp_file_header));
-	if(this->file_header.file_type != 0x4D42)
+	int fd = open(map_file, mode == map_mode::read_write ? O_RDWR : O_RDONLY);
+	if(fd < 0)
+		throw std::runtime_error("Unable to open image file for mapping.");
+	
+	struct stat file_stat;
+	if(fstat(fd, &file_stat)) {
+		close(fd);
+		throw std::runtime_error("Unable to determine image file size.");
+	}
+	
+	size_t file_size = file_stat.st_size;
+	if(file_size < sizeof(bmp_file_header) + sizeof(bmp_info_header)) {
+		close(fd);
+		throw std::runtime_error("Attempting to read unrecognized file format.");
+	}
+	
+	// Private mappings keep any modifications to this process, shared ones write them back to the file
+	int protection = mode == map_mode::read ? PROT_READ : PROT_READ | PROT_WRITE;
+	int flags = mode == map_mode::read_write ? MAP_SHARED : MAP_PRIVATE;
+	
+	void *map_base = mmap(nullptr, file_size, protection, flags, fd, 0);
+	close(fd);
+	
+	if(map_base == MAP_FAILED)
+		throw std::runtime_error("Unable to map image file.");
+	
+	// From here on the mapping belongs to the image, so it is released if anything below throws
+	bmp_file b_file;
+	b_file.map_base = (uint8_t *)map_base;
+	b_file.map_size = file_size;
+	b_file.mapping = mode;
+	
+	// Pixels are mostly walked front to back
+	madvise(map_base, file_size, MADV_SEQUENTIAL);
+	
+	std::memcpy(&b_file.file_header, b_file.map_base, sizeof(bmp_file_header));
+	if(b_file.file_header.file_type != 0x4D42)
 		throw std::runtime_error("Attempting to read unrecognized file format.");
 	
-	// Read the info header, check if this includes an alpha channel
-	input_file.read((char *)&this->info_header, sizeof(bmp_info_header));
-	if(this->info_header.bit_count == 32) {
+	std::memcpy(&b_file.info_header, b_file.map_base + sizeof(bmp_file_header), sizeof(bmp_info_header));
+	b_file.layout = pixel_format_of(b_file.info_header.bit_count);
+	if(pixel_format_alpha(b_file.layout)) {
 		
-		// Check if the info header size is large enough to contain the info header and color header, throw an error if not
-		if(this->info_header.size < (sizeof(bmp_info_header) + sizeof(bmp_color_header)))
+		if(b_file.info_header.size < (sizeof(bmp_info_header) + sizeof(bmp_color_header)) || file_size < sizeof(bmp_file_header) + sizeof(bmp_info_header) + sizeof(bmp_color_header))
 			throw std::runtime_error("Color header information not found.");
 		
-		// Read the color header, throw an error if it is non-standard (handle differently later)
-		input_file.read((char *)&this->color_header, sizeof(bmp_color_header));
-		if(!standard_color_header())
-			throw std::runtime_error("Non-standard color header information found. This is currently unsupported.");
+		std::memcpy(&b_file.color_header, b_file.map_base + sizeof(bmp_file_header) + sizeof(bmp_info_header), sizeof(bmp_color_header));
+	
+	}
+	
+	uint32_t pixel_offset = b_file.adopt_headers();
+	
+	// Rows in the file keep their padding, the view skips over it
+	b_file.map_stride = ROUNDUP(b_file.row_stride, STRIDE_ALIGN);
+	if(pixel_offset + (size_t)b_file.map_stride * b_file.abs_height() > file_size)
+		throw std::runtime_error("Image file is truncated.");
+	
+	b_file.map_pixels = b_file.map_base + pixel_offset;
+	
+	return b_file;
+
+}
+
+bmp_file bmp_file::open_lazy(const char *read_file) {
+	
+	bmp_file b_file = map(read_file, map_mode::read);
+	
+	// Only the pages actually touched are read, instead of the kernel reading ahead into the pixel rows
+	madvise(b_file.map_base, b_file.map_size, MADV_RANDOM);
+	
+	return b_file;
+
+}
+
+bmp_file bmp_file::map_copy(const char *read_file, const char *write_file) {
+	
+	int input_fd = open(read_file, O_RDONLY);
+	if(input_fd < 0)
+		throw std::runtime_error("Unable to open image file for reading.");
+	
+	struct stat file_stat;
+	if(fstat(input_fd, &file_stat)) {
+		close(input_fd);
+		throw std::runtime_error("Unable to determine image file size.");
+	}
+	
+	// Truncating the output would wipe the input along with it
+	struct stat output_stat;
+	if(!stat(write_file, &output_stat) && output_stat.st_dev == file_stat.st_dev && output_stat.st_ino == file_stat.st_ino) {
+		close(input_fd);
+		return map(write_file, map_mode::read_write);
+	}
+	
+	int output_fd = open(write_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(output_fd < 0) {
+		close(input_fd);
+		throw std::runtime_error("Unable to open file for writing.");
+	}
+	
+	// Let the kernel copy the file so the pixels never pass through user space
+	size_t remaining = file_stat.st_size;
+	{
 		
-		// Discard any additional information that might be in the info header
-		this->info_header.size = sizeof(bmp_info_header) + sizeof(bmp_color_header);
+		trace_span trace(trace_phase::write, file_stat.st_size);
+		
+		while(remaining) {
+			
+			ssize_t copied = copy_file_range(input_fd, nullptr, output_fd, nullptr, remaining, 0);
+			
+			// Fall back to sendfile where copy_file_range isn't supported between these files
+			if(copied <= 0)
+				copied = sendfile(output_fd, input_fd, nullptr, remaining);
+			
+			if(copied <= 0)
+				break;
+			
+			remaining -= copied;
 		
+		}
+	
+	}
+	
+	close(input_fd);
+	close(output_fd);
+	
+	if(remaining)
+		throw std::runtime_error("Unable to copy image file.");
+	
+	return map(write_file, map_mode::read_write);
+
+}
+
+bmp_file::bmp_file(const bmp_file &b_file) :
+	file_header(b_file.file_header), info_header(b_file.info_header), color_header(b_file.color_header), row_stride(b_file.row_stride), layout(b_file.layout) {
+	
+	// A copy of a mapped image gets its own packed pixel buffer
+	if(b_file.mapped()) {
+		this->data.resize(b_file.size());
+		b_file.view().copy_to(0, this->data.size(), this->data.data());
 	}
 	else
-		this->info_header.size = sizeof(bmp_info_header);
+		this->data = b_file.data;
+
+}
+
+bmp_file::bmp_file(bmp_file &&b_file) noexcept :
+	file_header(b_file.file_header), info_header(b_file.info_header), color_header(b_file.color_header),
+	data(std::move(b_file.data)), row_stride(b_file.row_stride), layout(b_file.layout),
+	map_base(b_file.map_base), map_size(b_file.map_size), map_pixels(b_file.map_pixels), map_stride(b_file.map_stride), mapping(b_file.mapping) {
 	
-	// Seek to the pixel data position
-	input_file.seekg(this->file_header.offset_data);
+	b_file.map_base = nullptr;
+	b_file.map_pixels = nullptr;
+
+}
+
+bmp_file &bmp_file::operator=(bmp_file b_file) noexcept {
+	
+	std::swap(this->file_header, b_file.file_header);
+	std::swap(this->info_header, b_file.info_header);
+	std::swap(this->color_header, b_file.color_header);
+	std::swap(this->data, b_file.data);
+	std::swap(this->row_stride, b_file.row_stride);
+	std::swap(this->layout, b_file.layout);
+	std::swap(this->map_base, b_file.map_base);
+	std::swap(this->map_size, b_file.map_size);
+	std::swap(this->map_pixels, b_file.map_pixels);
+	std::swap(this->map_stride, b_file.map_stride);
+	std::swap(this->mapping, b_file.mapping);
+	
+	return *this;
+
+}
+
+bmp_file::~bmp_file() {
+	if(this->map_base)
+		munmap(this->map_base, this->map_size);
+}
+
+// pread/pwrite all of len bytes at offset, retrying short transfers
+static void read_at(int fd, uint8_t *dst, size_t len, off_t offset) {
 	
-	// Adjust the data offset to remove any potential extra data that isn't needed to display the bmp
-	this->file_header.offset_data = sizeof(bmp_file_header) + sizeof(bmp_info_header);
-	if(this->info_header.bit_count == 32) this->file_header.offset_data += sizeof(bmp_color_header);
+	while(len) {
+		
+		ssize_t count = pread(fd, dst, len, offset);
+		if(count < 0 && errno == EINTR)
+			continue;
+		
+		if(count < 0)
+			throw std::runtime_error("Unable to read image file.");
+		if(!count)
+			throw std::runtime_error("Image file is truncated.");
+		
+		dst += count;
+		len -= count;
+		offset += count;
+	
+	}
 
-	// Set the initial size to the data offset, since this covers all of our header sizes
-	this->file_header.file_size = this->file_header.offset_data;
+}
 
-	// Set our pixel data vector size accordingly to fit our number of pixels and channels per pixel
-	this->data.resize(this->info_header.width * this->info_header.height * (this->info_header.bit_count >> 3));
-	// Add the size of the data to our total file size
-	this->file_header.file_size += this->data.size();
+static void write_at(int fd, const uint8_t *src, size_t len, off_t offset) {
 	
-	if(this->info_header.width % 4) {
+	while(len) {
+		
+		ssize_t count = pwrite(fd, src, len, offset);
+		if(count < 0 && errno == EINTR)
+			continue;
 		
-		this->row_stride = this->info_header.width * (this->info_header.bit_count >> 3);
-		uint32_t new_stride = ROUNDUP(this->row_stride, STRIDE_ALIGN);
-		std::vector<uint8_t> padding_row(new_stride - this->row_stride);
+		if(count <= 0)
+			throw std::runtime_error("Unable to write image file.");
 		
-		uint32_t abs_height = std::abs(this->info_header.height);
+		src += count;
+		len -= count;
+		offset += count;
+	
+	}
+
+}
+
+// Split rows of file_stride bytes into bands of about BMP_IO_BAND_BYTES and run band(first_row, row_count) for each,
+// spread over the worker threads
+static void for_each_band(size_t rows, size_t file_stride, const std::function<void(size_t, size_t)> &band) {
+	
+	size_t band_rows = std::max<size_t>(BMP_IO_BAND_BYTES / std::max<size_t>(file_stride, 1), 1);
+	
+	parallel_for((rows + band_rows - 1) / band_rows, [&](size_t index) {
+		size_t first_row = index * band_rows;
+		band(first_row, std::min(band_rows, rows - first_row));
+	});
+
+}
+
+// Staging for a band of padded rows, kept per thread so it is only allocated once
+static uint8_t *band_staging(size_t len) {
+	
+	static thread_local pixel_buffer staging;
+	if(staging.size() < len)
+		staging.resize(len);
+	
+	return staging.data();
+
+}
+
+int8_t bmp_file::read(const char *read_file) {
+	
+	// Attempt to open file for binary reading
+	std::fstream input_file{read_file, std::ios::in | std::ios::binary};
+	if(!input_file.is_open())
+		throw std::runtime_error("Unable to open image file for reading.");
+	
+	// Drop any file this image was previously mapped to
+	if(this->map_base) {
+		munmap(this->map_base, this->map_size);
+		this->map_base = nullptr;
+		this->map_pixels = nullptr;
+	}
+	
+	// Read the headers, leaving the file at the start of the pixel data
+	this->load_headers(input_file);
+	off_t pixel_offset = input_file.tellg();
+	input_file.close();
+	
+	trace_span trace(trace_phase::read, this->size());
+	
+	// Set our pixel data vector size accordingly to fit our number of pixels and channels per pixel
+	// Every byte is read over, so the buffer comes straight from the pool without being zeroed first
+	this->data.resize((size_t)this->row_stride * this->abs_height());
+	
+	// The pixel rows are read a band at a time with one pread each, padded or not
+	int input_fd = open(read_file, O_RDONLY);
+	if(input_fd < 0)
+		throw std::runtime_error("Unable to open image file for reading.");
+	
+	size_t row_bytes = this->row_stride;
+	size_t file_stride = ROUNDUP(row_bytes, STRIDE_ALIGN);
+	
+	try {
 		
-		// Read each row into our data array, skipping any padding
-		for(uint32_t y = 0; y < abs_height; y++) {
+		for_each_band(this->abs_height(), file_stride, [&](size_t first_row, size_t rows) {
 			
-			// Read the actual row data, stopping before the padding
-			input_file.read((char *)(this->data.data() + (y * this->row_stride)), this->row_stride);
+			uint8_t *dst = this->data.data() + first_row * row_bytes;
+			off_t offset = pixel_offset + first_row * file_stride;
 			
-			// The data we read isn't important, just need to skip past the padding
-			input_file.read((char *)padding_row.data(), padding_row.size());
+			if(file_stride == row_bytes) {
+				read_at(input_fd, dst, rows * row_bytes, offset);
+				return;
+			}
 			
-		}
-		
-		// Add the padding to the file size
-		this->file_header.file_size += this->info_header.height * padding_row.size();
+			// Read the band's padding along with its rows, then drop it in memory
+			// The last row's padding isn't needed, so a file missing it still loads
+			uint8_t *staging = band_staging(rows * file_stride);
+			read_at(input_fd, staging, (rows - 1) * file_stride + row_bytes, offset);
+			
+			for(size_t row = 0; row < rows; row++)
+				std::memcpy(dst + row * row_bytes, staging + row * file_stride, row_bytes);
 		
+		});
+	
+	}
+	catch(...) {
+		close(input_fd);
+		throw;
 	}
-	else
-		input_file.read((char *)this->data.data(), this->data.size());
 	
-	return 0;
+	close(input_fd);
 	
+	return 0;
+
 }
 
 int8_t bmp_file::write(const char *write_file) const {
 	
-	std::fstream output_file(write_file, std::ios::out | std::ios::binary | std::ios::trunc);
-	if(!output_file.is_open())
+	trace_span trace(trace_phase::write, this->size());
+	
+	int output_fd = open(write_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(output_fd < 0)
 		throw std::runtime_error("Unable to open file for writing.");
 	
-	// Write headers
-	output_file.write((const char *)&this->file_header, sizeof(bmp_file_header));
-	output_file.write((const char *)&this->info_header, sizeof(bmp_info_header));
-	if(this->info_header.bit_count == 32)
-		output_file.write((const char *)&this->color_header, sizeof(bmp_color_header));
-	else if(this->info_header.bit_count != 24)
-		throw std::runtime_error("Only 24/32 BPP is supported currently.");
+	const_pixel_view pixels = this->view();
 	
-	if(this->info_header.width % 4) {
+	size_t row_bytes = this->row_stride;
+	size_t file_stride = ROUNDUP(row_bytes, STRIDE_ALIGN);
+	
+	try {
 		
-		uint32_t new_stride = ROUNDUP(this->row_stride, STRIDE_ALIGN);
-		std::vector<uint8_t> padding_row(new_stride - this->row_stride);
+		std::ostringstream headers;
+		this->write_headers(headers);
 		
-		uint32_t abs_height = std::abs(this->info_header.height);
+		std::string header_bytes = headers.str();
+		write_at(output_fd, (const uint8_t *)header_bytes.data(), header_bytes.size(), 0);
 		
-		for(uint32_t y = 0; y < abs_height; y++) {
+		// Each band of rows goes out in one pwrite, padded rows being laid out with their padding in memory first
+		for_each_band(this->abs_height(), file_stride, [&](size_t first_row, size_t rows) {
 			
-			// Read the actual row data, stopping before the padding
-			output_file.write((char *)(this->data.data() + (y * this->row_stride)), this->row_stride);
+			off_t offset = header_bytes.size() + first_row * file_stride;
 			
-			// The data we read isn't important, just need to skip past the padding
-			output_file.write((char *)padding_row.data(), padding_row.size());
+			if(file_stride == row_bytes && pixels.contiguous()) {
+				write_at(output_fd, pixels.address(first_row * row_bytes), rows * row_bytes, offset);
+				return;
+			}
 			
-		}
+			uint8_t *staging = band_staging(rows * file_stride);
+			
+			for(size_t row = 0; row < rows; row++) {
+				std::memcpy(staging + row * file_stride, pixels.address((first_row + row) * row_bytes), row_bytes);
+				std::memset(staging + row * file_stride + row_bytes, 0, file_stride - row_bytes);
+			}
+			
+			write_at(output_fd, staging, rows * file_stride, offset);
 		
+		});
+	
 	}
-	else
-		output_file.write((const char *)this->data.data(), this->data.size());
+	catch(...) {
+		close(output_fd);
+		throw;
+	}
+	
+	if(close(output_fd))
+		throw std::runtime_error("Unable to write image file.");
 	
 	return 0;
+
+}
+
+bmp_file bmp_file::read_headers(std::istream &input) {
+	
+	bmp_file b_file;
+	b_file.load_headers(input);
 	
+	return b_file;
+
+}
+
+int8_t bmp_file::write_headers(std::ostream &output) const {
+	
+	output.write((const char *)&this->file_header, sizeof(bmp_file_header));
+	output.write((const char *)&this->info_header, sizeof(bmp_info_header));
+	if(pixel_format_alpha(this->layout))
+		output.write((const char *)&this->color_header, sizeof(bmp_color_header));
+	
+	return 0;
+
+}
+
+int8_t bmp_file::read_rows(std::istream &input, size_t byte_index, size_t len, uint8_t *dst) const {
+	
+	trace_span trace(trace_phase::read, len);
+	
+	uint32_t padding = (STRIDE_ALIGN - this->row_stride % STRIDE_ALIGN) % STRIDE_ALIGN;
+	
+	while(len) {
+		
+		// Read up to the end of the current row
+		size_t segment = std::min<size_t>(len, this->row_stride - byte_index % this->row_stride);
+		
+		if(!input.read((char *)dst, segment))
+			throw std::runtime_error("Image file is truncated.");
+		
+		byte_index += segment;
+		dst += segment;
+		len -= segment;
+		
+		// Skip the padding once a row is finished
+		if(padding && !(byte_index % this->row_stride))
+			input.ignore(padding);
+	
+	}
+	
+	return 0;
+
+}
+
+int8_t bmp_file::write_rows(std::ostream &output, size_t byte_index, size_t len, const uint8_t *src) const {
+	
+	trace_span trace(trace_phase::write, len);
+	
+	static const char padding_bytes[STRIDE_ALIGN] = {0};
+	uint32_t padding = (STRIDE_ALIGN - this->row_stride % STRIDE_ALIGN) % STRIDE_ALIGN;
+	
+	while(len) {
+		
+		size_t segment = std::min<size_t>(len, this->row_stride - byte_index % this->row_stride);
+		
+		output.write((const char *)src, segment);
+		
+		byte_index += segment;
+		src += segment;
+		len -= segment;
+		
+		// Pad every finished row out to the stride alignment
+		if(padding && !(byte_index % this->row_stride))
+			output.write(padding_bytes, padding);
+	
+	}
+	
+	if(!output)
+		throw std::runtime_error("Unable to write image rows.");
+	
+	return 0;
+
+}
+
+int8_t bmp_file::sync() const {
+	
+	if(this->map_base && this->mapping == map_mode::read_write && msync(this->map_base, this->map_size, MS_SYNC))
+		throw std::runtime_error("Unable to write mapped image back to its file.");
+	
+	return 0;
+
 }
 
 size_t bmp_file::size() const {
-	return this->data.size();
+	return (size_t)this->row_stride * this->abs_height();
 }
 
 uint32_t bmp_file::width() const {
@@ -254,44 +607,99 @@ uint32_t bmp_file::height() const {
 	return this->info_header.height;
 }
 
+bool bmp_file::mapped() const {
+	return this->map_base;
+}
+
+size_t bmp_file::file_offset(const uint8_t *pixel) const {
+	
+	if(!this->map_base)
+		throw std::runtime_error("Only the pixels of a mapped image have a file offset.");
+	
+	return pixel - this->map_base;
+
+}
+
+// Loops over many pixels should visit() once and walk the view they are given instead
 pixel bmp_file::get_pixel(uint32_t x, uint32_t y) const {
+	return this->visit([x, y](auto pixels) { return pixels.get_pixel(x, y); });
+}
+
+void bmp_file::set_pixel(uint32_t x, uint32_t y, pixel p) {
+	this->visit([x, y, p](auto pixels) { pixels.set_pixel(x, y, p); });
+}
+
+uint8_t *bmp_file::row(uint32_t y) {
+	return this->view().base + (size_t)y * (this->map_base ? this->map_stride : this->row_stride);
+}
+
+const uint8_t *bmp_file::row(uint32_t y) const {
+	return this->view().base + (size_t)y * (this->map_base ? this->map_stride : this->row_stride);
+}
+
+uint16_t bmp_file::bits_per_pixel() const {
+	return this->info_header.bit_count;
+}
+
+pixel_format bmp_file::format() const {
+	return this->layout;
+}
+
+uint8_t bmp_file::operator[](size_t byte_index) const {
+	return this->view()[byte_index];
+}
+uint8_t &bmp_file::operator[](size_t byte_index) {
+	return this->view()[byte_index];
+}
+
+std::span<uint8_t> bmp_file::pixels() {
 	
-	pixel p;
+	pixel_view pixels = this->view();
+	if(!pixels.contiguous())
+		throw std::runtime_error("Padded rows of a mapped image can only be accessed through view().");
 	
-	if(this->info_header.bit_count == 32) {
-		// Find the (x, y) position in the array by adding x to y * width
-		// Multiply by 4 to account for the color channels
-		// Convert to a uint32_t pointer and dereference to get the ARGB value
-		p.set_argb(*((uint32_t *)&this->data[(x + y * this->info_header.width) * 4]));
-	}
-	else {
-		uint32_t data_position = (x + y * this->info_header.width) * 3;
-		p.set_argb(0, this->data[data_position], this->data[data_position + 1], this->data[data_position + 2]);
-	}
+	return {pixels.base, pixels.size()};
+
+}
+std::span<const uint8_t> bmp_file::pixels() const {
 	
-	return p;
+	const_pixel_view pixels = this->view();
+	if(!pixels.contiguous())
+		throw std::runtime_error("Padded rows of a mapped image can only be accessed through view().");
 	
+	return {pixels.base, pixels.size()};
+
 }
 
-void bmp_file::set_pixel(uint32_t x, uint32_t y, pixel p) {
+pixel_view bmp_file::view() {
+	
+	if(this->map_base) {
+		
+		if(this->mapping == map_mode::read)
+			throw std::runtime_error("Image is mapped read-only.");
+		
+		return {this->map_pixels, this->row_stride, this->map_stride, this->abs_height()};
 	
-	if(this->info_header.bit_count == 32) {
-		*((uint32_t *)&this->data[(x + y * this->info_header.width) * 4]) = p.get_argb();
-	}
-	else {
-		uint32_t data_position = (x + y * this->info_header.width) * 3;
-		this->data[data_position] = p.red();
-		this->data[data_position + 1] = p.green();
-		this->data[data_position + 2] = p.blue();
 	}
 	
+	return std::span<uint8_t>(this->data);
+
+}
+const_pixel_view bmp_file::view() const {
+	
+	if(this->map_base)
+		return {this->map_pixels, this->row_stride, this->map_stride, this->abs_height()};
+	
+	return std::span<const uint8_t>(this->data);
+
 }
 
-uint8_t bmp_file::operator[](uint32_t byte_index) const {
-	return this->data[byte_index];
+pixel_view bmp_file::view(uint8_t channels) {
+	return this->view().select_channels(pixel_format_bytes(this->layout), channels);
 }
-uint8_t &bmp_file::operator[](uint32_t byte_index) {
-	return this->data[byte_index];
+
+const_pixel_view bmp_file::view(uint8_t channels) const {
+	return this->view().select_channels(pixel_format_bytes(this->layout), channels);
 }
 
 std::string bmp_file::to_string() const {
@@ -302,18 +710,158 @@ std::string bmp_file::to_string() const {
 	s_str << this->file_header << '\n';
 	s_str << this->info_header << '\n';
 	
-	if(this->info_header.bit_count == 32)
+	if(pixel_format_alpha(this->layout))
 		s_str << this->color_header << "\n\n";
 	
 	s_str << "Pixel count: " << std::dec << this->info_header.width * this->info_header.height << '\n';
-	s_str << "Data size: " << this->data.size() << '\n';
+	s_str << "Data size: " << this->size() << '\n';
 	s_str << "Row stride: " << this->row_stride << '\n';
 	
 	return s_str.str();
+
+}
+
+// Read and validate the headers, then skip ahead to the pixel data
+// Skipping rather than seeking lets this work on pipes as well as files
+void bmp_file::load_headers(std::istream &input) {
+	
+	trace_span trace(trace_phase::header);
+	
+	// Read the file header, throw an error if the wrong file type is found
+	input.read((char *)&this->file_header, sizeof(bmp_file_header));
+	if(!input || this->file_header.file_type != 0x4D42)
+		throw std::runtime_error("Attempting to read unrecognized file format.");
+	
+	size_t header_bytes = sizeof(bmp_file_header) + sizeof(bmp_info_header);
+	
+	// Read the info header and look up its pixel format once, check if this includes an alpha channel
+	input.read((char *)&this->info_header, sizeof(bmp_info_header));
+	this->layout = pixel_format_of(this->info_header.bit_count);
+	if(pixel_format_alpha(this->layout)) {
+		
+		// Check if the info header size is large enough to contain the info header and color header, throw an error if not
+		if(this->info_header.size < (sizeof(bmp_info_header) + sizeof(bmp_color_header)))
+			throw std::runtime_error("Color header information not found.");
+		
+		input.read((char *)&this->color_header, sizeof(bmp_color_header));
+		header_bytes += sizeof(bmp_color_header);
+	
+	}
+	
+	if(!input)
+		throw std::runtime_error("Image file is truncated.");
+	
+	uint32_t pixel_offset = this->adopt_headers();
+	if(pixel_offset < header_bytes)
+		throw std::runtime_error("Pixel data offset overlaps the image headers.");
+	
+	// Skip any extra header information before the pixel data
+	input.ignore(pixel_offset - header_bytes);
+
+}
+
+// Validate the headers just read from a file and trim them down to what write() produces
+// Returns the offset of the pixel data in the file they were read from
+uint32_t bmp_file::adopt_headers() {
+	
+	bool alpha = pixel_format_alpha(this->layout);
+	if(alpha) {
+		
+		// Throw an error if the color header is non-standard (handle differently later)
+		if(!standard_color_header())
+			throw std::runtime_error("Non-standard color header information found. This is currently unsupported.");
+		
+		// Discard any additional information that might be in the info header
+		this->info_header.size = sizeof(bmp_info_header) + sizeof(bmp_color_header);
+	
+	}
+	else
+		this->info_header.size = sizeof(bmp_info_header);
 	
+	uint32_t pixel_offset = this->file_header.offset_data;
+	
+	// Adjust the data offset to remove any potential extra data that isn't needed to display the bmp
+	this->file_header.offset_data = sizeof(bmp_file_header) + sizeof(bmp_info_header);
+	if(alpha) this->file_header.offset_data += sizeof(bmp_color_header);
+	
+	// Rows are stored without their padding
+	this->row_stride = this->info_header.width * pixel_format_bytes(this->layout);
+	
+	// The file size covers our headers, the pixel data, and the padding written after every row
+	this->file_header.file_size = this->file_header.offset_data + (size_t)ROUNDUP(this->row_stride, STRIDE_ALIGN) * this->abs_height();
+	
+	return pixel_offset;
+
+}
+
+uint32_t bmp_file::abs_height() const {
+	return std::abs(this->info_header.height);
 }
 
 bool bmp_file::standard_color_header() const {
 	bmp_color_header std_color_header;
 	return this->color_header == std_color_header;
+}
+
+/* replacement_file */
+
+replacement_file::replacement_file(const char *path) {
+	
+	char *resolved = realpath(path, nullptr);
+	this->target = resolved ? resolved : path;
+	std::free(resolved);
+	
+	struct stat target_stat;
+	bool replacing = !stat(this->target.c_str(), &target_stat);
+	
+	if(replacing && !S_ISREG(target_stat.st_mode))
+		throw std::runtime_error("Output is not a regular file.");
+	
+	// Named after the process and a counter, so concurrent outputs in one directory never pick the same name
+	static std::atomic<uint64_t> counter{0};
+	
+	do {
+		this->temp = this->target + '.' + std::to_string(getpid()) + '.' + std::to_string(counter++);
+		this->temp_fd = open(this->temp.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	} while(this->temp_fd < 0 && errno == EEXIST);
+	
+	if(this->temp_fd < 0)
+		throw std::runtime_error("Unable to open file for writing.");
+	
+	if(replacing && fchmod(this->temp_fd, target_stat.st_mode & 07777)) {
+		close(this->temp_fd);
+		unlink(this->temp.c_str());
+		throw std::runtime_error("Unable to open file for writing.");
+	}
+
+}
+
+replacement_file::~replacement_file() {
+	
+	if(this->temp_fd >= 0)
+		close(this->temp_fd);
+	
+	if(!this->committed)
+		unlink(this->temp.c_str());
+
+}
+
+int replacement_file::descriptor() const {
+	return this->temp_fd;
+}
+
+const char *replacement_file::path() const {
+	return this->temp.c_str();
+}
+
+void replacement_file::commit() {
+	
+	int closed = close(this->temp_fd);
+	this->temp_fd = -1;
+	
+	if(closed || rename(this->temp.c_str(), this->target.c_str()))
+		throw std::runtime_error("Unable to write image file.");
+	
+	this->committed = true;
+
 }
\ No newline at end of file
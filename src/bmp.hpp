@@ -2,13 +2,20 @@
 #define BMP_HPP
 
 #include <vector>
+#include <algorithm>
+#include <span>
 #include <fstream>
 #include <sstream>
 #include <ostream>
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
+#include <stdexcept>
 
 #include "pixel.hpp"
+#include "pixel_format.hpp"
+#include "convert.hpp"
+#include "buffer_pool.hpp"
 
 /*/
  *	Header file for reading, modifying, and writing bitmap files
@@ -19,6 +26,8 @@
 /*/
 
 #define STRIDE_ALIGN 4
+// Pixel bytes moved per pread/pwrite when reading or writing a whole image, bands of rows are spread over the worker threads
+#define BMP_IO_BAND_BYTES (8 * 1024 * 1024)
 
 // These two macros are taken from JOS from Operating Systems II
 #define ROUNDDOWN(a, n) ({ \
@@ -41,14 +50,14 @@ struct bmp_file_header {
 	uint32_t offset_data{0};	// Start position of pixel data
 	
 	std::string to_string() const;
-	
+
 } __attribute__((packed));
 
 inline std::ostream &operator<<(std::ostream &os, const bmp_file_header &file_header) {
 	
 	os << file_header.to_string();
 	return os;
-	
+
 }
 
 struct bmp_info_header {
@@ -71,14 +80,14 @@ struct bmp_info_header {
 	uint32_t colors_important{0};	// Number of colors used in the bitmap - 0 for all colors required
 	
 	std::string to_string() const;
-	
+
 } __attribute__((packed));
 
 inline std::ostream &operator<<(std::ostream &os, const bmp_info_header &info_header) {
 	
 	os << info_header.to_string();
 	return os;
-	
+
 }
 
 struct bmp_color_header {
@@ -94,19 +103,200 @@ struct bmp_color_header {
 	std::string to_string() const;
 	
 	bool operator==(const bmp_color_header &color_header) const;
-	
+
 } __attribute__((packed));
 
 inline std::ostream &operator<<(std::ostream &os, const bmp_color_header &color_header) {
 	
 	os << color_header.to_string();
 	return os;
-	
+
 }
 
+// Pixel bytes laid out as rows of row_bytes that start row_stride bytes apart
+// Indexing is by unpadded byte position, so a padded image reads the same as a packed one
+// With channels selected only the selected bytes of each pixel are indexed, so they read as a packed run of their own
+template<typename byte_type>
+struct basic_pixel_view {
+	
+	byte_type *base{nullptr};
+	size_t row_bytes{0};
+	size_t row_stride{0};
+	size_t rows{0};
+	
+	// Set by select_channels, 0 channels meaning every byte is indexed
+	uint8_t pixel_bytes{0};
+	uint8_t channel_mask{0};
+	uint8_t channels{0};
+	uint8_t channel_offsets[4]{};
+	
+	basic_pixel_view() = default;
+	basic_pixel_view(byte_type *view_base, size_t view_row_bytes, size_t view_row_stride, size_t view_rows) :
+		base(view_base), row_bytes(view_row_bytes), row_stride(view_row_stride), rows(view_rows) {}
+	
+	// A packed buffer is a single row
+	basic_pixel_view(std::span<byte_type> bytes) : basic_pixel_view(bytes.data(), bytes.size(), bytes.size(), 1) {}
+	
+	// Allow a mutable view to be passed wherever a read-only view is expected
+	operator basic_pixel_view<const byte_type>() const {
+		
+		basic_pixel_view<const byte_type> view(this->base, this->row_bytes, this->row_stride, this->rows);
+		
+		if(this->channels)
+			view = view.select_channels(this->pixel_bytes, this->channel_mask);
+		
+		return view;
+	
+	}
+	
+	// Index only the bytes picked by mask (see convert.hpp) out of each pixel of pixel_bytes bytes
+	// Selecting all of a pixel's bytes, or CHANNELS_ALL, leaves the view as it is. Channels can only be selected once
+	basic_pixel_view select_channels(uint8_t view_pixel_bytes, uint8_t mask) const {
+		
+		if(mask == CHANNELS_ALL)
+			return *this;
+		
+		if((view_pixel_bytes != 3 && view_pixel_bytes != 4) || !mask || mask >> view_pixel_bytes || this->row_bytes % view_pixel_bytes)
+			throw std::runtime_error("The channels selected are not in this image's pixels.");
+		
+		if(this->channels)
+			throw std::runtime_error("Channels have already been selected from this view.");
+		
+		basic_pixel_view view = *this;
+		if(mask == (1 << view_pixel_bytes) - 1)
+			return view;
+		
+		view.pixel_bytes = view_pixel_bytes;
+		view.channel_mask = mask;
+		
+		for(uint8_t byte = 0; byte < view_pixel_bytes; byte++)
+			if(mask >> byte & 1)
+				view.channel_offsets[view.channels++] = byte;
+		
+		return view;
+	
+	}
+	
+	size_t size() const {
+		return this->row_image_bytes() * this->rows;
+	}
+	
+	bool contiguous() const {
+		return !this->channels && (this->row_bytes == this->row_stride || this->rows <= 1);
+	}
+	
+	byte_type *address(size_t byte_index) const {
+		
+		// A selected byte is first found within the unpadded pixel bytes
+		if(this->channels)
+			byte_index = byte_index / this->channels * this->pixel_bytes + this->channel_offsets[byte_index % this->channels];
+		
+		if(this->row_bytes == this->row_stride || this->rows <= 1)
+			return this->base + byte_index;
+		return this->base + (byte_index / this->row_bytes) * this->row_stride + byte_index % this->row_bytes;
+	
+	}
+	
+	byte_type &operator[](size_t byte_index) const {
+		return *this->address(byte_index);
+	}
+	
+	// Copy len bytes starting at byte_index out of the view, one row segment at a time
+	void copy_to(size_t byte_index, size_t len, uint8_t *dst) const {
+		
+		while(len) {
+			
+			size_t segment = std::min(len, this->row_image_bytes() - byte_index % this->row_image_bytes());
+			
+			if(this->channels)
+				this->gather_segment(byte_index, segment, dst);
+			else
+				std::memcpy(dst, this->address(byte_index), segment);
+			
+			byte_index += segment;
+			dst += segment;
+			len -= segment;
+		
+		}
+	
+	}
+	
+	// Copy len bytes into the view starting at byte_index
+	void copy_from(size_t byte_index, size_t len, const uint8_t *src) const {
+		
+		while(len) {
+			
+			size_t segment = std::min(len, this->row_image_bytes() - byte_index % this->row_image_bytes());
+			
+			if(this->channels)
+				this->scatter_segment(byte_index, segment, src);
+			else
+				std::memcpy(this->address(byte_index), src, segment);
+			
+			byte_index += segment;
+			src += segment;
+			len -= segment;
+		
+		}
+	
+	}
+
+private:
+
+	// Indexed bytes in each row
+	size_t row_image_bytes() const {
+		return this->channels ? this->row_bytes / this->pixel_bytes * this->channels : this->row_bytes;
+	}
+	
+	// A segment within one row of a selection may start and end part way through a pixel, those bytes are moved one at
+	// a time and the whole pixels between them by the vector kernels
+	void gather_segment(size_t byte_index, size_t len, uint8_t *dst) const {
+		
+		size_t lead = std::min<size_t>(len, (this->channels - byte_index % this->channels) % this->channels);
+		size_t whole = (len - lead) / this->channels;
+		
+		for(size_t c = 0; c < lead; c++)
+			dst[c] = (*this)[byte_index + c];
+		
+		if(whole)
+			gather_channels(this->address(byte_index + lead) - this->channel_offsets[0], dst + lead, whole, this->pixel_bytes, this->channel_mask);
+		
+		for(size_t c = lead + whole * this->channels; c < len; c++)
+			dst[c] = (*this)[byte_index + c];
+	
+	}
+	
+	void scatter_segment(size_t byte_index, size_t len, const uint8_t *src) const {
+		
+		size_t lead = std::min<size_t>(len, (this->channels - byte_index % this->channels) % this->channels);
+		size_t whole = (len - lead) / this->channels;
+		
+		for(size_t c = 0; c < lead; c++)
+			(*this)[byte_index + c] = src[c];
+		
+		if(whole)
+			scatter_channels(src + lead, this->address(byte_index + lead) - this->channel_offsets[0], whole, this->pixel_bytes, this->channel_mask);
+		
+		for(size_t c = lead + whole * this->channels; c < len; c++)
+			(*this)[byte_index + c] = src[c];
+	
+	}
+
+};
+
+using pixel_view = basic_pixel_view<uint8_t>;
+using const_pixel_view = basic_pixel_view<const uint8_t>;
+
 class bmp_file {
-	
+
 public:
+
+	// How a memory-mapped image may be modified
+	enum class map_mode : uint8_t {
+		read,			// Read-only, pixels must not be modified
+		copy_on_write,	// Modifications stay private to this process and never reach the file
+		read_write		// Modifications are written straight back to the file
+	};
 	
 	// Create BMP of given dimensions
 	bmp_file(int32_t bmp_width, int32_t bmp_height, bool has_alpha = false);
@@ -114,40 +304,177 @@ public:
 	// Read from file
 	bmp_file(const char *read_file);
 	
+	// Map a file into memory instead of reading it, the pixels are used in place without being copied
+	static bmp_file map(const char *map_file, map_mode mode);
+	// Copy a file to a new path and map the copy for writing, so an image can be modified without staging its pixels on the heap
+	// When both paths name the same file there's nothing to copy, and the file itself is mapped for writing
+	static bmp_file map_copy(const char *read_file, const char *write_file);
+	// Open a file reading only its headers, pixel rows are read from the file as they are first touched
+	// Suited to looking at a few pixel bytes of many large images, the file is mapped read-only with read-ahead turned off
+	static bmp_file open_lazy(const char *read_file);
+	
+	bmp_file(const bmp_file &b_file);
+	bmp_file(bmp_file &&b_file) noexcept;
+	bmp_file &operator=(bmp_file b_file) noexcept;
+	~bmp_file();
+	
 	int8_t read(const char *read_file);
 	int8_t write(const char *write_file) const;
 	
+	// Read only the headers from a stream, leaving it positioned at the first pixel row
+	static bmp_file read_headers(std::istream &input);
+	int8_t write_headers(std::ostream &output) const;
+	
+	// Move len unpadded pixel bytes starting at byte_index between a stream and memory, skipping or adding row padding
+	// The stream must already be positioned at byte_index within the pixel rows
+	int8_t read_rows(std::istream &input, size_t byte_index, size_t len, uint8_t *dst) const;
+	int8_t write_rows(std::ostream &output, size_t byte_index, size_t len, const uint8_t *src) const;
+	
+	// Flush modifications of a read/write mapping back to the file
+	int8_t sync() const;
+	
 	size_t size() const;
 	uint32_t width() const;
 	uint32_t height() const;
 	
+	bool mapped() const;
+	// Offset in the file of a pixel byte of a mapped image, given its address in the mapping
+	size_t file_offset(const uint8_t *pixel) const;
+	
 	// Read/write a given pixel
 	pixel get_pixel(uint32_t x, uint32_t y) const;
 	void set_pixel(uint32_t x, uint32_t y, pixel p);
 	
-	uint8_t operator[](uint32_t byte_index) const;
-	uint8_t &operator[](uint32_t byte_index);
+	// Row y of the pixels in the order they are stored (bottom row first for a positive height), honoring any row
+	// padding. Each row is width() pixels of bits_per_pixel() / 8 bytes, see convert.hpp for converting whole rows
+	uint8_t *row(uint32_t y);
+	const uint8_t *row(uint32_t y) const;
+	uint16_t bits_per_pixel() const;
+	
+	// Format of the pixels, picked from the bit count once when the headers are read
+	pixel_format format() const;
+	
+	// The pixels as rows of the given format, throws if it isn't format()
+	template<typename format_traits>
+	image_view<format_traits> pixels_as();
+	template<typename format_traits>
+	const_image_view<format_traits> pixels_as() const;
+	
+	// Call function with the pixels as rows of their own format, so per-pixel loops in it are specialized for that format
+	template<typename function>
+	decltype(auto) visit(function &&call);
+	template<typename function>
+	decltype(auto) visit(function &&call) const;
+	
+	uint8_t operator[](size_t byte_index) const;
+	uint8_t &operator[](size_t byte_index);
+	
+	// Direct access to the unpadded pixel bytes, throws if the pixels are padded rows of a mapped file
+	std::span<uint8_t> pixels();
+	std::span<const uint8_t> pixels() const;
+	
+	// Access to the pixel bytes that honors any row padding
+	pixel_view view();
+	const_pixel_view view() const;
+	// Access to only the channels selected by a mask of CHANNEL_ bits (see convert.hpp), throws if the pixels lack one
+	pixel_view view(uint8_t channels);
+	const_pixel_view view(uint8_t channels) const;
 	
 	std::string to_string() const;
-	
+
 private:
-	
+
 	bmp_file_header file_header;
 	bmp_info_header info_header;
 	bmp_color_header color_header;
 	
-	std::vector<uint8_t> data;
+	pixel_buffer data;
 	uint32_t row_stride{0};
+	pixel_format layout{pixel_format::bgr24};
 	
-	bool standard_color_header() const;
+	// Set when the pixels live in a memory-mapped file rather than in data
+	uint8_t *map_base{nullptr};
+	size_t map_size{0};
+	uint8_t *map_pixels{nullptr};
+	uint32_t map_stride{0};
+	map_mode mapping{map_mode::read};
 	
+	bmp_file() = default;
+	
+	void load_headers(std::istream &input);
+	uint32_t adopt_headers();
+	uint32_t abs_height() const;
+	
+	bool standard_color_header() const;
+
 };
 
+template<typename format_traits>
+image_view<format_traits> bmp_file::pixels_as() {
+	
+	if(format_traits::format != this->layout)
+		throw std::runtime_error("Image pixels are not in the format asked for.");
+	
+	return {this->row(0), this->width(), this->abs_height(), this->map_base ? this->map_stride : this->row_stride};
+
+}
+
+template<typename format_traits>
+const_image_view<format_traits> bmp_file::pixels_as() const {
+	
+	if(format_traits::format != this->layout)
+		throw std::runtime_error("Image pixels are not in the format asked for.");
+	
+	return {this->row(0), this->width(), this->abs_height(), this->map_base ? this->map_stride : this->row_stride};
+
+}
+
+template<typename function>
+decltype(auto) bmp_file::visit(function &&call) {
+	return with_format(this->layout, [this, &call](auto traits) { return call(this->pixels_as<decltype(traits)>()); });
+}
+
+template<typename function>
+decltype(auto) bmp_file::visit(function &&call) const {
+	return with_format(this->layout, [this, &call](auto traits) { return call(this->pixels_as<decltype(traits)>()); });
+}
+
 inline std::ostream &operator<<(std::ostream &os, const bmp_file &b_file) {
 	
 	os << b_file.to_string();
 	return os;
-	
+
 }
 
+// A file written under a temporary name beside the output and renamed over it once complete, so a failure leaves
+// whatever was at the output path as it was. The temporary file takes the mode of the file it replaces, or the one a
+// new file would get, and a symlink at the output path is followed so the file it points to is the one replaced
+class replacement_file {
+
+public:
+
+	// Throws if the temporary file can't be created, or something other than a regular file is at path
+	replacement_file(const char *path);
+	// Removes the temporary file unless it has been committed
+	~replacement_file();
+	
+	replacement_file(const replacement_file &) = delete;
+	replacement_file &operator=(const replacement_file &) = delete;
+	
+	// The temporary file, open for reading and writing, and its path
+	int descriptor() const;
+	const char *path() const;
+	
+	// Close the temporary file and rename it over the output, throws if either fails
+	void commit();
+
+private:
+
+	std::string target;
+	std::string temp;
+	int temp_fd{-1};
+	bool committed{false};
+
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,137 @@
+#include <algorithm>
+#include <bit>
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+#include "buffer_pool.hpp"
+
+buffer_pool &buffer_pool::global() {
+	
+	// Never destroyed, so buffers freed by other static or thread_local objects during exit still have a pool
+	static buffer_pool *pool = new buffer_pool;
+	return *pool;
+
+}
+
+buffer_pool::buffer_pool(uint64_t idle_limit) : idle_limit(idle_limit) {}
+
+buffer_pool::~buffer_pool() {
+	this->trim();
+}
+
+void *buffer_pool::acquire(size_t bytes) {
+	
+	if(bytes < BUFFER_POOL_MIN_BYTES)
+		return this->allocate(bytes);
+	
+	size_t class_bytes = this->size_class(bytes);
+	
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		
+		auto found = this->idle.find(class_bytes);
+		if(found != this->idle.end()) {
+			
+			void *buffer = found->second;
+			this->idle.erase(found);
+			this->idle_total -= class_bytes;
+			
+			return buffer;
+		
+		}
+	}
+	
+	return this->allocate(class_bytes);
+
+}
+
+void buffer_pool::release(void *buffer, size_t bytes) {
+	
+	if(!buffer)
+		return;
+	
+	if(bytes >= BUFFER_POOL_MIN_BYTES) {
+		
+		size_t class_bytes = this->size_class(bytes);
+		
+		std::lock_guard<std::mutex> guard(this->lock);
+		
+		if(this->idle_total + class_bytes <= this->idle_limit) {
+			this->idle.emplace(class_bytes, buffer);
+			this->idle_total += class_bytes;
+			return;
+		}
+	
+	}
+	
+	std::free(buffer);
+
+}
+
+void buffer_pool::set_idle_limit(uint64_t bytes) {
+	
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		this->idle_limit = bytes;
+	}
+	
+	// Buffers over the new limit aren't worth sorting through, so all idle ones go
+	if(this->idle_bytes() > bytes)
+		this->trim();
+
+}
+
+void buffer_pool::set_huge_pages(bool enable) {
+	
+	std::lock_guard<std::mutex> guard(this->lock);
+	this->huge_pages = enable;
+
+}
+
+void buffer_pool::trim() {
+	
+	std::lock_guard<std::mutex> guard(this->lock);
+	
+	for(const auto &[class_bytes, buffer] : this->idle)
+		std::free(buffer);
+	
+	this->idle.clear();
+	this->idle_total = 0;
+
+}
+
+uint64_t buffer_pool::idle_bytes() const {
+	
+	std::lock_guard<std::mutex> guard(this->lock);
+	return this->idle_total;
+
+}
+
+// Round up to the next eighth of a power of two, so no more than an eighth of a buffer goes unused
+size_t buffer_pool::size_class(size_t bytes) const {
+	
+	size_t step = std::max<size_t>(std::bit_floor(bytes) >> 3, 1);
+	return (bytes + step - 1) / step * step;
+
+}
+
+void *buffer_pool::allocate(size_t bytes) const {
+	
+	bool huge = false;
+	{
+		std::lock_guard<std::mutex> guard(this->lock);
+		huge = this->huge_pages && bytes >= BUFFER_HUGE_PAGE_BYTES;
+	}
+	
+	void *buffer = nullptr;
+	if(posix_memalign(&buffer, huge ? BUFFER_HUGE_PAGE_BYTES : BUFFER_ALIGN, bytes ? bytes : 1))
+		throw std::bad_alloc();
+	
+	// Only a hint, the kernel may not have transparent huge pages turned on
+	if(huge)
+		madvise(buffer, bytes / BUFFER_HUGE_PAGE_BYTES * BUFFER_HUGE_PAGE_BYTES, MADV_HUGEPAGE);
+	
+	return buffer;
+
+}
\ No newline at end of file
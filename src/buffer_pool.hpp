@@ -0,0 +1,105 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <type_traits>
+
+/*/
+ *	Pool of large, reusable buffers for pixel data
+ *
+ *	Buffers are BUFFER_ALIGN aligned and left uninitialized. Once freed, buffers of at least BUFFER_POOL_MIN_BYTES
+ *	are kept for the next request of the same size class (sizes are rounded up to an eighth of a power of two), so
+ *	a batch or a long-running process working on images of similar sizes reuses memory that is already faulted in
+ *	instead of mapping and zeroing fresh pages every time. At most the idle limit is kept, anything past it is freed.
+ *
+ *	With huge pages on, buffers of 2 MiB and up are 2 MiB aligned and advised as transparent huge pages.
+ *
+/*/
+
+#define BUFFER_ALIGN 64
+#define BUFFER_POOL_MIN_BYTES (1024 * 1024)
+#define BUFFER_POOL_IDLE_BYTES (256ull * 1024 * 1024)
+#define BUFFER_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+class buffer_pool {
+
+public:
+
+	// Shared by every pixel_buffer
+	static buffer_pool &global();
+	
+	buffer_pool(uint64_t idle_limit = BUFFER_POOL_IDLE_BYTES);
+	~buffer_pool();
+	
+	buffer_pool(const buffer_pool &) = delete;
+	buffer_pool &operator=(const buffer_pool &) = delete;
+	
+	void *acquire(size_t bytes);
+	void release(void *buffer, size_t bytes);
+	
+	// Most bytes kept in idle buffers, 0 frees every buffer as soon as it is released
+	void set_idle_limit(uint64_t bytes);
+	void set_huge_pages(bool enable);
+	
+	// Free every idle buffer
+	void trim();
+	
+	uint64_t idle_bytes() const;
+
+private:
+
+	mutable std::mutex lock;
+	std::multimap<size_t, void *> idle;
+	uint64_t idle_total{0};
+	uint64_t idle_limit;
+	bool huge_pages{false};
+	
+	size_t size_class(size_t bytes) const;
+	void *allocate(size_t bytes) const;
+
+};
+
+// Allocator drawing from the global pool that default-initializes, so resizing a vector leaves the new bytes unset
+template<typename T>
+struct pool_allocator {
+	
+	using value_type = T;
+	
+	pool_allocator() = default;
+	template<typename U>
+	pool_allocator(const pool_allocator<U> &) {}
+	
+	T *allocate(size_t n) {
+		return static_cast<T *>(buffer_pool::global().acquire(n * sizeof(T)));
+	}
+	
+	void deallocate(T *p, size_t n) {
+		buffer_pool::global().release(p, n * sizeof(T));
+	}
+	
+	template<typename U>
+	void construct(U *p) noexcept(std::is_nothrow_default_constructible_v<U>) {
+		::new(static_cast<void *>(p)) U;
+	}
+	
+	template<typename U, typename... Args>
+	void construct(U *p, Args &&...args) {
+		::new(static_cast<void *>(p)) U(std::forward<Args>(args)...);
+	}
+	
+	template<typename U>
+	bool operator==(const pool_allocator<U> &) const {
+		return true;
+	}
+
+};
+
+// Uninitialized, pooled pixel bytes
+using pixel_buffer = std::vector<uint8_t, pool_allocator<uint8_t>>;
+
+#endif
\ No newline at end of file
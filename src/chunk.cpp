@@ -0,0 +1,222 @@
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <immintrin.h>
+#endif
+
+#include "chunk.hpp"
+#include "parallel.hpp"
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLYNOMIAL 0x82F63B78u
+
+static constexpr std::array<uint32_t, 256> make_crc_table() {
+	
+	std::array<uint32_t, 256> table{};
+	
+	for(uint32_t byte = 0; byte < 256; byte++) {
+		
+		uint32_t crc = byte;
+		for(uint8_t bit = 0; bit < 8; bit++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+		
+		table[byte] = crc;
+	
+	}
+	
+	return table;
+
+}
+
+static constexpr std::array<uint32_t, 256> crc_table = make_crc_table();
+
+// Both versions work on the inverted CRC
+static uint32_t crc32c_scalar(const uint8_t *data, size_t len, uint32_t crc) {
+	
+	for(size_t i = 0; i < len; i++)
+		crc = (crc >> 8) ^ crc_table[(crc ^ data[i]) & 0xFF];
+	
+	return crc;
+
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const uint8_t *data, size_t len, uint32_t crc) {
+
+#ifdef __x86_64__
+	uint64_t crc_word = crc;
+	
+	for(; len >= sizeof(uint64_t); len -= sizeof(uint64_t), data += sizeof(uint64_t)) {
+		uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc_word = _mm_crc32_u64(crc_word, word);
+	}
+	
+	crc = crc_word;
+#endif
+
+	for(; len; len--)
+		crc = _mm_crc32_u8(crc, *data++);
+	
+	return crc;
+
+}
+
+// Runs during static initialization, which may come before the CPU model is otherwise set up
+static bool detect_sse42() {
+	
+	__builtin_cpu_init();
+	
+	return __builtin_cpu_supports("sse4.2");
+
+}
+
+static const bool have_sse42 = detect_sse42();
+
+#endif
+
+uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(have_sse42)
+		return ~crc32c_sse42(data, len, ~crc);
+#endif
+
+	return ~crc32c_scalar(data, len, ~crc);
+
+}
+
+uint64_t chunk_framed_size(uint64_t raw_size) {
+	return raw_size + (raw_size + CHUNK_BYTES - 1) / CHUNK_BYTES * CHUNK_CRC_BYTES;
+}
+
+bool chunk_raw_size(uint64_t framed_size, uint64_t &raw_size) {
+	
+	// Every frame but the last is whole, and the last one holds at least one byte along with its CRC
+	uint64_t last_frame = framed_size % CHUNK_FRAME_BYTES;
+	if(last_frame && last_frame <= CHUNK_CRC_BYTES)
+		return false;
+	
+	raw_size = framed_size - (framed_size + CHUNK_FRAME_BYTES - 1) / CHUNK_FRAME_BYTES * CHUNK_CRC_BYTES;
+	
+	return true;
+
+}
+
+static void write_crc(uint8_t *dst, uint32_t crc) {
+	for(uint8_t c = 0; c < CHUNK_CRC_BYTES; c++)
+		dst[c] = crc >> (24 - (c << 3));
+}
+
+static uint32_t read_crc(const uint8_t *src) {
+	return ((uint32_t)src[0] << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+}
+
+std::vector<uint8_t> chunk_frame(std::span<const uint8_t> data) {
+	
+	size_t chunk_count = (data.size() + CHUNK_BYTES - 1) / CHUNK_BYTES;
+	std::vector<uint8_t> framed(chunk_framed_size(data.size()));
+	
+	parallel_for(chunk_count, [&](size_t index) {
+		
+		const uint8_t *chunk = data.data() + index * CHUNK_BYTES;
+		size_t chunk_bytes = std::min<size_t>(CHUNK_BYTES, data.size() - index * CHUNK_BYTES);
+		uint8_t *frame = framed.data() + index * CHUNK_FRAME_BYTES;
+		
+		std::memcpy(frame, chunk, chunk_bytes);
+		write_crc(frame + chunk_bytes, crc32c(chunk, chunk_bytes));
+	
+	});
+	
+	return framed;
+
+}
+
+chunk_decoder::chunk_decoder(std::function<void(const uint8_t *data, size_t len)> sink, uint64_t first_chunk) : sink(std::move(sink)), chunks(first_chunk) {}
+
+void chunk_decoder::feed(const uint8_t *data, size_t len) {
+	
+	// Complete a frame started by an earlier piece
+	if(!this->pending.empty()) {
+		
+		size_t needed = std::min(CHUNK_FRAME_BYTES - this->pending.size(), len);
+		
+		this->pending.insert(this->pending.end(), data, data + needed);
+		data += needed;
+		len -= needed;
+		
+		if(this->pending.size() < CHUNK_FRAME_BYTES)
+			return;
+		
+		this->check(this->pending.data(), 1, CHUNK_FRAME_BYTES);
+		this->pending.clear();
+	
+	}
+	
+	size_t frames = len / CHUNK_FRAME_BYTES;
+	if(frames)
+		this->check(data, frames, CHUNK_FRAME_BYTES);
+	
+	// Whatever is left may be the whole final frame, but that isn't known until the data ends
+	this->pending.assign(data + frames * CHUNK_FRAME_BYTES, data + len);
+
+}
+
+uint64_t chunk_decoder::finish() {
+	
+	if(!this->pending.empty()) {
+		
+		if(this->pending.size() <= CHUNK_CRC_BYTES)
+			throw std::runtime_error("Chunked data is truncated.");
+		
+		this->check(this->pending.data(), 1, this->pending.size());
+		this->pending.clear();
+	
+	}
+	
+	return this->raw_done;
+
+}
+
+void chunk_decoder::check(const uint8_t *frames, size_t count, size_t last_bytes) {
+	
+	auto chunk_bytes = [count, last_bytes](size_t index) {
+		return (index == count - 1 ? last_bytes : CHUNK_FRAME_BYTES) - CHUNK_CRC_BYTES;
+	};
+	
+	std::atomic<size_t> first_bad{count};
+	
+	parallel_for(count, [&](size_t index) {
+		
+		// Nothing after a bad chunk is passed on, so there's no need to check it
+		if(index > first_bad.load(std::memory_order_relaxed))
+			return;
+		
+		const uint8_t *frame = frames + index * CHUNK_FRAME_BYTES;
+		size_t bytes = chunk_bytes(index);
+		
+		if(crc32c(frame, bytes) == read_crc(frame + bytes))
+			return;
+		
+		size_t bad = first_bad.load();
+		while(index < bad && !first_bad.compare_exchange_weak(bad, index));
+	
+	});
+	
+	if(first_bad < count)
+		throw std::runtime_error("Chunk " + std::to_string(this->chunks + first_bad) + " failed its CRC check, the data is corrupt.");
+	
+	for(size_t index = 0; index < count; index++) {
+		this->sink(frames + index * CHUNK_FRAME_BYTES, chunk_bytes(index));
+		this->raw_done += chunk_bytes(index);
+	}
+	
+	this->chunks += count;
+
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef CHUNK_HPP
+#define CHUNK_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <span>
+#include <functional>
+
+/*/
+ *	Chunked framing with a CRC32C per chunk, so corrupted data is caught instead of being passed on
+ *
+ *	Data is split into chunks of CHUNK_BYTES, the last one possibly shorter, and every chunk is followed by the
+ *	CRC32C (Castagnoli) of its bytes, most significant byte first. The framed size alone gives the raw size, and
+ *	chunks don't depend on each other, so a run of them can be checked in parallel.
+ *
+/*/
+
+#define CHUNK_BYTES (64 * 1024)
+#define CHUNK_CRC_BYTES 4
+#define CHUNK_FRAME_BYTES (CHUNK_BYTES + CHUNK_CRC_BYTES)
+
+// CRC32C of data, continuing from the CRC of any data before it, using the SSE4.2 instruction where available
+uint32_t crc32c(const uint8_t *data, size_t len, uint32_t crc = 0);
+
+uint64_t chunk_framed_size(uint64_t raw_size);
+// Raw size of data framed to framed_size bytes, returns false if no raw size frames to that size
+bool chunk_raw_size(uint64_t framed_size, uint64_t &raw_size);
+
+// Split data into chunks, each followed by its CRC
+std::vector<uint8_t> chunk_frame(std::span<const uint8_t> data);
+
+// Checks framed data handed to it in pieces of any size, passing each chunk's bytes on once its CRC matches
+// Every whole chunk in a piece is checked before any of them is passed on, throwing on the first that doesn't match
+class chunk_decoder {
+
+public:
+
+	// Chunks are counted from first_chunk when reporting a bad one, for data picked up part way through
+	chunk_decoder(std::function<void(const uint8_t *data, size_t len)> sink, uint64_t first_chunk = 0);
+	
+	void feed(const uint8_t *data, size_t len);
+	
+	// Checks the final chunk, throws if it is corrupt or the data ended early, returns the raw size
+	uint64_t finish();
+
+private:
+
+	// Check count frames, the last of which is last_bytes long, and pass their chunks on
+	void check(const uint8_t *frames, size_t count, size_t last_bytes);
+	
+	std::function<void(const uint8_t *data, size_t len)> sink;
+	
+	std::vector<uint8_t> pending;
+	
+	uint64_t chunks{0};
+	uint64_t raw_done{0};
+
+};
+
+#endif
\ No newline at end of file
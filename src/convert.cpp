@@ -0,0 +1,563 @@
+#include <array>
+#include <cstring>
+#include <stdexcept>
+
+#include "convert.hpp"
+#include "lsb.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// Spreads 4 packed 3 byte pixels over 4 byte lanes, leaving the top byte of each lane 0
+alignas(16) static constexpr std::array<int8_t, 16> expand_shuffle = {0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1};
+// Packs the bottom 3 bytes of each 4 byte lane into the first 12 bytes
+alignas(16) static constexpr std::array<int8_t, 16> pack_shuffle = {0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1};
+// Gathers each channel of 4 pixels into a 4 byte lane of its own
+alignas(16) static constexpr std::array<int8_t, 16> gather_shuffle = {0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15};
+
+// Shuffles for 16 pixels of 3 channels held in 3 vectors, split[c][v] picks channel c's bytes out of vector v and join[v][c]
+// puts channel c's bytes into vector v, every other byte being 0 so the three results for a vector can be ORed together
+struct planar_shuffles {
+	
+	std::array<std::array<std::array<int8_t, 16>, 3>, 3> split{};
+	std::array<std::array<std::array<int8_t, 16>, 3>, 3> join{};
+	
+	constexpr planar_shuffles() {
+		
+		for(uint8_t channel = 0; channel < 3; channel++) {
+			for(uint8_t vector = 0; vector < 3; vector++) {
+				for(uint8_t c = 0; c < 16; c++) {
+					
+					uint8_t byte = c * 3 + channel;
+					this->split[channel][vector][c] = byte >> 4 == vector ? byte & 15 : -1;
+					
+					byte = (vector << 4) + c;
+					this->join[vector][channel][c] = byte % 3 == channel ? byte / 3 : -1;
+				
+				}
+			}
+		}
+	
+	}
+
+};
+
+alignas(16) static constexpr planar_shuffles rgb_shuffles;
+
+static __m128i load_shuffle(const std::array<int8_t, 16> &shuffle) {
+	return _mm_load_si128((const __m128i *)shuffle.data());
+}
+
+/* SSSE3, each function returns the number of pixels it converted and leaves the rest to the scalar loops */
+
+__attribute__((target("ssse3")))
+static size_t expand_sse(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t alpha) {
+	
+	const __m128i shuffle = load_shuffle(expand_shuffle);
+	const __m128i alpha_bytes = _mm_set1_epi32((uint32_t)alpha << 24);
+	
+	size_t done = 0;
+	
+	// Each iteration reads 16 bytes but only consumes the 12 of 4 pixels, so it stops while 16 are left to read
+	for(; pixels - done >= 6; done += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + done * 3));
+		_mm_storeu_si128((__m128i *)(dst + done * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha_bytes));
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("ssse3")))
+static size_t pack_sse(const uint8_t *src, uint8_t *dst, size_t pixels) {
+	
+	const __m128i shuffle = load_shuffle(pack_shuffle);
+	
+	size_t done = 0;
+	
+	// Each iteration writes 16 bytes but only 12 of them are pixels, the next iteration overwrites the rest
+	for(; pixels - done >= 6; done += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + done * 4));
+		_mm_storeu_si128((__m128i *)(dst + done * 3), _mm_shuffle_epi8(v, shuffle));
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("ssse3")))
+static size_t split_sse(const uint8_t *src, uint8_t *const *planes, size_t pixels, uint8_t channels) {
+	
+	size_t done = 0;
+	
+	if(channels == 3) {
+		
+		for(; pixels - done >= 16; done += 16) {
+			
+			__m128i v[3];
+			for(uint8_t vector = 0; vector < 3; vector++)
+				v[vector] = _mm_loadu_si128((const __m128i *)(src + done * 3) + vector);
+			
+			for(uint8_t channel = 0; channel < 3; channel++) {
+				
+				__m128i plane = _mm_setzero_si128();
+				for(uint8_t vector = 0; vector < 3; vector++)
+					plane = _mm_or_si128(plane, _mm_shuffle_epi8(v[vector], load_shuffle(rgb_shuffles.split[channel][vector])));
+				
+				_mm_storeu_si128((__m128i *)(planes[channel] + done), plane);
+			
+			}
+		
+		}
+		
+		return done;
+	
+	}
+	
+	const __m128i gather = load_shuffle(gather_shuffle);
+	
+	for(; pixels - done >= 16; done += 16) {
+		
+		// Each vector ends up with one channel per 4 byte lane, then a 4x4 transpose lines the lanes up by channel
+		__m128i v[4];
+		for(uint8_t vector = 0; vector < 4; vector++)
+			v[vector] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + done * 4) + vector), gather);
+		
+		__m128i low_01 = _mm_unpacklo_epi32(v[0], v[1]), low_23 = _mm_unpacklo_epi32(v[2], v[3]);
+		__m128i high_01 = _mm_unpackhi_epi32(v[0], v[1]), high_23 = _mm_unpackhi_epi32(v[2], v[3]);
+		
+		_mm_storeu_si128((__m128i *)(planes[0] + done), _mm_unpacklo_epi64(low_01, low_23));
+		_mm_storeu_si128((__m128i *)(planes[1] + done), _mm_unpackhi_epi64(low_01, low_23));
+		_mm_storeu_si128((__m128i *)(planes[2] + done), _mm_unpacklo_epi64(high_01, high_23));
+		_mm_storeu_si128((__m128i *)(planes[3] + done), _mm_unpackhi_epi64(high_01, high_23));
+	
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("ssse3")))
+static size_t join_sse(const uint8_t *const *planes, uint8_t *dst, size_t pixels, uint8_t channels) {
+	
+	size_t done = 0;
+	
+	if(channels == 3) {
+		
+		for(; pixels - done >= 16; done += 16) {
+			
+			__m128i p[3];
+			for(uint8_t channel = 0; channel < 3; channel++)
+				p[channel] = _mm_loadu_si128((const __m128i *)(planes[channel] + done));
+			
+			for(uint8_t vector = 0; vector < 3; vector++) {
+				
+				__m128i v = _mm_setzero_si128();
+				for(uint8_t channel = 0; channel < 3; channel++)
+					v = _mm_or_si128(v, _mm_shuffle_epi8(p[channel], load_shuffle(rgb_shuffles.join[vector][channel])));
+				
+				_mm_storeu_si128((__m128i *)(dst + done * 3) + vector, v);
+			
+			}
+		
+		}
+		
+		return done;
+	
+	}
+	
+	for(; pixels - done >= 16; done += 16) {
+		
+		__m128i p[4];
+		for(uint8_t channel = 0; channel < 4; channel++)
+			p[channel] = _mm_loadu_si128((const __m128i *)(planes[channel] + done));
+		
+		// Interleave channels 0/1 and 2/3 bytewise, then the two results 2 bytes at a time
+		__m128i low_01 = _mm_unpacklo_epi8(p[0], p[1]), low_23 = _mm_unpacklo_epi8(p[2], p[3]);
+		__m128i high_01 = _mm_unpackhi_epi8(p[0], p[1]), high_23 = _mm_unpackhi_epi8(p[2], p[3]);
+		
+		__m128i *out = (__m128i *)(dst + done * 4);
+		_mm_storeu_si128(out, _mm_unpacklo_epi16(low_01, low_23));
+		_mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low_01, low_23));
+		_mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high_01, high_23));
+		_mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high_01, high_23));
+	
+	}
+	
+	return done;
+
+}
+
+/* AVX2, twice the pixels of SSSE3 per iteration */
+
+__attribute__((target("avx2")))
+static size_t expand_avx2(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t alpha) {
+	
+	// Moves pixels 4..7 (bytes 12..23) to the bottom of the upper lane so both lanes shuffle the same way
+	const __m256i spread = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+	const __m256i shuffle = _mm256_broadcastsi128_si256(load_shuffle(expand_shuffle));
+	const __m256i alpha_bytes = _mm256_set1_epi32((uint32_t)alpha << 24);
+	
+	size_t done = 0;
+	
+	// 32 bytes are read for the 24 of 8 pixels
+	for(; pixels - done >= 11; done += 8) {
+		__m256i v = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i *)(src + done * 3)), spread);
+		_mm256_storeu_si256((__m256i *)(dst + done * 4), _mm256_or_si256(_mm256_shuffle_epi8(v, shuffle), alpha_bytes));
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("avx2")))
+static size_t pack_avx2(const uint8_t *src, uint8_t *dst, size_t pixels) {
+	
+	// Closes the gap between the 12 pixel bytes at the bottom of each lane
+	const __m256i close = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+	const __m256i shuffle = _mm256_broadcastsi128_si256(load_shuffle(pack_shuffle));
+	
+	size_t done = 0;
+	
+	// 32 bytes are written for the 24 of 8 pixels
+	for(; pixels - done >= 11; done += 8) {
+		__m256i v = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *)(src + done * 4)), shuffle);
+		_mm256_storeu_si256((__m256i *)(dst + done * 3), _mm256_permutevar8x32_epi32(v, close));
+	}
+	
+	return done;
+
+}
+
+/* Channel selection, 4 pixels per 16 byte lane whether they are 3 or 4 bytes each */
+
+// Shuffles for gathering and scattering the selected bytes of 4 pixels, built for the pixel size and mask in use
+struct channel_shuffles {
+	
+	// Picks the selected bytes of each pixel out of a lane, packed at its bottom
+	alignas(16) std::array<int8_t, 16> gather{};
+	// Spreads packed bytes back out to where they sit in their pixels
+	alignas(16) std::array<int8_t, 16> scatter{};
+	// Set on the pixel bytes taking a packed byte, every other byte of the lane is kept
+	alignas(16) std::array<int8_t, 16> blend{};
+	
+	uint8_t count{0};
+	
+	channel_shuffles(uint8_t pixel_bytes, uint8_t mask) {
+		
+		int8_t packed[4];
+		for(uint8_t byte = 0; byte < 4; byte++)
+			packed[byte] = mask >> byte & 1 ? this->count++ : -1;
+		
+		this->gather.fill(-1);
+		this->scatter.fill(-1);
+		
+		for(uint8_t pixel = 0; pixel < 4; pixel++) {
+			for(uint8_t byte = 0; byte < pixel_bytes; byte++) {
+				
+				if(packed[byte] < 0)
+					continue;
+				
+				uint8_t lane_byte = pixel * pixel_bytes + byte;
+				
+				this->gather[pixel * this->count + packed[byte]] = lane_byte;
+				this->scatter[lane_byte] = pixel * this->count + packed[byte];
+				this->blend[lane_byte] = -1;
+			
+			}
+		}
+	
+	}
+
+};
+
+// Moves the packed bytes at the bottom of the upper lane down next to those of the lower lane
+__attribute__((target("avx2")))
+static __m256i close_lanes(uint8_t count) {
+	
+	alignas(32) int32_t lanes[8] = {0};
+	for(uint8_t dword = 0; dword < count; dword++) {
+		lanes[dword] = dword;
+		lanes[count + dword] = 4 + dword;
+	}
+	
+	return _mm256_load_si256((const __m256i *)lanes);
+
+}
+
+__attribute__((target("ssse3")))
+static size_t gather_sse(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, const channel_shuffles &shuffles) {
+	
+	const __m128i gather = load_shuffle(shuffles.gather);
+	
+	size_t done = 0;
+	
+	// Whole vectors are read and written for the fewer bytes of 4 pixels, so it stops while a vector is left to write
+	for(; (pixels - done) * shuffles.count >= 16; done += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + done * pixel_bytes));
+		_mm_storeu_si128((__m128i *)(dst + done * shuffles.count), _mm_shuffle_epi8(v, gather));
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("sse4.1")))
+static size_t scatter_sse(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, const channel_shuffles &shuffles) {
+	
+	const __m128i scatter = load_shuffle(shuffles.scatter);
+	const __m128i blend = load_shuffle(shuffles.blend);
+	
+	size_t done = 0;
+	
+	// Bytes past the 4 pixels are blended back as they were, so the write never changes a byte it doesn't own
+	for(; (pixels - done) * shuffles.count >= 16; done += 4) {
+		
+		__m128i *out = (__m128i *)(dst + done * pixel_bytes);
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + done * shuffles.count)), scatter);
+		
+		_mm_storeu_si128(out, _mm_blendv_epi8(_mm_loadu_si128(out), v, blend));
+	
+	}
+	
+	return done;
+
+}
+
+// Loads 16 bytes at low into the lower lane and 16 at high into the upper one
+__attribute__((target("avx2")))
+static __m256i load_lanes(const uint8_t *low, const uint8_t *high) {
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)low)), _mm_loadu_si128((const __m128i *)high), 1);
+}
+
+__attribute__((target("avx2")))
+static size_t gather_avx2(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, const channel_shuffles &shuffles) {
+	
+	const __m256i gather = _mm256_broadcastsi128_si256(load_shuffle(shuffles.gather));
+	const __m256i close = close_lanes(shuffles.count);
+	
+	size_t done = 0;
+	
+	for(; (pixels - done) * shuffles.count >= 32; done += 8) {
+		
+		const uint8_t *in = src + done * pixel_bytes;
+		__m256i v = _mm256_shuffle_epi8(load_lanes(in, in + 4 * pixel_bytes), gather);
+		
+		_mm256_storeu_si256((__m256i *)(dst + done * shuffles.count), _mm256_permutevar8x32_epi32(v, close));
+	
+	}
+	
+	return done;
+
+}
+
+__attribute__((target("avx2")))
+static size_t scatter_avx2(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, const channel_shuffles &shuffles) {
+	
+	const __m256i scatter = _mm256_broadcastsi128_si256(load_shuffle(shuffles.scatter));
+	const __m256i blend = _mm256_broadcastsi128_si256(load_shuffle(shuffles.blend));
+	
+	size_t done = 0;
+	
+	for(; (pixels - done) * shuffles.count >= 32; done += 8) {
+		
+		const uint8_t *in = src + done * shuffles.count;
+		uint8_t *out = dst + done * pixel_bytes;
+		
+		__m256i v = _mm256_shuffle_epi8(load_lanes(in, in + 4 * shuffles.count), scatter);
+		v = _mm256_blendv_epi8(load_lanes(out, out + 4 * pixel_bytes), v, blend);
+		
+		// At 3 bytes a pixel the lanes overlap by 4 bytes, the upper lane is stored last so its blended bytes win
+		_mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(out + 4 * pixel_bytes), _mm256_extracti128_si256(v, 1));
+	
+	}
+	
+	return done;
+
+}
+
+#endif
+
+static bool use_sse() {
+#if defined(__x86_64__) || defined(__i386__)
+	return lsb_get_kernel() >= lsb_kernel::sse;
+#else
+	return false;
+#endif
+}
+
+static bool use_avx2() {
+#if defined(__x86_64__) || defined(__i386__)
+	return lsb_get_kernel() >= lsb_kernel::avx2;
+#else
+	return false;
+#endif
+}
+
+static void check_channels(uint8_t channels) {
+	if(channels != 3 && channels != 4)
+		throw std::runtime_error("Only 3 or 4 channel pixels can be converted between interleaved and planar.");
+}
+
+void bgr24_to_bgra32(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t alpha) {
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_avx2())
+		done = expand_avx2(src, dst, pixels, alpha);
+	if(use_sse())
+		done += expand_sse(src + done * 3, dst + done * 4, pixels - done, alpha);
+#endif
+
+	for(; done < pixels; done++) {
+		dst[done * 4] = src[done * 3];
+		dst[done * 4 + 1] = src[done * 3 + 1];
+		dst[done * 4 + 2] = src[done * 3 + 2];
+		dst[done * 4 + 3] = alpha;
+	}
+
+}
+
+void bgra32_to_bgr24(const uint8_t *src, uint8_t *dst, size_t pixels) {
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_avx2())
+		done = pack_avx2(src, dst, pixels);
+	if(use_sse())
+		done += pack_sse(src + done * 4, dst + done * 3, pixels - done);
+#endif
+
+	for(; done < pixels; done++) {
+		dst[done * 3] = src[done * 4];
+		dst[done * 3 + 1] = src[done * 4 + 1];
+		dst[done * 3 + 2] = src[done * 4 + 2];
+	}
+
+}
+
+void interleaved_to_planar(const uint8_t *src, uint8_t *const *planes, size_t pixels, uint8_t channels) {
+	
+	check_channels(channels);
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_sse())
+		done = split_sse(src, planes, pixels, channels);
+#endif
+
+	for(; done < pixels; done++)
+		for(uint8_t channel = 0; channel < channels; channel++)
+			planes[channel][done] = src[done * channels + channel];
+
+}
+
+void planar_to_interleaved(const uint8_t *const *planes, uint8_t *dst, size_t pixels, uint8_t channels) {
+	
+	check_channels(channels);
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_sse())
+		done = join_sse(planes, dst, pixels, channels);
+#endif
+
+	for(; done < pixels; done++)
+		for(uint8_t channel = 0; channel < channels; channel++)
+			dst[done * channels + channel] = planes[channel][done];
+
+}
+
+bool parse_channels(const char *name, uint8_t &mask) {
+	
+	static const char channel_names[] = "bgra";
+	
+	uint8_t parsed = 0;
+	for(; *name; name++) {
+		
+		const char *channel = std::strchr(channel_names, *name);
+		if(!channel)
+			return false;
+		
+		parsed |= 1 << (channel - channel_names);
+	
+	}
+	
+	if(!parsed)
+		return false;
+	
+	mask = parsed;
+	return true;
+
+}
+
+// Pixel offsets of the selected bytes in order, returns how many there are
+static uint8_t selected_offsets(uint8_t pixel_bytes, uint8_t mask, uint8_t offsets[4]) {
+	
+	if((pixel_bytes != 3 && pixel_bytes != 4) || !mask || mask >> pixel_bytes)
+		throw std::runtime_error("Channels can only be selected from the bytes of 3 or 4 byte pixels.");
+	
+	uint8_t count = 0;
+	for(uint8_t byte = 0; byte < pixel_bytes; byte++)
+		if(mask >> byte & 1)
+			offsets[count++] = byte;
+	
+	return count;
+
+}
+
+void gather_channels(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, uint8_t mask) {
+	
+	uint8_t offsets[4];
+	uint8_t count = selected_offsets(pixel_bytes, mask, offsets);
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_sse()) {
+		
+		channel_shuffles shuffles(pixel_bytes, mask);
+		
+		if(use_avx2())
+			done = gather_avx2(src, dst, pixels, pixel_bytes, shuffles);
+		done += gather_sse(src + done * pixel_bytes, dst + done * count, pixels - done, pixel_bytes, shuffles);
+	
+	}
+#endif
+
+	for(; done < pixels; done++)
+		for(uint8_t channel = 0; channel < count; channel++)
+			dst[done * count + channel] = src[done * pixel_bytes + offsets[channel]];
+
+}
+
+void scatter_channels(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, uint8_t mask) {
+	
+	uint8_t offsets[4];
+	uint8_t count = selected_offsets(pixel_bytes, mask, offsets);
+	
+	size_t done = 0;
+
+#if defined(__x86_64__) || defined(__i386__)
+	if(use_sse()) {
+		
+		channel_shuffles shuffles(pixel_bytes, mask);
+		
+		if(use_avx2())
+			done = scatter_avx2(src, dst, pixels, pixel_bytes, shuffles);
+		done += scatter_sse(src + done * count, dst + done * pixel_bytes, pixels - done, pixel_bytes, shuffles);
+	
+	}
+#endif
+
+	for(; done < pixels; done++)
+		for(uint8_t channel = 0; channel < count; channel++)
+			dst[done * pixel_bytes + offsets[channel]] = src[done * count + channel];
+
+}
\ No newline at end of file
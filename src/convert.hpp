@@ -0,0 +1,47 @@
+#ifndef CONVERT_HPP
+#define CONVERT_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+// Bytes of a pixel in the order they are stored, the alpha byte only being present at 32 BPP
+#define CHANNEL_BLUE 0x01
+#define CHANNEL_GREEN 0x02
+#define CHANNEL_RED 0x04
+#define CHANNEL_ALPHA 0x08
+#define CHANNELS_ALL 0x0F
+
+/*/
+ *	Bulk pixel conversions between 24 and 32 BPP and between interleaved and planar channels
+ *
+ *	Each conversion takes a run of pixels of any length at any alignment, such as one row from bmp_file::row() or
+ *	the whole of an unpadded image. Bytes are moved without regard to which channel they hold, so the B, G, R of a
+ *	24 BPP row become the B, G, R of a 32 BPP one. Source and destination must not overlap.
+ *
+ *	Gathering and scattering channels moves only some bytes of each pixel, picked by a mask of CHANNEL_ bits, to and
+ *	from a packed buffer. This is how a pixel view with selected channels (see bmp.hpp) is read and written.
+ *
+ *	The vector versions follow the kernel selected for lsb_encode/lsb_decode (see lsb.hpp): sse uses SSSE3 shuffles
+ *	and avx2 and up use AVX2 ones, pinning the scalar kernel pins these to scalar loops too.
+ *
+/*/
+
+// Expand 3 byte pixels to 4 bytes, setting the fourth byte of each to alpha
+void bgr24_to_bgra32(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t alpha = 0xFF);
+// Drop the fourth byte of each pixel
+void bgra32_to_bgr24(const uint8_t *src, uint8_t *dst, size_t pixels);
+
+// Split pixels of 3 or 4 channels into one plane per channel, channel c going to planes[c]
+void interleaved_to_planar(const uint8_t *src, uint8_t *const *planes, size_t pixels, uint8_t channels);
+// Join one plane per channel back into pixels of 3 or 4 channels
+void planar_to_interleaved(const uint8_t *const *planes, uint8_t *dst, size_t pixels, uint8_t channels);
+
+// Parse a list of channels, such as bgr or b, into a mask of CHANNEL_ bits, returns false if it isn't one
+bool parse_channels(const char *name, uint8_t &mask);
+
+// Copy the bytes selected by mask out of each of pixels pixels of 3 or 4 bytes, packed one after another
+void gather_channels(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, uint8_t mask);
+// Copy packed bytes back into the bytes selected by mask of each pixel, blending them in so the others are kept
+void scatter_channels(const uint8_t *src, uint8_t *dst, size_t pixels, uint8_t pixel_bytes, uint8_t mask);
+
+#endif
\ No newline at end of file
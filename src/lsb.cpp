@@ -0,0 +1,315 @@
+#include <array>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#ifdef __BMI2__
+	#include <immintrin.h>
+#endif
+
+#include "lsb.hpp"
+#include "lsb_simd.hpp"
+
+static inline uint64_t load_word(const uint8_t *src) {
+	uint64_t word;
+	std::memcpy(&word, src, sizeof(word));
+	return word;
+}
+
+static inline void store_word(uint8_t *dst, uint64_t word) {
+	std::memcpy(dst, &word, sizeof(word));
+}
+
+// Word-at-a-time kernels, each group is n stream bytes held in the low 8n bits of a 64-bit word and 8 image bytes
+template<uint8_t bits>
+struct lsb_word_kernel {
+	
+	static constexpr uint64_t bitmask = (1 << bits) - 1;
+	// The lowest n bits of every byte in a word
+	static constexpr uint64_t lane_mask = 0x0101010101010101ULL * bitmask;
+	
+	// Spread 8 fields of n bits across the lowest n bits of each image byte, first field in the first image byte
+	static inline uint64_t deposit(uint64_t word, uint64_t value) {
+	
+	#ifdef __BMI2__
+		// PDEP fills the lowest byte first, so work on the byte-swapped word to put the first field in the first image byte
+		word = __builtin_bswap64(word);
+		word = (word & ~lane_mask) | _pdep_u64(value, lane_mask);
+		return __builtin_bswap64(word);
+	#else
+		word &= ~lane_mask;
+		for(uint8_t c = 0; c < 8; c++)
+			word |= ((value >> (bits * (7 - c))) & bitmask) << (c << 3);
+		return word;
+	#endif
+	
+	}
+	
+	// Collect the lowest n bits of each image byte into 8n contiguous bits, first image byte most significant
+	static inline uint64_t gather(uint64_t word) {
+	
+	#ifdef __BMI2__
+		return _pext_u64(__builtin_bswap64(word), lane_mask);
+	#else
+		uint64_t value = 0;
+		for(uint8_t c = 0; c < 8; c++)
+			value |= ((word >> (c << 3)) & bitmask) << (bits * (7 - c));
+		return value;
+	#endif
+	
+	}
+	
+	static inline uint64_t read_group(const uint8_t *src) {
+		uint64_t value = 0;
+		for(uint8_t c = 0; c < bits; c++)
+			value = (value << 8) | src[c];
+		return value;
+	}
+	
+	static inline void write_group(uint8_t *dst, uint64_t value) {
+		for(uint8_t c = 0; c < bits; c++)
+			dst[c] = value >> ((bits - 1 - c) << 3);
+	}
+	
+	static void encode(uint8_t *cover, const uint8_t *src, size_t len) {
+		
+		size_t groups = len / bits;
+		size_t g = 0;
+		
+		// While a full word can be loaded from the source, read the group big-endian in one go
+		for(; g < groups && len - g * bits >= sizeof(uint64_t); g++)
+			store_word(cover + (g << 3), deposit(load_word(cover + (g << 3)), __builtin_bswap64(load_word(src + g * bits)) >> (64 - (bits << 3))));
+		
+		for(; g < groups; g++)
+			store_word(cover + (g << 3), deposit(load_word(cover + (g << 3)), read_group(src + g * bits)));
+		
+		// Zero-pad a trailing partial group, only touching the image bytes it actually needs
+		size_t remaining = len - groups * bits;
+		if(remaining) {
+			
+			uint8_t data_group[8] = {0};
+			uint8_t cover_group[8] = {0};
+			size_t cover_bytes = lsb_cover_bytes(remaining, bits);
+			
+			std::memcpy(data_group, src + groups * bits, remaining);
+			std::memcpy(cover_group, cover + (groups << 3), cover_bytes);
+			
+			store_word(cover_group, deposit(load_word(cover_group), read_group(data_group)));
+			
+			std::memcpy(cover + (groups << 3), cover_group, cover_bytes);
+		
+		}
+	
+	}
+	
+	static void decode(const uint8_t *cover, uint8_t *dst, size_t len) {
+		
+		size_t groups = len / bits;
+		size_t g = 0;
+		
+		// While a full word can be stored to the destination, write the group big-endian in one go
+		for(; g < groups && len - g * bits >= sizeof(uint64_t); g++)
+			store_word(dst + g * bits, __builtin_bswap64(gather(load_word(cover + (g << 3))) << (64 - (bits << 3))));
+		
+		for(; g < groups; g++)
+			write_group(dst + g * bits, gather(load_word(cover + (g << 3))));
+		
+		size_t remaining = len - groups * bits;
+		if(remaining) {
+			
+			uint8_t data_group[8];
+			uint8_t cover_group[8] = {0};
+			
+			std::memcpy(cover_group, cover + (groups << 3), lsb_cover_bytes(remaining, bits));
+			
+			write_group(data_group, gather(load_word(cover_group)));
+			
+			std::memcpy(dst + groups * bits, data_group, remaining);
+		
+		}
+	
+	}
+
+};
+
+/*/
+ *	Table-driven decoding for 1, 2 and 4 bits
+ *
+ *	When n divides 8, every data byte comes from a whole number of image bytes, so decoding is a lookup of the
+ *	fields held by each pair of image bytes. The tables are built at compile time and live in read-only data.
+ *
+/*/
+
+// Indexed by two image bytes read little-endian, holds their 2n field bits with the first image byte's on top
+template<uint8_t bits>
+static constexpr std::array<uint8_t, 65536> make_pair_table() {
+	
+	std::array<uint8_t, 65536> table{};
+	
+	for(uint32_t pair = 0; pair < table.size(); pair++)
+		table[pair] = ((pair & ((1 << bits) - 1)) << bits) | ((pair >> 8) & ((1 << bits) - 1));
+	
+	return table;
+
+}
+
+template<uint8_t bits>
+struct lsb_table_kernel {
+	
+	static_assert(8 % bits == 0, "Table decoding needs a whole number of image bytes per data byte.");
+	
+	static constexpr std::array<uint8_t, 65536> pair_table = make_pair_table<bits>();
+	
+	static void decode(const uint8_t *cover, uint8_t *dst, size_t len) {
+		
+		for(size_t c = 0; c < len; c++, cover += 8 / bits) {
+			
+			uint8_t byte = 0;
+			
+			// One lookup per pair of image bytes, 4 / n pairs per data byte
+			for(uint8_t p = 0; p < 4 / bits; p++) {
+				
+				uint16_t pair;
+				std::memcpy(&pair, cover + (p << 1), sizeof(pair));
+				
+				byte = (byte << (bits << 1)) | pair_table[pair];
+			
+			}
+			
+			dst[c] = byte;
+		
+		}
+	
+	}
+
+};
+
+static bool kernel_supported(lsb_kernel kernel) {
+
+#if defined(__x86_64__) || defined(__i386__)
+	switch(kernel) {
+		case lsb_kernel::scalar: return true;
+		case lsb_kernel::sse: return __builtin_cpu_supports("sse4.1");
+		case lsb_kernel::avx2: return __builtin_cpu_supports("avx2");
+		case lsb_kernel::avx512: return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+	}
+	return false;
+#else
+	return kernel == lsb_kernel::scalar;
+#endif
+
+}
+
+lsb_kernel lsb_detect_kernel() {
+	
+	for(lsb_kernel kernel : {lsb_kernel::avx512, lsb_kernel::avx2, lsb_kernel::sse})
+		if(kernel_supported(kernel))
+			return kernel;
+	
+	return lsb_kernel::scalar;
+
+}
+
+static lsb_kernel active_kernel = lsb_detect_kernel();
+
+void lsb_set_kernel(lsb_kernel kernel) {
+	
+	if(!kernel_supported(kernel))
+		throw std::runtime_error(std::string("The ") + lsb_kernel_name(kernel) + " kernel is not supported on this CPU.");
+	
+	active_kernel = kernel;
+
+}
+
+lsb_kernel lsb_get_kernel() {
+	return active_kernel;
+}
+
+static const char *kernel_names[] = {"scalar", "sse", "avx2", "avx512"};
+
+const char *lsb_kernel_name(lsb_kernel kernel) {
+	return kernel_names[(uint8_t)kernel];
+}
+
+bool lsb_parse_kernel(const char *name, lsb_kernel &kernel) {
+	
+	for(uint8_t c = 0; c < sizeof(kernel_names) / sizeof(kernel_names[0]); c++) {
+		if(!std::strcmp(name, kernel_names[c])) {
+			kernel = (lsb_kernel)c;
+			return true;
+		}
+	}
+	
+	return false;
+
+}
+
+// Run the active vector kernel over as much of the stream as it can take, returns the stream bytes it handled
+static size_t encode_bulk(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits) {
+	
+	switch(active_kernel) {
+		case lsb_kernel::sse: return lsb_encode_sse(cover, src, len, bits);
+		case lsb_kernel::avx2: return lsb_encode_avx2(cover, src, len, bits);
+		case lsb_kernel::avx512: return lsb_encode_avx512(cover, src, len, bits);
+		default: return 0;
+	}
+
+}
+
+static size_t decode_bulk(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits) {
+	
+	switch(active_kernel) {
+		case lsb_kernel::sse: return lsb_decode_sse(cover, dst, len, bits);
+		case lsb_kernel::avx2: return lsb_decode_avx2(cover, dst, len, bits);
+		case lsb_kernel::avx512: return lsb_decode_avx512(cover, dst, len, bits);
+		default: return 0;
+	}
+
+}
+
+void lsb_encode(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits) {
+	
+	if(!bits || bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	// The vector kernels always stop on a group boundary, so the word kernels can pick up right after them
+	size_t done = encode_bulk(cover, src, len, bits);
+	
+	cover += done / bits * 8;
+	src += done;
+	len -= done;
+	
+	switch(bits) {
+		case 1: lsb_word_kernel<1>::encode(cover, src, len); break;
+		case 2: lsb_word_kernel<2>::encode(cover, src, len); break;
+		case 3: lsb_word_kernel<3>::encode(cover, src, len); break;
+		case 4: lsb_word_kernel<4>::encode(cover, src, len); break;
+		case 5: lsb_word_kernel<5>::encode(cover, src, len); break;
+		case 6: lsb_word_kernel<6>::encode(cover, src, len); break;
+		case 7: lsb_word_kernel<7>::encode(cover, src, len); break;
+	}
+
+}
+
+void lsb_decode(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits) {
+	
+	if(!bits || bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	size_t done = decode_bulk(cover, dst, len, bits);
+	
+	cover += done / bits * 8;
+	dst += done;
+	len -= done;
+	
+	switch(bits) {
+		case 1: lsb_table_kernel<1>::decode(cover, dst, len); break;
+		case 2: lsb_table_kernel<2>::decode(cover, dst, len); break;
+		case 3: lsb_word_kernel<3>::decode(cover, dst, len); break;
+		case 4: lsb_table_kernel<4>::decode(cover, dst, len); break;
+		case 5: lsb_word_kernel<5>::decode(cover, dst, len); break;
+		case 6: lsb_word_kernel<6>::decode(cover, dst, len); break;
+		case 7: lsb_word_kernel<7>::decode(cover, dst, len); break;
+	}
+
+}
@@ -0,0 +1,46 @@
+#ifndef LSB_HPP
+#define LSB_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+/*/
+ *	Bit-packing kernels for moving a byte stream in and out of the n least-significant bits of image bytes
+ *
+ *	The stream is stored most significant bit first, n bits per image byte, so every group of n stream bytes
+ *	maps onto exactly 8 image bytes. Both functions must be started on such a group boundary, and a trailing
+ *	partial group is zero-padded (encode) or truncated (decode).
+ *
+/*/
+
+// Kernel implementations, widest last
+enum class lsb_kernel : uint8_t {
+	scalar,
+	sse,
+	avx2,
+	avx512
+};
+
+// The widest kernel this CPU supports, picked once at startup
+lsb_kernel lsb_detect_kernel();
+
+// Pin the kernel used by lsb_encode/lsb_decode, throws if this CPU doesn't support it
+void lsb_set_kernel(lsb_kernel kernel);
+lsb_kernel lsb_get_kernel();
+
+const char *lsb_kernel_name(lsb_kernel kernel);
+// Parse a kernel name as printed by lsb_kernel_name, returns false if it isn't recognized
+bool lsb_parse_kernel(const char *name, lsb_kernel &kernel);
+
+// Encode len stream bytes into the lowest n bits of the image bytes starting at cover
+void lsb_encode(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits);
+
+// Decode len stream bytes from the lowest n bits of the image bytes starting at cover
+void lsb_decode(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits);
+
+// Image bytes touched by len stream bytes at n bits per image byte
+inline size_t lsb_cover_bytes(size_t len, uint8_t bits) {
+	return ((len << 3) + bits - 1) / bits;
+}
+
+#endif
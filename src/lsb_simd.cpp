@@ -0,0 +1,310 @@
+#include <array>
+
+#include "lsb_simd.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+
+// GCC 12's AVX-512 intrinsics trip these warnings on their own self-initialized placeholder values
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+/*/
+ *	Every 64-bit lane holds one group: n stream bytes on one side, 8 image bytes on the other.
+ *	Encoding splits the group's 8n bits in half three times (64 -> 32 -> 16 -> 8 bit elements) with
+ *	uniform shifts, which leaves one n bit field at the bottom of each byte, first field in the lowest byte.
+ *	Decoding runs the same steps backwards, then a byte shuffle restores the stream's byte order.
+ *
+/*/
+
+template<uint8_t bits>
+struct lsb_simd_constants {
+	
+	static constexpr uint8_t field_mask = (1 << bits) - 1;
+	static constexpr uint16_t pair_mask = (1 << (bits * 2)) - 1;
+	static constexpr uint32_t quad_mask = (1 << (bits * 4)) - 1;
+	static constexpr uint64_t group_mask = (1ULL << (bits * 8)) - 1;
+	
+	// Moves each group's stream bytes into the bottom of its lane, last byte lowest, for two groups per 128 bits
+	static constexpr std::array<int8_t, 16> make_load_shuffle() {
+		
+		std::array<int8_t, 16> shuffle{};
+		
+		for(uint8_t c = 0; c < 16; c++) {
+			uint8_t lane = c >> 3, byte = c & 7;
+			shuffle[c] = byte < bits ? lane * bits + bits - 1 - byte : -1;
+		}
+		
+		return shuffle;
+	
+	}
+	
+	// Packs the bottom of each lane back into 2n contiguous stream bytes, first byte first
+	static constexpr std::array<int8_t, 16> make_store_shuffle() {
+		
+		std::array<int8_t, 16> shuffle{};
+		
+		for(uint8_t c = 0; c < 16; c++)
+			shuffle[c] = c < bits * 2 ? ((c / bits) << 3) + bits - 1 - c % bits : -1;
+		
+		return shuffle;
+	
+	}
+	
+	alignas(16) static constexpr std::array<int8_t, 16> load_shuffle = make_load_shuffle();
+	alignas(16) static constexpr std::array<int8_t, 16> store_shuffle = make_store_shuffle();
+
+};
+
+/* SSE4.1, 16 image bytes per iteration */
+
+template<uint8_t bits>
+__attribute__((target("sse4.1")))
+static size_t encode_sse(uint8_t *cover, const uint8_t *src, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m128i load_shuffle = _mm_load_si128((const __m128i *)k::load_shuffle.data());
+	const __m128i lane_mask = _mm_set1_epi8(k::field_mask);
+	const __m128i field_mask = _mm_set1_epi16(k::field_mask);
+	const __m128i pair_mask = _mm_set1_epi32(k::pair_mask);
+	const __m128i quad_mask = _mm_set1_epi64x(k::quad_mask);
+	
+	size_t done = 0;
+	
+	// Each iteration reads a full 16 bytes of stream data but only consumes 2n of them
+	for(; len - done >= 16; done += bits * 2, cover += 16) {
+		
+		__m128i v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + done)), load_shuffle);
+		
+		v = _mm_or_si128(_mm_srli_epi64(v, bits * 4), _mm_slli_epi64(_mm_and_si128(v, quad_mask), 32));
+		v = _mm_or_si128(_mm_srli_epi32(v, bits * 2), _mm_slli_epi32(_mm_and_si128(v, pair_mask), 16));
+		v = _mm_or_si128(_mm_srli_epi16(v, bits), _mm_slli_epi16(_mm_and_si128(v, field_mask), 8));
+		
+		__m128i c = _mm_loadu_si128((const __m128i *)cover);
+		_mm_storeu_si128((__m128i *)cover, _mm_or_si128(_mm_andnot_si128(lane_mask, c), v));
+	
+	}
+	
+	return done;
+
+}
+
+template<uint8_t bits>
+__attribute__((target("sse4.1")))
+static size_t decode_sse(const uint8_t *cover, uint8_t *dst, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m128i store_shuffle = _mm_load_si128((const __m128i *)k::store_shuffle.data());
+	const __m128i lane_mask = _mm_set1_epi8(k::field_mask);
+	const __m128i pair_mask = _mm_set1_epi16(k::pair_mask);
+	const __m128i quad_mask = _mm_set1_epi32(k::quad_mask);
+	const __m128i group_mask = _mm_set1_epi64x(k::group_mask);
+	
+	size_t done = 0;
+	
+	// Each iteration writes a full 16 bytes of stream data, the next iteration overwrites everything past 2n
+	for(; len - done >= 16; done += bits * 2, cover += 16) {
+		
+		__m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i *)cover), lane_mask);
+		
+		v = _mm_and_si128(_mm_or_si128(_mm_slli_epi16(v, bits), _mm_srli_epi16(v, 8)), pair_mask);
+		v = _mm_and_si128(_mm_or_si128(_mm_slli_epi32(v, bits * 2), _mm_srli_epi32(v, 16)), quad_mask);
+		v = _mm_and_si128(_mm_or_si128(_mm_slli_epi64(v, bits * 4), _mm_srli_epi64(v, 32)), group_mask);
+		
+		_mm_storeu_si128((__m128i *)(dst + done), _mm_shuffle_epi8(v, store_shuffle));
+	
+	}
+	
+	return done;
+
+}
+
+/* AVX2, 32 image bytes per iteration */
+
+template<uint8_t bits>
+__attribute__((target("avx2")))
+static size_t encode_avx2(uint8_t *cover, const uint8_t *src, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m256i load_shuffle = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)k::load_shuffle.data()));
+	const __m256i lane_mask = _mm256_set1_epi8(k::field_mask);
+	const __m256i field_mask = _mm256_set1_epi16(k::field_mask);
+	const __m256i pair_mask = _mm256_set1_epi32(k::pair_mask);
+	const __m256i quad_mask = _mm256_set1_epi64x(k::quad_mask);
+	
+	size_t done = 0;
+	
+	// The upper 128 bits hold groups 2 and 3, loaded from their own offset since shuffles can't cross halves
+	for(; len - done >= bits * 2 + 16; done += bits * 4, cover += 32) {
+		
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(src + done))), _mm_loadu_si128((const __m128i *)(src + done + bits * 2)), 1);
+		v = _mm256_shuffle_epi8(v, load_shuffle);
+		
+		v = _mm256_or_si256(_mm256_srli_epi64(v, bits * 4), _mm256_slli_epi64(_mm256_and_si256(v, quad_mask), 32));
+		v = _mm256_or_si256(_mm256_srli_epi32(v, bits * 2), _mm256_slli_epi32(_mm256_and_si256(v, pair_mask), 16));
+		v = _mm256_or_si256(_mm256_srli_epi16(v, bits), _mm256_slli_epi16(_mm256_and_si256(v, field_mask), 8));
+		
+		__m256i c = _mm256_loadu_si256((const __m256i *)cover);
+		_mm256_storeu_si256((__m256i *)cover, _mm256_or_si256(_mm256_andnot_si256(lane_mask, c), v));
+	
+	}
+	
+	return done;
+
+}
+
+template<uint8_t bits>
+__attribute__((target("avx2")))
+static size_t decode_avx2(const uint8_t *cover, uint8_t *dst, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m256i store_shuffle = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)k::store_shuffle.data()));
+	const __m256i lane_mask = _mm256_set1_epi8(k::field_mask);
+	const __m256i pair_mask = _mm256_set1_epi16(k::pair_mask);
+	const __m256i quad_mask = _mm256_set1_epi32(k::quad_mask);
+	const __m256i group_mask = _mm256_set1_epi64x(k::group_mask);
+	
+	size_t done = 0;
+	
+	for(; len - done >= bits * 2 + 16; done += bits * 4, cover += 32) {
+		
+		__m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)cover), lane_mask);
+		
+		v = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi16(v, bits), _mm256_srli_epi16(v, 8)), pair_mask);
+		v = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi32(v, bits * 2), _mm256_srli_epi32(v, 16)), quad_mask);
+		v = _mm256_and_si256(_mm256_or_si256(_mm256_slli_epi64(v, bits * 4), _mm256_srli_epi64(v, 32)), group_mask);
+		
+		v = _mm256_shuffle_epi8(v, store_shuffle);
+		
+		// Store the lower half first so the upper half overwrites its unused tail
+		_mm_storeu_si128((__m128i *)(dst + done), _mm256_castsi256_si128(v));
+		_mm_storeu_si128((__m128i *)(dst + done + bits * 2), _mm256_extracti128_si256(v, 1));
+	
+	}
+	
+	return done;
+
+}
+
+/* AVX-512BW, 64 image bytes per iteration */
+
+template<uint8_t bits>
+__attribute__((target("avx512f,avx512bw")))
+static size_t encode_avx512(uint8_t *cover, const uint8_t *src, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m512i load_shuffle = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)k::load_shuffle.data()));
+	const __m512i lane_mask = _mm512_set1_epi8(k::field_mask);
+	const __m512i field_mask = _mm512_set1_epi16(k::field_mask);
+	const __m512i pair_mask = _mm512_set1_epi32(k::pair_mask);
+	const __m512i quad_mask = _mm512_set1_epi64(k::quad_mask);
+	
+	size_t done = 0;
+	
+	for(; len - done >= bits * 6 + 16; done += bits * 8, cover += 64) {
+		
+		__m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)(src + done)));
+		v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(src + done + bits * 2)), 1);
+		v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(src + done + bits * 4)), 2);
+		v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)(src + done + bits * 6)), 3);
+		v = _mm512_shuffle_epi8(v, load_shuffle);
+		
+		v = _mm512_or_si512(_mm512_srli_epi64(v, bits * 4), _mm512_slli_epi64(_mm512_and_si512(v, quad_mask), 32));
+		v = _mm512_or_si512(_mm512_srli_epi32(v, bits * 2), _mm512_slli_epi32(_mm512_and_si512(v, pair_mask), 16));
+		v = _mm512_or_si512(_mm512_srli_epi16(v, bits), _mm512_slli_epi16(_mm512_and_si512(v, field_mask), 8));
+		
+		__m512i c = _mm512_loadu_si512(cover);
+		_mm512_storeu_si512(cover, _mm512_ternarylogic_epi32(lane_mask, c, v, 0xAE));
+	
+	}
+	
+	return done;
+
+}
+
+template<uint8_t bits>
+__attribute__((target("avx512f,avx512bw")))
+static size_t decode_avx512(const uint8_t *cover, uint8_t *dst, size_t len) {
+	
+	using k = lsb_simd_constants<bits>;
+	
+	const __m512i store_shuffle = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *)k::store_shuffle.data()));
+	const __m512i lane_mask = _mm512_set1_epi8(k::field_mask);
+	const __m512i pair_mask = _mm512_set1_epi16(k::pair_mask);
+	const __m512i quad_mask = _mm512_set1_epi32(k::quad_mask);
+	const __m512i group_mask = _mm512_set1_epi64(k::group_mask);
+	
+	size_t done = 0;
+	
+	for(; len - done >= bits * 6 + 16; done += bits * 8, cover += 64) {
+		
+		__m512i v = _mm512_and_si512(_mm512_loadu_si512(cover), lane_mask);
+		
+		v = _mm512_and_si512(_mm512_or_si512(_mm512_slli_epi16(v, bits), _mm512_srli_epi16(v, 8)), pair_mask);
+		v = _mm512_and_si512(_mm512_or_si512(_mm512_slli_epi32(v, bits * 2), _mm512_srli_epi32(v, 16)), quad_mask);
+		v = _mm512_and_si512(_mm512_or_si512(_mm512_slli_epi64(v, bits * 4), _mm512_srli_epi64(v, 32)), group_mask);
+		
+		v = _mm512_shuffle_epi8(v, store_shuffle);
+		
+		_mm_storeu_si128((__m128i *)(dst + done), _mm512_castsi512_si128(v));
+		_mm_storeu_si128((__m128i *)(dst + done + bits * 2), _mm512_extracti32x4_epi32(v, 1));
+		_mm_storeu_si128((__m128i *)(dst + done + bits * 4), _mm512_extracti32x4_epi32(v, 2));
+		_mm_storeu_si128((__m128i *)(dst + done + bits * 6), _mm512_extracti32x4_epi32(v, 3));
+	
+	}
+	
+	return done;
+
+}
+
+// Send the bit count to the matching instantiation of a bulk loop
+#define LSB_SIMD_DISPATCH(fn, ...) \
+	switch(bits) { \
+		case 1: return fn<1>(__VA_ARGS__); \
+		case 2: return fn<2>(__VA_ARGS__); \
+		case 3: return fn<3>(__VA_ARGS__); \
+		case 4: return fn<4>(__VA_ARGS__); \
+		case 5: return fn<5>(__VA_ARGS__); \
+		case 6: return fn<6>(__VA_ARGS__); \
+		case 7: return fn<7>(__VA_ARGS__); \
+		default: return 0; \
+	}
+
+size_t lsb_encode_sse(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(encode_sse, cover, src, len)
+}
+size_t lsb_decode_sse(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(decode_sse, cover, dst, len)
+}
+
+size_t lsb_encode_avx2(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(encode_avx2, cover, src, len)
+}
+size_t lsb_decode_avx2(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(decode_avx2, cover, dst, len)
+}
+
+size_t lsb_encode_avx512(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(encode_avx512, cover, src, len)
+}
+size_t lsb_decode_avx512(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits) {
+	LSB_SIMD_DISPATCH(decode_avx512, cover, dst, len)
+}
+
+#else
+
+// No vector kernels outside of x86, everything is left to the word kernels
+size_t lsb_encode_sse(uint8_t *, const uint8_t *, size_t, uint8_t) {return 0;}
+size_t lsb_decode_sse(const uint8_t *, uint8_t *, size_t, uint8_t) {return 0;}
+size_t lsb_encode_avx2(uint8_t *, const uint8_t *, size_t, uint8_t) {return 0;}
+size_t lsb_decode_avx2(const uint8_t *, uint8_t *, size_t, uint8_t) {return 0;}
+size_t lsb_encode_avx512(uint8_t *, const uint8_t *, size_t, uint8_t) {return 0;}
+size_t lsb_decode_avx512(const uint8_t *, uint8_t *, size_t, uint8_t) {return 0;}
+
+#endif
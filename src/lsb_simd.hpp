@@ -0,0 +1,25 @@
+#ifndef LSB_SIMD_HPP
+#define LSB_SIMD_HPP
+
+#include <cstdint>
+#include <cstddef>
+
+/*/
+ *	Vectorized bulk loops behind lsb_encode/lsb_decode
+ *
+ *	Each function handles as many whole vectors as it can without reading or writing past the end of the
+ *	stream and returns the number of stream bytes it processed, always a whole number of groups. The caller
+ *	finishes the rest with the word kernels.
+ *
+/*/
+
+size_t lsb_encode_sse(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits);
+size_t lsb_decode_sse(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits);
+
+size_t lsb_encode_avx2(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits);
+size_t lsb_decode_avx2(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits);
+
+size_t lsb_encode_avx512(uint8_t *cover, const uint8_t *src, size_t len, uint8_t bits);
+size_t lsb_decode_avx512(const uint8_t *cover, uint8_t *dst, size_t len, uint8_t bits);
+
+#endif
@@ -0,0 +1,426 @@
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+
+#include "lz.hpp"
+#include "parallel.hpp"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+// Candidates compared per position at the max level
+#define LZ_MAX_CHAIN 256
+
+// Largest compressed block, if it would be any larger the block is stored instead
+#define LZ_BLOCK_BOUND (LZ_BLOCK_BYTES + LZ_BLOCK_BYTES / 255 + 16)
+
+static const char *level_names[] = {"none", "fast", "max"};
+
+const char *lz_level_name(lz_level level) {
+	return level_names[(uint8_t)level];
+}
+
+bool lz_parse_level(const char *name, lz_level &level) {
+	
+	for(uint8_t c = 0; c < sizeof(level_names) / sizeof(level_names[0]); c++) {
+		if(!std::strcmp(name, level_names[c])) {
+			level = (lz_level)c;
+			return true;
+		}
+	}
+	
+	return false;
+
+}
+
+static uint32_t read32(const uint8_t *src) {
+	
+	uint32_t value;
+	std::memcpy(&value, src, sizeof(value));
+	
+	return value;
+
+}
+
+static uint32_t hash4(const uint8_t *src, uint8_t hash_bits) {
+	return (read32(src) * 2654435761u) >> (32 - hash_bits);
+}
+
+// Number of bytes at b matching those at a, without reading past end
+static size_t match_length(const uint8_t *a, const uint8_t *b, const uint8_t *end) {
+	
+	const uint8_t *start = b;
+	
+	while(b + sizeof(uint64_t) <= end) {
+		
+		uint64_t a_word, b_word;
+		std::memcpy(&a_word, a, sizeof(a_word));
+		std::memcpy(&b_word, b, sizeof(b_word));
+		
+		if(a_word != b_word)
+			return b - start + (__builtin_ctzll(a_word ^ b_word) >> 3);
+		
+		a += sizeof(uint64_t);
+		b += sizeof(uint64_t);
+	
+	}
+	
+	while(b < end && *a == *b) {
+		a++;
+		b++;
+	}
+	
+	return b - start;
+
+}
+
+// Lengths of 15 or more carry on in extra bytes of 255, ending with a byte below 255
+static uint8_t *write_length(uint8_t *dst, size_t len) {
+	
+	for(; len >= 255; len -= 255)
+		*dst++ = 255;
+	
+	*dst++ = len;
+	
+	return dst;
+
+}
+
+// Write one sequence, a match length of 0 writes the literals-only sequence ending a block
+static uint8_t *write_sequence(uint8_t *dst, const uint8_t *literals, size_t literal_len, size_t offset, size_t match_len) {
+	
+	uint8_t *token = dst++;
+	
+	*token = std::min<size_t>(literal_len, 15) << 4;
+	if(literal_len >= 15)
+		dst = write_length(dst, literal_len - 15);
+	
+	std::memcpy(dst, literals, literal_len);
+	dst += literal_len;
+	
+	if(match_len) {
+		
+		*dst++ = offset & 0xFF;
+		*dst++ = offset >> 8;
+		
+		match_len -= LZ_MIN_MATCH;
+		
+		*token |= std::min<size_t>(match_len, 15);
+		if(match_len >= 15)
+			dst = write_length(dst, match_len - 15);
+	
+	}
+	
+	return dst;
+
+}
+
+// Greedy matching against the last position seen with the same hash, skipping ahead faster the longer nothing matches
+static uint8_t *compress_fast(const uint8_t *src, size_t len, uint8_t *dst) {
+	
+	const uint8_t hash_bits = 14;
+	std::vector<int32_t> head(1 << hash_bits, -1);
+	
+	size_t anchor = 0, position = 0;
+	uint32_t misses = 0;
+	
+	while(position + LZ_MIN_MATCH <= len) {
+		
+		uint32_t hash = hash4(src + position, hash_bits);
+		int32_t candidate = head[hash];
+		head[hash] = position;
+		
+		if(candidate < 0 || position - candidate > LZ_MAX_OFFSET || read32(src + candidate) != read32(src + position)) {
+			position += 1 + (misses++ >> 5);
+			continue;
+		}
+		
+		size_t match_len = LZ_MIN_MATCH + match_length(src + candidate + LZ_MIN_MATCH, src + position + LZ_MIN_MATCH, src + len);
+		
+		// Take back any literals that are also part of the match
+		while(position > anchor && candidate > 0 && src[position - 1] == src[candidate - 1]) {
+			position--;
+			candidate--;
+			match_len++;
+		}
+		
+		dst = write_sequence(dst, src + anchor, position - anchor, position - candidate, match_len);
+		
+		position += match_len;
+		anchor = position;
+		misses = 0;
+	
+	}
+	
+	return write_sequence(dst, src + anchor, len - anchor, 0, 0);
+
+}
+
+// Hash chains searched for the longest match, deferring a match whenever the next position has a longer one
+static uint8_t *compress_max(const uint8_t *src, size_t len, uint8_t *dst) {
+	
+	const uint8_t hash_bits = 16;
+	std::vector<int32_t> head(1 << hash_bits, -1);
+	std::vector<int32_t> chain(len);
+	
+	size_t anchor = 0, position = 0, inserted = 0;
+	
+	// Longest match for the bytes at target among everything before it
+	auto longest = [&](size_t target, size_t &offset) {
+		
+		for(; inserted < target; inserted++) {
+			uint32_t hash = hash4(src + inserted, hash_bits);
+			chain[inserted] = head[hash];
+			head[hash] = inserted;
+		}
+		
+		size_t best = 0;
+		int32_t candidate = head[hash4(src + target, hash_bits)];
+		
+		for(uint32_t depth = 0; candidate >= 0 && target - candidate <= LZ_MAX_OFFSET && depth < LZ_MAX_CHAIN; candidate = chain[candidate], depth++) {
+			
+			if(read32(src + candidate) != read32(src + target))
+				continue;
+			
+			size_t match_len = LZ_MIN_MATCH + match_length(src + candidate + LZ_MIN_MATCH, src + target + LZ_MIN_MATCH, src + len);
+			if(match_len > best) {
+				best = match_len;
+				offset = target - candidate;
+			}
+		
+		}
+		
+		return best;
+	
+	};
+	
+	while(position + LZ_MIN_MATCH <= len) {
+		
+		size_t offset = 0;
+		size_t match_len = longest(position, offset);
+		
+		if(match_len < LZ_MIN_MATCH) {
+			position++;
+			continue;
+		}
+		
+		// Move up a byte as long as that finds a longer match
+		while(position + 1 + LZ_MIN_MATCH <= len) {
+			
+			size_t next_offset = 0;
+			size_t next_len = longest(position + 1, next_offset);
+			
+			if(next_len <= match_len)
+				break;
+			
+			position++;
+			match_len = next_len;
+			offset = next_offset;
+		
+		}
+		
+		dst = write_sequence(dst, src + anchor, position - anchor, offset, match_len);
+		
+		position += match_len;
+		anchor = position;
+	
+	}
+	
+	return write_sequence(dst, src + anchor, len - anchor, 0, 0);
+
+}
+
+static void decompress_block(const uint8_t *src, size_t len, uint8_t *dst, size_t raw_len) {
+	
+	const uint8_t *end = src + len;
+	uint8_t *output = dst;
+	uint8_t *output_end = dst + raw_len;
+	
+	auto read_length = [&](size_t len) {
+		
+		if(len != 15)
+			return len;
+		
+		uint8_t extra;
+		do {
+			if(src >= end)
+				throw std::runtime_error("Compressed data is corrupt.");
+			extra = *src++;
+			len += extra;
+		} while(extra == 255);
+		
+		return len;
+	
+	};
+	
+	while(true) {
+		
+		if(src >= end)
+			throw std::runtime_error("Compressed data is corrupt.");
+		
+		uint8_t token = *src++;
+		
+		size_t literal_len = read_length(token >> 4);
+		if(literal_len > (size_t)(end - src) || literal_len > (size_t)(output_end - output))
+			throw std::runtime_error("Compressed data is corrupt.");
+		
+		std::memcpy(output, src, literal_len);
+		output += literal_len;
+		src += literal_len;
+		
+		if(src == end)
+			break;
+		
+		if(end - src < 2)
+			throw std::runtime_error("Compressed data is corrupt.");
+		
+		size_t offset = src[0] | (src[1] << 8);
+		src += 2;
+		
+		size_t match_len = read_length(token & 15) + LZ_MIN_MATCH;
+		if(!offset || offset > (size_t)(output - dst) || match_len > (size_t)(output_end - output))
+			throw std::runtime_error("Compressed data is corrupt.");
+		
+		// Matches closer than their length repeat themselves, so they have to be copied front to back
+		const uint8_t *match = output - offset;
+		if(offset >= match_len)
+			std::memcpy(output, match, match_len);
+		else
+			for(size_t c = 0; c < match_len; c++)
+				output[c] = match[c];
+		
+		output += match_len;
+	
+	}
+	
+	if(output != output_end)
+		throw std::runtime_error("Compressed data is corrupt.");
+
+}
+
+std::vector<uint8_t> lz_compress(std::span<const uint8_t> data, lz_level level) {
+	
+	size_t block_count = (data.size() + LZ_BLOCK_BYTES - 1) / LZ_BLOCK_BYTES;
+	std::vector<std::vector<uint8_t>> blocks(block_count);
+	
+	// Blocks don't depend on each other, so they are compressed in parallel and joined afterwards
+	parallel_for(block_count, [&](size_t index) {
+		
+		const uint8_t *src = data.data() + index * LZ_BLOCK_BYTES;
+		size_t raw_len = std::min<size_t>(LZ_BLOCK_BYTES, data.size() - index * LZ_BLOCK_BYTES);
+		
+		std::vector<uint8_t> &block = blocks[index];
+		block.resize(4 + LZ_BLOCK_BOUND);
+		
+		size_t block_len = raw_len;
+		if(level != lz_level::none)
+			block_len = (level == lz_level::fast ? compress_fast(src, raw_len, block.data() + 4) : compress_max(src, raw_len, block.data() + 4)) - (block.data() + 4);
+		
+		// Blocks that don't shrink are stored as they are
+		uint32_t block_header = block_len;
+		if(block_len >= raw_len) {
+			block_len = raw_len;
+			block_header = raw_len | 0x80000000u;
+			std::memcpy(block.data() + 4, src, raw_len);
+		}
+		
+		for(uint8_t c = 0; c < 4; c++)
+			block[c] = block_header >> (24 - (c << 3));
+		
+		block.resize(4 + block_len);
+	
+	});
+	
+	std::vector<uint8_t> container(sizeof(uint64_t));
+	
+	for(uint8_t c = 0; c < sizeof(uint64_t); c++)
+		container[c] = (uint64_t)data.size() >> (56 - (c << 3));
+	
+	for(const std::vector<uint8_t> &block : blocks)
+		container.insert(container.end(), block.begin(), block.end());
+	
+	return container;
+
+}
+
+uint64_t lz_raw_size(const uint8_t *container) {
+	
+	uint64_t raw_size = 0;
+	
+	for(uint8_t c = 0; c < sizeof(uint64_t); c++)
+		raw_size = (raw_size << 8) | container[c];
+	
+	return raw_size;
+
+}
+
+lz_decoder::lz_decoder(std::function<void(const uint8_t *data, size_t len)> sink) : sink(std::move(sink)) {}
+
+void lz_decoder::feed(const uint8_t *data, size_t len) {
+	
+	this->pending.insert(this->pending.end(), data, data + len);
+	
+	while(true) {
+		
+		const uint8_t *next = this->pending.data() + this->pending_start;
+		size_t available = this->pending.size() - this->pending_start;
+		
+		if(!this->have_size) {
+			
+			if(available < sizeof(uint64_t))
+				break;
+			
+			this->raw_size = lz_raw_size(next);
+			this->have_size = true;
+			this->pending_start += sizeof(uint64_t);
+			
+			continue;
+		
+		}
+		
+		if(this->raw_done == this->raw_size) {
+			if(available)
+				throw std::runtime_error("Compressed data is corrupt.");
+			break;
+		}
+		
+		if(available < 4)
+			break;
+		
+		uint32_t block_header = (next[0] << 24) | (next[1] << 16) | (next[2] << 8) | next[3];
+		size_t block_len = block_header & 0x7FFFFFFF;
+		size_t raw_len = std::min<uint64_t>(LZ_BLOCK_BYTES, this->raw_size - this->raw_done);
+		
+		// Stored blocks hold exactly their raw bytes, compressed ones never exceed the bound
+		if((block_header >> 31 && block_len != raw_len) || block_len > LZ_BLOCK_BOUND)
+			throw std::runtime_error("Compressed data is corrupt.");
+		
+		if(available < 4 + block_len)
+			break;
+		
+		if(block_header >> 31)
+			this->sink(next + 4, raw_len);
+		else {
+			this->block.resize(LZ_BLOCK_BYTES);
+			decompress_block(next + 4, block_len, this->block.data(), raw_len);
+			this->sink(this->block.data(), raw_len);
+		}
+		
+		this->raw_done += raw_len;
+		this->pending_start += 4 + block_len;
+	
+	}
+	
+	// Only a partial block is ever left over
+	this->pending.erase(this->pending.begin(), this->pending.begin() + this->pending_start);
+	this->pending_start = 0;
+
+}
+
+uint64_t lz_decoder::finish() const {
+	
+	if(!this->have_size || this->raw_done != this->raw_size || this->pending.size() != this->pending_start)
+		throw std::runtime_error("Compressed data is truncated.");
+	
+	return this->raw_size;
+
+}
\ No newline at end of file
@@ -0,0 +1,69 @@
+#ifndef LZ_HPP
+#define LZ_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <span>
+#include <functional>
+
+/*/
+ *	Small LZ77 codec for compressing data before it is hidden
+ *
+ *	Data is compressed in independent blocks of LZ_BLOCK_BYTES so blocks can be compressed in parallel and decompressed
+ *	one at a time as they are extracted. The container is the 64-bit raw size, most significant byte first, followed by
+ *	each block as a 32-bit length (most significant bit set for a block stored uncompressed) and the block's bytes.
+ *
+ *	Within a block, each sequence is a token byte holding a literal count (high nibble) and a match length less 4 (low
+ *	nibble), with 15 in either continued by extra bytes of 255 and a final byte below 255, then the literals, then the
+ *	match offset as 16 bits, least significant byte first. The last sequence of a block has literals only.
+ *
+/*/
+
+#define LZ_BLOCK_BYTES (64 * 1024)
+
+// Compression levels, none passes data through untouched
+enum class lz_level : uint8_t {
+	none,
+	fast,
+	max
+};
+
+const char *lz_level_name(lz_level level);
+// Parse a level name as printed by lz_level_name, returns false if it isn't recognized
+bool lz_parse_level(const char *name, lz_level &level);
+
+// Compress data into a container
+std::vector<uint8_t> lz_compress(std::span<const uint8_t> data, lz_level level);
+
+// Raw size stored at the front of a container, which must be at least 8 bytes long
+uint64_t lz_raw_size(const uint8_t *container);
+
+// Decompresses a container handed to it in pieces of any size, passing the raw data on one block at a time
+class lz_decoder {
+
+public:
+
+	lz_decoder(std::function<void(const uint8_t *data, size_t len)> sink);
+	
+	void feed(const uint8_t *data, size_t len);
+	
+	// Throws if the container ended early, returns the raw size
+	uint64_t finish() const;
+
+private:
+
+	std::function<void(const uint8_t *data, size_t len)> sink;
+	
+	std::vector<uint8_t> pending;
+	size_t pending_start{0};
+	
+	std::vector<uint8_t> block;
+	
+	bool have_size{false};
+	uint64_t raw_size{0};
+	uint64_t raw_done{0};
+
+};
+
+#endif
\ No newline at end of file
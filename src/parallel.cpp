@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <exception>
+
+#include "parallel.hpp"
+#include "trace.hpp"
+
+static std::atomic<unsigned> thread_count{0};
+
+// Set on worker threads and on a thread while it runs a parallel_for, so nested calls run serially
+static thread_local bool in_parallel = false;
+
+class worker_pool {
+
+public:
+
+	~worker_pool() {
+		this->stop();
+	}
+	
+	// Run a parallel_for, returns false if the pool is busy with another one
+	bool run(size_t count, const std::function<void(size_t)> &task) {
+		
+		std::unique_lock<std::mutex> run_guard(this->run_lock, std::try_to_lock);
+		if(!run_guard.owns_lock())
+			return false;
+		
+		unsigned threads = get_thread_count();
+		if(this->workers.size() != threads - 1) {
+			this->stop();
+			this->start(threads - 1);
+		}
+		
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			
+			this->task = &task;
+			this->count = count;
+			this->next = 0;
+			this->active = this->workers.size();
+			this->error = nullptr;
+			this->generation++;
+		}
+		
+		this->wake.notify_all();
+		
+		in_parallel = true;
+		this->drain();
+		in_parallel = false;
+		
+		// Every worker checks in once per generation, even if there was nothing left for it to do
+		std::unique_lock<std::mutex> guard(this->lock);
+		this->done.wait(guard, [this]() { return !this->active; });
+		
+		this->task = nullptr;
+		
+		if(this->error)
+			std::rethrow_exception(this->error);
+		
+		return true;
+	
+	}
+
+private:
+
+	std::vector<std::thread> workers;
+	
+	std::mutex run_lock;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable done;
+	
+	const std::function<void(size_t)> *task{nullptr};
+	size_t count{0};
+	std::atomic<size_t> next{0};
+	size_t active{0};
+	uint64_t generation{0};
+	bool stopping{false};
+	
+	std::exception_ptr error;
+	
+	void start(unsigned worker_count) {
+		
+		this->stopping = false;
+		
+		// Workers start from the current generation, so a job posted before they first wait is not missed
+		for(unsigned w = 0; w < worker_count; w++)
+			this->workers.emplace_back([this, seen = this->generation]() { this->work(seen); });
+	
+	}
+	
+	void stop() {
+		
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->stopping = true;
+		}
+		
+		this->wake.notify_all();
+		
+		for(std::thread &worker : this->workers)
+			worker.join();
+		
+		this->workers.clear();
+	
+	}
+	
+	void work(uint64_t seen) {
+		
+		in_parallel = true;
+		
+		// Count this worker's share of the work in the hardware counters of whichever span is running
+		trace_thread();
+		
+		std::unique_lock<std::mutex> guard(this->lock);
+		
+		while(true) {
+			
+			this->wake.wait(guard, [this, seen]() { return this->stopping || this->generation != seen; });
+			
+			if(this->stopping)
+				return;
+			
+			seen = this->generation;
+			
+			guard.unlock();
+			this->drain();
+			guard.lock();
+			
+			if(!--this->active)
+				this->done.notify_one();
+		
+		}
+	
+	}
+	
+	// Take indices until none are left
+	void drain() {
+		
+		for(size_t index = this->next++; index < this->count; index = this->next++) {
+			
+			try {
+				(*this->task)(index);
+			}
+			catch(...) {
+				std::lock_guard<std::mutex> guard(this->lock);
+				if(!this->error)
+					this->error = std::current_exception();
+			}
+		
+		}
+	
+	}
+
+};
+
+void set_thread_count(unsigned threads) {
+	thread_count = threads;
+}
+
+unsigned get_thread_count() {
+	
+	if(in_parallel)
+		return 1;
+	
+	if(unsigned threads = thread_count)
+		return threads;
+	
+	return std::max(std::thread::hardware_concurrency(), 1u);
+
+}
+
+serial_scope::serial_scope() : previous(in_parallel) {
+	in_parallel = true;
+}
+
+serial_scope::~serial_scope() {
+	in_parallel = this->previous;
+}
+
+void parallel_for(size_t count, const std::function<void(size_t)> &task) {
+	
+	static worker_pool pool;
+	
+	if(count > 1 && get_thread_count() > 1 && !in_parallel && pool.run(count, task))
+		return;
+	
+	for(size_t index = 0; index < count; index++)
+		task(index);
+
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <cstddef>
+#include <functional>
+
+/*/
+ *	Shared worker threads for splitting one encode/decode across cores
+ *
+ *	Workers are started on first use and kept for the life of the process, so a parallel call only pays for
+ *	waking them. The calling thread takes part in the work too. A parallel_for issued while another one is
+ *	running (from a worker, or from a second thread) runs serially on the calling thread instead of waiting.
+ *
+/*/
+
+// Number of threads a parallel_for may use, including the calling thread
+// 0 selects the number of hardware threads. On a thread that would run a parallel_for serially, this is 1
+void set_thread_count(unsigned threads);
+unsigned get_thread_count();
+
+// Runs every parallel_for issued on the constructing thread serially for as long as it exists, as nested calls are
+// For a thread that is already one of several working on independent jobs side by side
+class serial_scope {
+
+public:
+
+	serial_scope();
+	~serial_scope();
+	
+	serial_scope(const serial_scope &) = delete;
+	serial_scope &operator=(const serial_scope &) = delete;
+
+private:
+
+	bool previous;
+
+};
+
+// Run task(0) .. task(count - 1) across the worker threads and return once all have finished
+// The first exception thrown by a task is rethrown on the calling thread
+void parallel_for(size_t count, const std::function<void(size_t)> &task);
+
+#endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#ifndef PIXEL_FORMAT_HPP
+#define PIXEL_FORMAT_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+#include "pixel.hpp"
+
+/*/
+ *	Compile-time pixel formats
+ *
+ *	Each format is a traits type giving the size of its pixels and how one is loaded into and stored from a pixel.
+ *	Code written against an image_view of a format compiles to loops specialized for it, with no per-pixel branch
+ *	on the bit count. An image's format is looked up once, when its headers are read (see bmp_file::format), and
+ *	with_format picks the instantiation to run from it.
+ *
+ *	Supporting another format (8 BPP palettized, 16 BPP) means adding its traits and a case to with_format.
+ *
+/*/
+
+enum class pixel_format : uint8_t {
+	bgr24,
+	bgra32
+};
+
+// 3 bytes a pixel, no alpha, and no color header in the file
+// Loaded the way bmp_file has always returned them: the first byte in red(), the second in green(), the third in
+// blue(), and alpha 0
+struct bgr24_format {
+	
+	static constexpr pixel_format format = pixel_format::bgr24;
+	static constexpr uint16_t bits = 24;
+	static constexpr uint8_t bytes = 3;
+	static constexpr bool alpha = false;
+	
+	static pixel load(const uint8_t *src) {
+		pixel p;
+		p.set_argb(0, src[0], src[1], src[2]);
+		return p;
+	}
+	
+	static void store(uint8_t *dst, pixel p) {
+		dst[0] = p.red();
+		dst[1] = p.green();
+		dst[2] = p.blue();
+	}
+
+};
+
+// 4 bytes a pixel with alpha, described by a color header, moved to and from a pixel as they are
+struct bgra32_format {
+	
+	static constexpr pixel_format format = pixel_format::bgra32;
+	static constexpr uint16_t bits = 32;
+	static constexpr uint8_t bytes = 4;
+	static constexpr bool alpha = true;
+	
+	static pixel load(const uint8_t *src) {
+		uint32_t argb;
+		std::memcpy(&argb, src, sizeof(argb));
+		return pixel(argb);
+	}
+	
+	static void store(uint8_t *dst, pixel p) {
+		uint32_t argb = p.get_argb();
+		std::memcpy(dst, &argb, sizeof(argb));
+	}
+
+};
+
+// Call function with the traits of format as its argument, instantiating it once per format
+template<typename function>
+decltype(auto) with_format(pixel_format format, function &&call) {
+	
+	switch(format) {
+		case pixel_format::bgra32: return call(bgra32_format{});
+		default: return call(bgr24_format{});
+	}
+
+}
+
+// Format of pixels of the given bit count, throws if there is none
+inline pixel_format pixel_format_of(uint16_t bits) {
+	
+	switch(bits) {
+		case bgr24_format::bits: return pixel_format::bgr24;
+		case bgra32_format::bits: return pixel_format::bgra32;
+	}
+	
+	throw std::runtime_error("Only 24/32 BPP is supported currently.");
+
+}
+
+inline uint8_t pixel_format_bytes(pixel_format format) {
+	return with_format(format, [](auto traits) { return decltype(traits)::bytes; });
+}
+
+inline bool pixel_format_alpha(pixel_format format) {
+	return with_format(format, [](auto traits) { return decltype(traits)::alpha; });
+}
+
+// Pixels of one format laid out as rows that start stride bytes apart, in the order they are stored
+template<typename format_traits, typename byte_type>
+struct basic_image_view {
+	
+	using traits = format_traits;
+	
+	byte_type *base{nullptr};
+	uint32_t width{0};
+	uint32_t height{0};
+	size_t stride{0};
+	
+	basic_image_view() = default;
+	basic_image_view(byte_type *view_base, uint32_t view_width, uint32_t view_height, size_t view_stride) :
+		base(view_base), width(view_width), height(view_height), stride(view_stride) {}
+	
+	operator basic_image_view<format_traits, const byte_type>() const {
+		return {this->base, this->width, this->height, this->stride};
+	}
+	
+	byte_type *row(uint32_t y) const {
+		return this->base + (size_t)y * this->stride;
+	}
+	
+	pixel get_pixel(uint32_t x, uint32_t y) const {
+		return format_traits::load(this->row(y) + (size_t)x * format_traits::bytes);
+	}
+	
+	void set_pixel(uint32_t x, uint32_t y, pixel p) const {
+		format_traits::store(this->row(y) + (size_t)x * format_traits::bytes, p);
+	}
+	
+	// Call function(x, y, pixel &) for every pixel, row by row, storing back whatever it leaves in the pixel
+	template<typename function>
+	void transform(function &&call) const {
+		
+		for(uint32_t y = 0; y < this->height; y++) {
+			
+			byte_type *row = this->row(y);
+			
+			for(uint32_t x = 0; x < this->width; x++, row += format_traits::bytes) {
+				pixel p = format_traits::load(row);
+				call(x, y, p);
+				format_traits::store(row, p);
+			}
+		
+		}
+	
+	}
+	
+	// Call function(x, y, const pixel &) for every pixel, row by row
+	template<typename function>
+	void for_each(function &&call) const {
+		
+		for(uint32_t y = 0; y < this->height; y++) {
+			
+			const byte_type *row = this->row(y);
+			
+			for(uint32_t x = 0; x < this->width; x++, row += format_traits::bytes)
+				call(x, y, format_traits::load(row));
+		
+		}
+	
+	}
+
+};
+
+template<typename format_traits>
+using image_view = basic_image_view<format_traits, uint8_t>;
+template<typename format_traits>
+using const_image_view = basic_image_view<format_traits, const uint8_t>;
+
+#endif
\ No newline at end of file
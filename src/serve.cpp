@@ -0,0 +1,603 @@
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <optional>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "serve.hpp"
+#include "steg.hpp"
+#include "stream.hpp"
+#include "parallel.hpp"
+
+// Connections waiting to be listened to
+#define SERVE_BACKLOG 64
+// Pause after accept fails for lack of descriptors or memory, before trying again
+#define SERVE_ACCEPT_BACKOFF_MS 100
+
+// A failed request along with the exit code the command line would have returned for it
+class request_error : public std::runtime_error {
+
+public:
+
+	request_error(uint8_t status, const std::string &message) : std::runtime_error(message), status(status) {}
+	
+	uint8_t status;
+
+};
+
+struct serve_response {
+	
+	uint8_t status{0};
+	uint64_t data_bytes{0};
+	std::string message;
+
+};
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void request_stop(int) {
+	stop_requested = 1;
+}
+
+// Receive exactly len bytes, collecting any file descriptors sent along with them
+// Returns false if the connection was closed before the first byte
+static bool receive(int socket_fd, uint8_t *dst, size_t len, std::vector<int> &fds) {
+	
+	for(size_t done = 0; done < len;) {
+		
+		iovec iov{dst + done, len - done};
+		alignas(cmsghdr) char control[CMSG_SPACE(SERVE_MAX_FDS * sizeof(int))];
+		
+		msghdr message{};
+		message.msg_iov = &iov;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof(control);
+		
+		ssize_t received = recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC);
+		
+		if(received < 0 && errno == EINTR)
+			continue;
+		
+		for(cmsghdr *header = CMSG_FIRSTHDR(&message); header; header = CMSG_NXTHDR(&message, header)) {
+			
+			if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+				continue;
+			
+			size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for(size_t index = 0; index < count; index++) {
+				int fd;
+				std::memcpy(&fd, CMSG_DATA(header) + index * sizeof(int), sizeof(int));
+				fds.push_back(fd);
+			}
+		
+		}
+		
+		if(received < 0)
+			throw std::runtime_error("Unable to read from connection.");
+		
+		if(!received) {
+			if(!done)
+				return false;
+			throw std::runtime_error("Connection closed in the middle of a request.");
+		}
+		
+		done += received;
+	
+	}
+	
+	return true;
+
+}
+
+static void send_all(int socket_fd, const uint8_t *src, size_t len) {
+	
+	while(len) {
+		
+		ssize_t sent = send(socket_fd, src, len, MSG_NOSIGNAL);
+		
+		if(sent < 0) {
+			if(errno == EINTR)
+				continue;
+			throw std::runtime_error("Unable to write to connection.");
+		}
+		
+		src += sent;
+		len -= sent;
+	
+	}
+
+}
+
+static void write_be(uint8_t *dst, uint64_t value, uint8_t bytes) {
+	for(uint8_t b = 0; b < bytes; b++)
+		dst[b] = value >> ((bytes - 1 - b) << 3);
+}
+
+static uint64_t read_be(const uint8_t *src, uint8_t bytes) {
+	
+	uint64_t value = 0;
+	for(uint8_t b = 0; b < bytes; b++)
+		value = (value << 8) | src[b];
+	
+	return value;
+
+}
+
+// Reads the fields of a request in order, resolving each file to a path the library can open
+class request_reader {
+
+public:
+
+	request_reader(const std::vector<uint8_t> &body, const std::vector<int> &fds) : body(body), fds(fds) {}
+	
+	uint8_t byte() {
+		
+		if(this->position >= this->body.size())
+			throw request_error(1, "Request is truncated.");
+		
+		return this->body[this->position++];
+	
+	}
+	
+	// A passed descriptor is opened again through /proc, so it can be used anywhere a path is taken
+	std::string file(int *fd = nullptr) {
+		
+		uint16_t len = this->byte() << 8;
+		len |= this->byte();
+		
+		if(fd)
+			*fd = -1;
+		
+		if(!len) {
+			
+			if(this->next_fd >= this->fds.size())
+				throw request_error(1, "Request names more passed file descriptors than it was sent.");
+			
+			int passed = this->fds[this->next_fd++];
+			if(fd)
+				*fd = passed;
+			
+			return "/proc/self/fd/" + std::to_string(passed);
+		
+		}
+		
+		if(this->position + len > this->body.size())
+			throw request_error(1, "Request is truncated.");
+		
+		std::string path((const char *)this->body.data() + this->position, len);
+		this->position += len;
+		
+		return path;
+	
+	}
+
+private:
+
+	const std::vector<uint8_t> &body;
+	const std::vector<int> &fds;
+	
+	size_t position{0};
+	size_t next_fd{0};
+
+};
+
+// Read a whole data file, a regular file from its start whatever its offset and anything else until it ends
+static pixel_buffer read_all(int fd) {
+	
+	pixel_buffer data;
+	
+	struct stat file_stat;
+	bool regular = !fstat(fd, &file_stat) && S_ISREG(file_stat.st_mode);
+	if(regular)
+		data.reserve(file_stat.st_size);
+	
+	uint8_t block[64 * 1024];
+	
+	for(;;) {
+		
+		ssize_t got = regular ? pread(fd, block, sizeof(block), data.size()) : read(fd, block, sizeof(block));
+		
+		if(got < 0 && errno == EINTR)
+			continue;
+		if(got < 0)
+			throw request_error(6, "Unable to read data file.");
+		if(!got)
+			return data;
+		
+		data.insert(data.end(), block, block + got);
+	
+	}
+
+}
+
+static serve_response handle_request(const std::vector<uint8_t> &body, const std::vector<int> &fds, const serve_options &options) {
+	
+	serve_response response;
+	request_reader request(body, fds);
+	
+	uint8_t operation = request.byte();
+	uint8_t bits = request.byte();
+	uint8_t compression_level = request.byte();
+	uint8_t flags = request.byte();
+	
+	if(bits > 7)
+		throw request_error(2, "Only up to 7 least-significant bits are supported for writing.");
+	
+	if(compression_level > 2)
+		throw request_error(1, "Invalid compression level.");
+	
+	lz_level compression = compression_level == 2 ? lz_level::max : compression_level == 1 ? lz_level::fast : lz_level::none;
+	
+	std::string image = request.file();
+	
+	try {
+		
+		if(operation == SERVE_PROBE) {
+			
+			std::optional<bmp_file> input_image;
+			
+			try {
+				input_image.emplace(bmp_file::open_lazy(image.c_str()));
+			}
+			catch(const std::runtime_error &e) {
+				throw request_error(6, e.what());
+			}
+			
+			// The image is mapped read-only, so only the const view can be taken from it
+			const_pixel_view pixels = std::as_const(*input_image).view();
+			
+			// Anything read_header throws means there's no header, as does one describing more data than fits, like probe_image
+			try {
+				steg_header header = read_header(pixels);
+				if(header.data_size <= pixels.size() && header.image_bytes() <= pixels.size())
+					response.data_bytes = header.data_size;
+			}
+			catch(const std::runtime_error &) {}
+			
+			response.message = probe_image(*input_image);
+		
+		}
+		else if(operation == SERVE_DECODE) {
+			
+			bmp_file input_image = options.map_images ? bmp_file::map(image.c_str(), bmp_file::map_mode::read) : bmp_file(image.c_str());
+			
+			if(flags & SERVE_FLAG_VERIFY) {
+				
+				try {
+					response.data_bytes = extract_data(input_image, [](const uint8_t *, size_t) {});
+				}
+				catch(const std::runtime_error &e) {
+					throw request_error(9, e.what());
+				}
+			
+			}
+			else {
+				
+				int output_fd;
+				std::string output = request.file(&output_fd);
+				
+				bool opened = output_fd < 0;
+				if(opened)
+					output_fd = open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+				
+				if(output_fd < 0)
+					throw request_error(7, "Unable to open output file for writing.");
+				
+				// Corrupt data is only found once the data ahead of it has been written out, which is then removed again
+				// A passed descriptor's file belongs to the client, so it is left alone
+				try {
+					response.data_bytes = extract_data(input_image, fd_sink(output_fd));
+				}
+				catch(const std::runtime_error &e) {
+					if(opened)
+						discard_output(output_fd, output.c_str());
+					throw request_error(9, e.what());
+				}
+				catch(...) {
+					if(opened)
+						close(output_fd);
+					throw;
+				}
+				
+				if(opened)
+					close(output_fd);
+			
+			}
+		
+		}
+		else if(operation == SERVE_ENCODE) {
+			
+			int data_fd;
+			std::string data_file = request.file(&data_fd);
+			std::string output = request.file();
+			
+			bool opened = data_fd < 0;
+			if(opened)
+				data_fd = open(data_file.c_str(), O_RDONLY);
+			
+			if(data_fd < 0)
+				throw request_error(6, "Unable to open data file for reading.");
+			
+			pixel_buffer data;
+			
+			try {
+				data = read_all(data_fd);
+			}
+			catch(...) {
+				if(opened)
+					close(data_fd);
+				throw;
+			}
+			
+			if(opened)
+				close(data_fd);
+			
+			if(options.map_images) {
+				
+				replacement_file output_file(output.c_str());
+				bmp_file output_image = bmp_file::map_copy(image.c_str(), output_file.path());
+				
+				hide_data(output_image, std::span<const uint8_t>(data), bits, compression, flags & SERVE_FLAG_CHECKSUM);
+				output_image.sync();
+				output_file.commit();
+			
+			}
+			else
+				pipeline_hide(image.c_str(), output.c_str(), std::span<const uint8_t>(data), bits, compression, flags & SERVE_FLAG_CHECKSUM);
+			
+			response.data_bytes = data.size();
+		
+		}
+		else
+			throw request_error(1, "Unknown request operation.");
+	
+	}
+	catch(const request_error &) {
+		throw;
+	}
+	// Anything else went wrong in reading, encoding/decoding, or writing the image
+	catch(const std::exception &e) {
+		throw request_error(8, e.what());
+	}
+	
+	return response;
+
+}
+
+// Answer requests on one connection until the client closes it
+static void serve_connection(int socket_fd, const serve_options &options) {
+	
+	for(;;) {
+		
+		std::vector<int> fds;
+		serve_response response;
+		
+		try {
+			
+			uint8_t length[4];
+			if(!receive(socket_fd, length, sizeof(length), fds))
+				return;
+			
+			uint64_t body_bytes = read_be(length, sizeof(length));
+			if(body_bytes > SERVE_MAX_REQUEST_BYTES)
+				throw std::runtime_error("Request is too large.");
+			
+			std::vector<uint8_t> body(body_bytes);
+			receive(socket_fd, body.data(), body.size(), fds);
+			
+			try {
+				response = handle_request(body, fds, options);
+			}
+			catch(const request_error &e) {
+				response.status = e.status;
+				response.message = e.what();
+			}
+			
+			for(int fd : fds)
+				close(fd);
+			fds.clear();
+			
+			std::vector<uint8_t> reply(4 + 1 + 8 + response.message.size());
+			write_be(reply.data(), reply.size() - 4, 4);
+			reply[4] = response.status;
+			write_be(reply.data() + 5, response.data_bytes, 8);
+			std::memcpy(reply.data() + 13, response.message.data(), response.message.size());
+			
+			send_all(socket_fd, reply.data(), reply.size());
+		
+		}
+		// The connection itself failed, there's no one left to answer
+		catch(const std::exception &) {
+			for(int fd : fds)
+				close(fd);
+			return;
+		}
+	
+	}
+
+}
+
+// Whether the socket at address was left behind by a server that is no longer running, refusing connections
+static bool stale_socket(const sockaddr_un &address) {
+	
+	int probe_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(probe_fd < 0)
+		return false;
+	
+	bool stale = connect(probe_fd, (const sockaddr *)&address, sizeof(address)) && errno == ECONNREFUSED;
+	
+	close(probe_fd);
+	
+	return stale;
+
+}
+
+int32_t serve(const char *socket_path, const serve_options &options) {
+	
+	sockaddr_un address{};
+	address.sun_family = AF_UNIX;
+	
+	if(std::strlen(socket_path) >= sizeof(address.sun_path))
+		throw std::runtime_error("Socket path is too long.");
+	
+	std::strcpy(address.sun_path, socket_path);
+	
+	// Non-blocking, so a connection gone again between ppoll and accept doesn't stall the loop
+	int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(listen_fd < 0)
+		throw std::runtime_error("Unable to create socket.");
+	
+	// A socket left behind by a server that is no longer running would block the bind, anything else at the path is kept
+	struct stat path_stat;
+	if(!lstat(socket_path, &path_stat)) {
+		
+		if(!S_ISSOCK(path_stat.st_mode) || !stale_socket(address)) {
+			close(listen_fd);
+			throw std::runtime_error("Socket path is already in use.");
+		}
+		
+		unlink(socket_path);
+	
+	}
+	
+	struct stat socket_stat;
+	if(bind(listen_fd, (const sockaddr *)&address, sizeof(address)) || lstat(socket_path, &socket_stat) || listen(listen_fd, SERVE_BACKLOG)) {
+		close(listen_fd);
+		throw std::runtime_error("Unable to listen on socket.");
+	}
+	
+	// Without SA_RESTART, so a signal breaks ppoll() out of its wait
+	struct sigaction action{};
+	action.sa_handler = request_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, nullptr);
+	sigaction(SIGTERM, &action, nullptr);
+	
+	// A client closing its end of a passed pipe fails the request instead of ending the server
+	signal(SIGPIPE, SIG_IGN);
+	
+	std::mutex lock;
+	std::condition_variable waiting;
+	std::deque<int> connections;
+	std::vector<int> active;
+	bool stopping = false;
+	
+	size_t worker_count = options.workers ? options.workers : get_thread_count();
+	std::vector<std::thread> workers;
+	
+	// Workers start with every signal blocked, so the signals are left for the accepting thread
+	sigset_t all_signals, previous_signals;
+	sigfillset(&all_signals);
+	pthread_sigmask(SIG_SETMASK, &all_signals, &previous_signals);
+	
+	for(size_t w = 0; w < worker_count; w++) {
+		workers.emplace_back([&]() {
+			
+			for(;;) {
+				
+				int connection_fd;
+				
+				{
+					std::unique_lock<std::mutex> guard(lock);
+					waiting.wait(guard, [&] { return stopping || !connections.empty(); });
+					
+					if(stopping)
+						return;
+					
+					connection_fd = connections.front();
+					connections.pop_front();
+					active.push_back(connection_fd);
+				}
+				
+				serve_connection(connection_fd, options);
+				
+				{
+					std::lock_guard<std::mutex> guard(lock);
+					active.erase(std::find(active.begin(), active.end(), connection_fd));
+				}
+				
+				close(connection_fd);
+			
+			}
+		
+		});
+	}
+	
+	// The accepting thread keeps SIGINT and SIGTERM blocked except while it waits in ppoll, so one arriving just after
+	// stop_requested was checked ends the wait instead of going unnoticed until the next connection
+	sigset_t accept_signals = previous_signals, wait_signals = previous_signals;
+	sigaddset(&accept_signals, SIGINT);
+	sigaddset(&accept_signals, SIGTERM);
+	sigdelset(&wait_signals, SIGINT);
+	sigdelset(&wait_signals, SIGTERM);
+	pthread_sigmask(SIG_SETMASK, &accept_signals, nullptr);
+	
+	pollfd listen_poll{listen_fd, POLLIN, 0};
+	const timespec backoff{0, SERVE_ACCEPT_BACKOFF_MS * 1000000L};
+	
+	while(!stop_requested) {
+		
+		if(ppoll(&listen_poll, 1, nullptr, &wait_signals) <= 0)
+			continue;
+		
+		int connection_fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		
+		if(connection_fd < 0) {
+			
+			// Out of descriptors or memory, which a connection finishing frees up, so wait a little instead of spinning
+			if(errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+				ppoll(nullptr, 0, &backoff, &wait_signals);
+			
+			continue;
+		
+		}
+		
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			connections.push_back(connection_fd);
+		}
+		
+		waiting.notify_one();
+	
+	}
+	
+	pthread_sigmask(SIG_SETMASK, &previous_signals, nullptr);
+	
+	close(listen_fd);
+	
+	// Unless the path has been taken over by something else since
+	if(!lstat(socket_path, &path_stat) && path_stat.st_dev == socket_stat.st_dev && path_stat.st_ino == socket_stat.st_ino)
+		unlink(socket_path);
+	
+	// Requests being handled are still answered, but no further ones are read and connections not yet picked up are dropped
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		
+		stopping = true;
+		
+		for(int connection_fd : active)
+			shutdown(connection_fd, SHUT_RD);
+		for(int connection_fd : connections)
+			close(connection_fd);
+	}
+	
+	waiting.notify_all();
+	for(std::thread &worker : workers)
+		worker.join();
+	
+	return 0;
+
+}
\ No newline at end of file
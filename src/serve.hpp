@@ -0,0 +1,59 @@
+#ifndef SERVE_HPP
+#define SERVE_HPP
+
+#include <cstdint>
+
+/*/
+ *	Daemon mode, serving encode, decode, and probe requests over a Unix domain socket
+ *
+ *	A connection may carry any number of requests, each answered before the next one is read. Connections are
+ *	handled by a pool of workers, and a request's encode/decode spreads over the worker threads whenever they
+ *	aren't busy with other requests (see parallel.hpp).
+ *
+ *	Every message is a 32-bit length followed by that many bytes. All integers are most significant byte first.
+ *
+ *	Request:
+ *		u8 operation -> SERVE_ENCODE, SERVE_DECODE, or SERVE_PROBE
+ *		u8 bits -> bit count to encode with, 0 picks the minimum
+ *		u8 compression -> 0 none, 1 fast, 2 max
+ *		u8 flags -> SERVE_FLAG_CHECKSUM when encoding, SERVE_FLAG_VERIFY to decode without writing the data
+ *		files -> encode: image, data, output; decode: image, output (unless verifying); probe: image
+ *
+ *	Each file is a u16 path length followed by the path, or a length of 0 to use the next file descriptor passed
+ *	with the request (SCM_RIGHTS, sent along with its first bytes). Passing descriptors avoids any path lookups in
+ *	the server, and a memfd passes data through shared memory. A regular data file is read whole from its start.
+ *	An encode's output must be a regular file, a decode's output may also be a pipe or socket. Passed descriptors
+ *	are closed once the request is answered.
+ *
+ *	Response:
+ *		u8 status -> 0, or the exit code the command line would have returned
+ *		u64 data bytes -> bytes hidden when encoding, decoded or verified when decoding, encoded in the image when probing
+ *		message -> the rest of the response, the error when the status isn't 0 or the --probe line when probing
+ *
+/*/
+
+#define SERVE_ENCODE 1
+#define SERVE_DECODE 2
+#define SERVE_PROBE 3
+
+#define SERVE_FLAG_CHECKSUM 0x01
+#define SERVE_FLAG_VERIFY 0x02
+
+// Largest request accepted, requests only carry paths and options
+#define SERVE_MAX_REQUEST_BYTES (64 * 1024)
+// Most file descriptors passed with one request
+#define SERVE_MAX_FDS 3
+
+struct serve_options {
+	
+	// Connections handled at once, 0 selects the number of hardware threads
+	unsigned workers{0};
+	bool map_images{false};
+
+};
+
+// Listen on socket_path and answer requests until SIGINT or SIGTERM, removing the socket on the way out
+// Returns 0 once stopped, throws if the socket can't be set up or something other than a stale socket is at socket_path
+int32_t serve(const char *socket_path, const serve_options &options = {});
+
+#endif
\ No newline at end of file
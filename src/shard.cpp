@@ -0,0 +1,217 @@
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+#include "shard.hpp"
+#include "parallel.hpp"
+
+uint64_t shard_capacity(size_t image_bytes, uint8_t bits, bool checked) {
+	
+	uint64_t capacity = data_capacity(image_bytes, bits, STEG_FLAG_SHARD | (checked ? STEG_FLAG_CHECKED : 0));
+	
+	// Checked data grows by a CRC for every chunk started, so only as much raw data as frames into the capacity fits
+	if(checked) {
+		uint64_t last_frame = capacity % CHUNK_FRAME_BYTES;
+		capacity = capacity / CHUNK_FRAME_BYTES * CHUNK_BYTES + (last_frame > CHUNK_CRC_BYTES ? last_frame - CHUNK_CRC_BYTES : 0);
+	}
+	
+	// Compressed parts are never larger than the data, so they always fit where the data does
+	return capacity > STEG_SHARD_BYTES ? capacity - STEG_SHARD_BYTES : 0;
+
+}
+
+// Rethrow an error from working on one image with the image's name in front of it
+[[noreturn]] static void image_error(const std::string &image, const std::exception &e) {
+	throw std::runtime_error(image + ": " + e.what());
+}
+
+uint8_t shard_hide(const std::vector<std::string> &covers, const std::vector<std::string> &outputs, std::span<const uint8_t> data, const shard_options &options) {
+	
+	if(covers.empty())
+		throw std::runtime_error("No cover images supplied.");
+	
+	if(covers.size() != outputs.size())
+		throw std::runtime_error("Every cover image needs an output image.");
+	
+	if(covers.size() > UINT32_MAX)
+		throw std::runtime_error("Too many cover images.");
+	
+	if(options.bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	// Only the headers of the covers are read to size their parts
+	std::vector<size_t> image_bytes(covers.size());
+	parallel_for(covers.size(), [&](size_t cover) {
+		try {
+			const bmp_file cover_image = bmp_file::open_lazy(covers[cover].c_str());
+			image_bytes[cover] = cover_image.view(options.channels).size();
+		}
+		catch(const std::exception &e) {
+			image_error(covers[cover], e);
+		}
+	});
+	
+	auto total_capacity = [&](uint8_t bits) {
+		return std::accumulate(image_bytes.begin(), image_bytes.end(), (uint64_t)0, [&](uint64_t total, size_t bytes) { return total + shard_capacity(bytes, bits, options.checked); });
+	};
+	
+	// Every cover uses the same bit count, the smallest that fits the data into all of them together
+	uint8_t bits = options.bits;
+	for(uint8_t candidate = 1; !bits && candidate < 8; candidate++) {
+		if(total_capacity(candidate) >= data.size())
+			bits = candidate;
+	}
+	
+	if(!bits)
+		throw std::runtime_error("Cover images are too small to store this data set.");
+	
+	uint64_t capacity = total_capacity(bits);
+	if(capacity < data.size()) {
+		
+		std::stringstream err_s_str;
+		
+		err_s_str << "Not enough space in these images (" << capacity << ") to store this data set (" << data.size() << " bytes) for " << (uint16_t)bits << " bits.";
+		
+		throw std::runtime_error(err_s_str.str());
+	
+	}
+	
+	VERBOSE_LOG("Sharding " << data.size() << " bytes over " << covers.size() << " images at " << (uint16_t)bits << " bits");
+	
+	// Part boundaries are placed in proportion to the capacity ahead of them, which keeps every part within its cover
+	std::vector<uint64_t> offsets(covers.size() + 1);
+	uint64_t capacity_before = 0;
+	
+	for(size_t cover = 0; cover < covers.size(); cover++) {
+		capacity_before += shard_capacity(image_bytes[cover], bits, options.checked);
+		offsets[cover + 1] = capacity ? (unsigned __int128)data.size() * capacity_before / capacity : 0;
+	}
+	
+	std::random_device random;
+	uint64_t set_id = (uint64_t)random() << 32 | random();
+	
+	parallel_for(covers.size(), [&](size_t cover) {
+		
+		shard_header shard;
+		shard.set_id = set_id;
+		shard.index = cover;
+		shard.count = covers.size();
+		shard.offset = offsets[cover];
+		
+		std::span<const uint8_t> part = data.subspan(offsets[cover], offsets[cover + 1] - offsets[cover]);
+		
+		try {
+			
+			if(options.map_images) {
+				
+				replacement_file output_file(outputs[cover].c_str());
+				bmp_file output_image = bmp_file::map_copy(covers[cover].c_str(), output_file.path());
+				
+				hide_shard(output_image.view(options.channels), shard, part, bits, options.compression, options.checked);
+				output_image.sync();
+				output_file.commit();
+			
+			}
+			else {
+				
+				bmp_file output_image(covers[cover].c_str());
+				
+				hide_shard(output_image.view(options.channels), shard, part, bits, options.compression, options.checked);
+				output_image.write(outputs[cover].c_str());
+			
+			}
+		
+		}
+		catch(const std::exception &e) {
+			image_error(covers[cover], e);
+		}
+	
+	});
+	
+	return bits;
+
+}
+
+// Writes the data passing through it to the file from offset on, position counting the bytes written so far
+static data_sink offset_sink(int fd, const uint64_t &offset, uint64_t &position) {
+	
+	return [fd, &offset, &position](const uint8_t *data, size_t len) {
+		
+		while(len) {
+			
+			ssize_t written = pwrite(fd, data, len, offset + position);
+			
+			if(written < 0) {
+				if(errno == EINTR)
+					continue;
+				throw std::runtime_error("Unable to write decoded data.");
+			}
+			
+			data += written;
+			len -= written;
+			position += written;
+		
+		}
+	
+	};
+
+}
+
+uint64_t shard_extract(const std::vector<std::string> &images, int output_fd, const shard_options &options) {
+	
+	if(images.empty())
+		throw std::runtime_error("No input image supplied.");
+	
+	std::vector<shard_header> shards(images.size());
+	std::vector<uint64_t> sizes(images.size());
+	
+	// Each part is written to its offset as soon as its shard header has been decoded, ahead of its data
+	parallel_for(images.size(), [&](size_t image) {
+		
+		uint64_t position = 0;
+		
+		try {
+			
+			const bmp_file input_image = options.map_images ? bmp_file::map(images[image].c_str(), bmp_file::map_mode::read) : bmp_file(images[image].c_str());
+			
+			sizes[image] = extract_shard(input_image.view(options.channels), offset_sink(output_fd, shards[image].offset, position), shards[image]);
+		
+		}
+		catch(const std::exception &e) {
+			image_error(images[image], e);
+		}
+	
+	});
+	
+	// Only now is it known whether the parts written make up one whole payload
+	std::vector<size_t> order(images.size());
+	std::iota(order.begin(), order.end(), 0);
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return shards[a].index < shards[b].index; });
+	
+	uint64_t payload_size = 0;
+	
+	for(size_t part = 0; part < order.size(); part++) {
+		
+		const shard_header &shard = shards[order[part]];
+		
+		if(shard.set_id != shards[order[0]].set_id)
+			throw std::runtime_error("Images hold parts of different sharded payloads.");
+		
+		if(shard.count != images.size() || shard.index != part)
+			throw std::runtime_error("Images don't hold every part of the sharded payload exactly once.");
+		
+		if(shard.offset != payload_size)
+			throw std::runtime_error("Parts of the sharded payload don't line up.");
+		
+		payload_size += sizes[order[part]];
+	
+	}
+	
+	VERBOSE_LOG("Reassembled " << payload_size << " bytes from " << images.size() << " images");
+	
+	return payload_size;
+
+}
\ No newline at end of file
@@ -0,0 +1,46 @@
+#ifndef SHARD_HPP
+#define SHARD_HPP
+
+#include <string>
+#include <vector>
+#include <span>
+#include <cstdint>
+
+#include "steg.hpp"
+
+/*/
+ *	Sharding, spreading one payload over several cover images
+ *
+ *	The payload is split into one part per cover, each sized in proportion to what its cover holds at the bit count
+ *	used for all of them, so the covers fill up evenly. Every part is embedded behind a shard header (see steg.hpp)
+ *	giving the set it belongs to, its index, the number of parts, and its offset in the payload.
+ *
+ *	The covers are the unit of parallelism: each is read, encoded, and written on its own worker thread, and when
+ *	extracting each part is decoded on its own worker and written straight to its offset in the output file. The
+ *	images may be given in any order, but every part of the set has to be there.
+ *
+/*/
+
+struct shard_options {
+	
+	// Bit count used in every cover, 0 picks the minimum that fits the payload into all of them together
+	uint8_t bits{0};
+	lz_level compression{lz_level::none};
+	bool checked{false};
+	uint8_t channels{CHANNELS_ALL};
+	bool map_images{false};
+
+};
+
+// Largest part of a payload that fits in an image of image_bytes at n bits, compressed or not
+uint64_t shard_capacity(size_t image_bytes, uint8_t bits, bool checked = false);
+
+// Split data over the covers and write the image made from covers[i] to outputs[i], returns the bit count used
+// Throws if the covers can't hold the data between them
+uint8_t shard_hide(const std::vector<std::string> &covers, const std::vector<std::string> &outputs, std::span<const uint8_t> data, const shard_options &options = {});
+
+// Extract every part of a sharded payload from the images and write each to its offset in the file open as output_fd
+// Throws unless the images hold exactly one complete set, returns the payload size
+uint64_t shard_extract(const std::vector<std::string> &images, int output_fd, const shard_options &options = {});
+
+#endif
\ No newline at end of file
@@ -1,264 +1,908 @@
+#include <cstring>
+
 #include "steg.hpp"
+#include "lsb.hpp"
+#include "parallel.hpp"
 
-// Total needed data: 3 bytes (determine bitness) + (4 + data.size()) * 8 / bits
-bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data, uint8_t bits) {
+size_t steg_header::prefix_bytes() const {
+	return this->version ? 11 : 3;
+}
+
+size_t steg_header::length_bytes() const {
+	return this->version ? 10 : 4;
+}
+
+// Image bytes needed to store this data:
+//	the prefix + the ceiling of (the length bytes + the data size) * 8 / bits
+//  prefix -> bytes needed to decode the bitness (and the header version)
+//  length bytes -> the data size (and the version and flags) stored ahead of the data
+size_t steg_header::image_bytes() const {
+	return this->prefix_bytes() + lsb_cover_bytes(this->length_bytes() + this->data_size, this->bits);
+}
+
+steg_header make_header(uint64_t data_size, uint8_t bits, uint8_t flags) {
+	
+	steg_header header;
+	
+	header.bits = bits;
+	header.flags = flags;
+	header.data_size = data_size;
+	
+	// Only a larger data size or flags need the newer header
+	if(data_size > UINT32_MAX || flags)
+		header.version = STEG_HEADER_VERSION;
+	
+	return header;
+
+}
+
+size_t image_bytes_needed(uint64_t data_size, uint8_t bits, uint8_t flags) {
+	return make_header(data_size, bits, flags).image_bytes();
+}
+
+void write_shard(const shard_header &shard, uint8_t *dst) {
+	
+	// Each field is stored most significant byte first
+	for(size_t c = 0; c < sizeof(uint64_t); c++) {
+		dst[7 - c] = (shard.set_id >> (c << 3)) & 0xFF;
+		dst[23 - c] = (shard.offset >> (c << 3)) & 0xFF;
+	}
+	
+	for(size_t c = 0; c < sizeof(uint32_t); c++) {
+		dst[11 - c] = (shard.index >> (c << 3)) & 0xFF;
+		dst[15 - c] = (shard.count >> (c << 3)) & 0xFF;
+	}
+
+}
+
+shard_header read_shard(const uint8_t *src) {
+	
+	shard_header shard;
+	
+	for(size_t c = 0; c < sizeof(uint64_t); c++) {
+		shard.set_id = (shard.set_id << 8) | src[c];
+		shard.offset = (shard.offset << 8) | src[16 + c];
+	}
+	
+	for(size_t c = 0; c < sizeof(uint32_t); c++) {
+		shard.index = (shard.index << 8) | src[8 + c];
+		shard.count = (shard.count << 8) | src[12 + c];
+	}
+	
+	return shard;
+
+}
+
+// Bytes at the front of the extracted data taken up by a shard header, if the header says there is one
+static size_t shard_size(const steg_header &header) {
+	return header.flags & STEG_FLAG_SHARD ? STEG_SHARD_BYTES : 0;
+}
+
+void write_prefix(pixel_view pixels, const steg_header &header) {
+	
+	size_t prefix_bytes = header.prefix_bytes();
+	
+	// Version 1 leaves the first three bits clear and moves the bitness to the next three, the rest are reserved
+	uint32_t prefix = header.version ? header.bits << 5 : header.bits;
+	
+	// Set the image bytes' least significant bits such that they will encode the prefix, most significant bit first
+	for(size_t byte_cursor = 0; byte_cursor < prefix_bytes; byte_cursor++) {
+		pixels[byte_cursor] &= 0xFE;
+		pixels[byte_cursor] |= (prefix >> (prefix_bytes - 1 - byte_cursor)) & 1;
+	}
+
+}
+
+size_t write_length(const steg_header &header, uint8_t *stream) {
+	
+	size_t length_bytes = header.length_bytes();
+	size_t size_bytes = header.version ? sizeof(uint64_t) : sizeof(uint32_t);
+	
+	if(header.version) {
+		stream[0] = header.version;
+		stream[1] = header.flags;
+	}
+	
+	// The data size is stored most significant byte first
+	for(size_t c = 0; c < size_bytes; c++)
+		stream[length_bytes - 1 - c] = (header.data_size >> (c << 3)) & 0xFF;
+	
+	return length_bytes;
+
+}
+
+size_t head_size(const steg_header &header) {
+	
+	size_t length_bytes = header.length_bytes();
+	
+	return std::min<uint64_t>((length_bytes + header.bits - 1) / header.bits * header.bits, length_bytes + header.data_size);
+
+}
+
+// Encode stream bytes into the pixels starting at image byte cover_offset, which must be on a group boundary
+static void encode_range(pixel_view pixels, size_t cover_offset, const uint8_t *src, size_t len, uint8_t bits) {
+	
+	if(pixels.contiguous()) {
+		lsb_encode(pixels.base + cover_offset, src, len, bits);
+		return;
+	}
+	
+	// Padded rows and selected channels are staged through a small buffer, a whole number of groups at a time
+	std::vector<uint8_t> staging(STEG_STAGING_BYTES);
+	size_t block = STEG_STAGING_BYTES / 8 * bits;
+	
+	while(len) {
+		
+		size_t stream_bytes = std::min(len, block);
+		size_t cover_bytes = lsb_cover_bytes(stream_bytes, bits);
+		
+		pixels.copy_to(cover_offset, cover_bytes, staging.data());
+		lsb_encode(staging.data(), src, stream_bytes, bits);
+		pixels.copy_from(cover_offset, cover_bytes, staging.data());
+		
+		cover_offset += cover_bytes;
+		src += stream_bytes;
+		len -= stream_bytes;
+	
+	}
+
+}
+
+// Decode stream bytes from the pixels starting at image byte cover_offset, which must be on a group boundary
+static void decode_range(const_pixel_view pixels, size_t cover_offset, uint8_t *dst, size_t len, uint8_t bits) {
+	
+	if(pixels.contiguous()) {
+		lsb_decode(pixels.base + cover_offset, dst, len, bits);
+		return;
+	}
+	
+	std::vector<uint8_t> staging(STEG_STAGING_BYTES);
+	size_t block = STEG_STAGING_BYTES / 8 * bits;
+	
+	while(len) {
+		
+		size_t stream_bytes = std::min(len, block);
+		size_t cover_bytes = lsb_cover_bytes(stream_bytes, bits);
+		
+		pixels.copy_to(cover_offset, cover_bytes, staging.data());
+		lsb_decode(staging.data(), dst, stream_bytes, bits);
+		
+		cover_offset += cover_bytes;
+		dst += stream_bytes;
+		len -= stream_bytes;
+	
+	}
+
+}
+
+// Split len stream bytes into runs of whole groups, one per thread, and call range(stream_offset, cover_offset, len) for each
+// Each group of bits stream bytes is exactly 8 image bytes, so the runs never share an image byte
+// Stays on the calling thread when there is too little work to be worth waking the others
+static void split_stream(size_t len, uint8_t bits, const std::function<void(size_t, size_t, size_t)> &range) {
+	
+	size_t groups = len / bits;
+	size_t threads = std::min<size_t>(get_thread_count(), lsb_cover_bytes(len, bits) / STEG_THREAD_MIN_BYTES);
+	
+	if(threads <= 1) {
+		range(0, 0, len);
+		return;
+	}
+	
+	size_t groups_per_thread = (groups + threads - 1) / threads;
+	
+	parallel_for(threads, [&](size_t thread) {
+		
+		size_t first = std::min(groups, thread * groups_per_thread);
+		size_t stream_offset = first * bits;
+		
+		// The last run also takes the trailing partial group
+		size_t stream_end = thread == threads - 1 ? len : std::min(groups, first + groups_per_thread) * bits;
+		
+		if(stream_end > stream_offset)
+			range(stream_offset, first * 8, stream_end - stream_offset);
+	
+	});
+
+}
+
+void encode_stream(pixel_view pixels, size_t cover_offset, const uint8_t *src, size_t len, uint8_t bits) {
+	split_stream(len, bits, [&](size_t stream_offset, size_t range_offset, size_t range_len) {
+		encode_range(pixels, cover_offset + range_offset, src + stream_offset, range_len, bits);
+	});
+}
+
+static void decode_stream(const_pixel_view pixels, size_t cover_offset, uint8_t *dst, size_t len, uint8_t bits) {
+	split_stream(len, bits, [&](size_t stream_offset, size_t range_offset, size_t range_len) {
+		decode_range(pixels, cover_offset + range_offset, dst + stream_offset, range_len, bits);
+	});
+}
+
+// Decode stream bytes [stream_offset, stream_offset + len), which may start part way through a group
+static void decode_stream_at(const_pixel_view pixels, size_t prefix_bytes, uint64_t stream_offset, uint8_t *dst, size_t len, uint8_t bits) {
+	
+	size_t lead = stream_offset % bits;
+	size_t cover_offset = prefix_bytes + lsb_cover_bytes(stream_offset - lead, bits);
+	
+	if(!lead) {
+		decode_stream(pixels, cover_offset, dst, len, bits);
+		return;
+	}
+	
+	// Decode the partial first group on its own, then everything after it straight into dst
+	uint8_t group[8];
+	size_t head = std::min<size_t>(bits - lead, len);
+	
+	decode_stream(pixels, cover_offset, group, lead + head, bits);
+	std::memcpy(dst, group + lead, head);
+	
+	if(len > head)
+		decode_stream(pixels, cover_offset + 8, dst + head, len - head, bits);
+
+}
+
+// Read the least significant bits of image bytes [first, first + 3) as a bit count
+static uint8_t prefix_bits(const_pixel_view pixels, size_t first) {
+	
+	uint8_t bits = 0;
+	
+	for(size_t byte_cursor = first; byte_cursor < first + 3; byte_cursor++) {
+		bits <<= 1;
+		bits |= pixels[byte_cursor] & 1;
+	}
+	
+	return bits;
+
+}
+
+steg_header read_header(const_pixel_view pixels) {
+	
+	trace_span trace(trace_phase::header);
+	
+	steg_header header;
+	
+	if(pixels.size() < header.prefix_bytes())
+		throw std::runtime_error("Image is too small to contain encoded data.");
+	
+	header.bits = prefix_bits(pixels, 0);
+	
+	// A bit count of 0 is only ever written ahead of a version 1 header
+	if(!header.bits) {
+		
+		header.version = STEG_HEADER_VERSION;
+		
+		if(pixels.size() < header.prefix_bytes())
+			throw std::runtime_error("No encoded data found in this image.");
+		
+		header.bits = prefix_bits(pixels, 3);
+		
+		if(!header.bits)
+			throw std::runtime_error("No encoded data found in this image.");
+	
+	}
+	
+	VERBOSE_LOG("Bits used in encoding: " << (uint16_t)header.bits);
+	
+	if(header.prefix_bytes() + lsb_cover_bytes(header.length_bytes(), header.bits) > pixels.size())
+		throw std::runtime_error("Image is too small to contain encoded data.");
+	
+	uint8_t length[16];
+	size_t length_bytes = header.length_bytes();
+	decode_stream(pixels, header.prefix_bytes(), length, length_bytes, header.bits);
+	
+	if(header.version) {
+		
+		// Anything other than version 1 with known flags is most likely an image that was never encoded
+		if(length[0] != STEG_HEADER_VERSION || (length[1] & ~STEG_KNOWN_FLAGS))
+			throw std::runtime_error("No encoded data found in this image.");
+		
+		header.flags = length[1];
+	
+	}
+	
+	// The data size is stored most significant byte first
+	for(size_t c = length_bytes - (header.version ? sizeof(uint64_t) : sizeof(uint32_t)); c < length_bytes; c++)
+		header.data_size = (header.data_size << 8) | length[c];
+	
+	return header;
+
+}
 
+// Read the header and make sure the data it describes fits in the image
+static steg_header checked_header(const_pixel_view pixels) {
+	
+	steg_header header = read_header(pixels);
+	
+	VERBOSE_LOG("Data size: " << header.data_size);
+	
+	if(header.data_size > pixels.size() || header.image_bytes() > pixels.size())
+		throw std::runtime_error("Encoded data size exceeds the capacity of this image.");
+	
+	return header;
+
+}
+
+// Embed data as it is, under a header with the given flags
+static void hide_stream(pixel_view pixels, std::span<const uint8_t> data, uint8_t bits, uint8_t flags) {
+	
+	trace_span trace(trace_phase::embed, data.size());
+	
 	VERBOSE_LOG("Begin encoding");
 	
-	if(bits > 8 && bits)
-		throw std::runtime_error("Bit count exceeds bits per channel.");
+	if(!bits || bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
 	
-	size_t image_bytes = orig_file.size();
-	// Image bytes needed to store this data:
-	//	3 + the ceiling of 8 / bits (image bytes needed for each data byte) times 4 + the data size
-	//  3 -> bytes needed to decode the bitness
-	//  4 -> 32 bits used to determine the data size on decode
-	size_t bytes_needed = 3 + (size_t)std::ceil((4 + data.size()) * (8.f / bits));
+	steg_header header = make_header(data.size(), bits, flags);
+	
+	size_t image_bytes = pixels.size();
+	size_t needed = header.image_bytes();
 	
 	// Check if we have the space needed to store this document in this image's lowest n bits
-	if(bytes_needed > image_bytes) {
+	if(needed > image_bytes) {
 		
 		std::stringstream err_s_str;
 		
-		err_s_str << "Not enough space in this image (" << image_bytes << ") to store this data set (" << bytes_needed << " bytes needed) for " << bits << " bits.";
+		err_s_str << "Not enough space in this image (" << image_bytes << ") to store this data set (" << needed << " bytes needed) for " << (uint16_t)bits << " bits.";
 		
 		throw std::runtime_error(err_s_str.str());
-		
+	
 	}
 	
-	uint32_t byte_cursor = 0;
+	write_prefix(pixels, header);
 	
-	// Set the first three image bytes' least significant bits such that they will encode the bitness
-	while(byte_cursor < 3) {
-		orig_file[byte_cursor] &= 0xFE;
-		orig_file[byte_cursor] |= (bits >> (2 - byte_cursor)) & 1;
-		byte_cursor++;
-	}	
+	VERBOSE_LOG("Data size: " << header.data_size);
 	
-	// Grab the data size in a uint32_t so we can put it at the beginning of the data set
-	uint32_t data_size = data.size();
+	// Scalar prologue: the length bytes followed by the first data bytes up to a group boundary
+	uint8_t head[16];
+	size_t head_bytes = head_size(header);
+	size_t length_bytes = write_length(header, head);
 	
-	VERBOSE_LOG("Data size: " << data_size);
+	std::memcpy(head + length_bytes, data.data(), head_bytes - length_bytes);
 	
-	// Put the data size at the beginning of the data set
-	data.insert(data.begin(), (uint8_t)((data_size) & 0xFF));
-	data.insert(data.begin(), (uint8_t)((data_size >> 8) & 0xFF));
-	data.insert(data.begin(), (uint8_t)((data_size >> 16) & 0xFF));
-	data.insert(data.begin(), (uint8_t)(data_size >> 24));
+	size_t prefix_bytes = header.prefix_bytes();
+	encode_stream(pixels, prefix_bytes, head, head_bytes, bits);
 	
-	// Bitmask used to get the lowest n bits
-	// Complement can be used to get the highest 8 - n bits
-	uint8_t bitmask = (1 << bits) - 1;
+	// Everything after the prologue is group aligned and goes straight through the kernels
+	size_t head_data = head_bytes - length_bytes;
+	encode_stream(pixels, prefix_bytes + lsb_cover_bytes(head_bytes, bits), data.data() + head_data, data.size() - head_data, bits);
 	
-	// Keep track of how many bits are still available to use in this image byte
-	uint8_t image_bits_remaining = bits;
-	// Clear the lower n bits of this image byte for storing data
-	orig_file[byte_cursor] &= ~bitmask;
+	// The byte following a completely filled final image byte also has its lowest n bits cleared
+	if(needed < image_bytes && !(((length_bytes + data.size()) << 3) % bits))
+		pixels[needed] &= ~((1 << bits) - 1);
 	
-	// Keep track of how many data bits are remaining in this data byte
-	uint8_t data_bits_remaining;
+	VERBOSE_LOG("Finished encoding");
+
+}
 
-	// Insert each data byte into the image
-	for(uint32_t c = 0; c < data.size(); c++) {
+void hide_data(pixel_view pixels, std::span<const uint8_t> data, uint8_t bits) {
+	hide_stream(pixels, data, bits, 0);
+}
+
+uint8_t minimum_bits(size_t image_bytes, uint64_t data_size, uint8_t flags) {
+	
+	VERBOSE_LOG("Determining minimum bit count");
+	
+	// Try each bit count against the exact space it needs, data_size is checked first so the byte counts can't overflow
+	for(uint8_t bits = 1; bits < 8 && data_size <= image_bytes; bits++) {
 		
-		data_bits_remaining = 8;
+		size_t bytes_needed = image_bytes_needed(data_size, bits, flags);
 		
-		if(image_bits_remaining < bits) {
-			
-			// Get the top k bits that will still fit in this channel's byte
-			// Store those in the lowest k bits of the channel's byte and mark to get the next image byte after
-			orig_file[byte_cursor] |= (data[c] >> (data_bits_remaining - image_bits_remaining));
-			
-			data_bits_remaining -= image_bits_remaining;
-			
-			// Grab the next image byte
-			byte_cursor++;
-			image_bits_remaining = bits;
-			
-			// Clear the lowest n bits for writing
-			orig_file[byte_cursor] &= ~bitmask;
-			
-		}
+		VERBOSE_LOG("Bytes needed at " << (uint16_t)bits << " bits per byte: " << bytes_needed);
 		
-		// Loop until we have written this data byte's full contents
-		do {
+		if(bytes_needed <= image_bytes)
+			return bits;
+	
+	}
+	
+	throw std::runtime_error("Image is too small to store this data set.");
+
+}
+
+uint64_t data_capacity(size_t image_bytes, uint8_t bits, uint8_t flags) {
+	
+	// Whole stream bytes that fit after the prefix, less the length bytes, for each header version
+	steg_header header = make_header(0, bits, flags);
+	if(image_bytes < header.prefix_bytes() || (image_bytes - header.prefix_bytes()) * bits / 8 < header.length_bytes())
+		return 0;
+	
+	uint64_t capacity = (image_bytes - header.prefix_bytes()) * bits / 8 - header.length_bytes();
+	if(capacity <= UINT32_MAX)
+		return capacity;
+	
+	// Too large for the original header, so the rest is only usable with the longer one
+	header = make_header(capacity, bits, flags);
+	
+	return std::max<uint64_t>((image_bytes - header.prefix_bytes()) * bits / 8 - header.length_bytes(), UINT32_MAX);
+
+}
+
+void hide_data(pixel_view pixels, std::span<const uint8_t> data) {
+	hide_data(pixels, data, minimum_bits(pixels.size(), data.size()));
+}
+
+uint8_t pack_data(std::span<const uint8_t> &data, std::vector<uint8_t> &storage, lz_level compression, bool checked) {
+	
+	uint8_t flags = 0;
+	
+	if(compression != lz_level::none) {
 		
-			// If our image byte does not have more space than we have data to write, write what we can and move to the next image byte
-			if(data_bits_remaining >= image_bits_remaining) {
-			
-				// If we still have space in this image byte, write what we can of our data
-				if(image_bits_remaining) {
-					
-					orig_file[byte_cursor] |= (data[c] >> (data_bits_remaining - bits)) & bitmask;
-					
-					data_bits_remaining -= image_bits_remaining;
-					
-				}
-			
-				byte_cursor++;
-				image_bits_remaining = bits;
-				
-				orig_file[byte_cursor] &= ~bitmask;
-			
-			}
-			// Otherwise, write the remainder of our data bits and exit the loop
-			else {
-				
-				orig_file[byte_cursor] |= (data[c] & ((1 << data_bits_remaining) - 1)) << (image_bits_remaining - data_bits_remaining);
-				
-				// Used to indicate that there are still bits left in this image byte that can be used by the next data byte
-				image_bits_remaining -= data_bits_remaining;
-				
-				break;
-				
-			}
-			
-		} while(data_bits_remaining);
+		trace_span trace(trace_phase::compress, data.size());
+		std::vector<uint8_t> compressed = lz_compress(data, compression);
+		
+		VERBOSE_LOG("Compressed " << data.size() << " bytes to " << compressed.size());
 		
+		if(compressed.size() < data.size()) {
+			storage = std::move(compressed);
+			data = storage;
+			flags = STEG_FLAG_COMPRESSED;
+		}
+	
 	}
 	
-	VERBOSE_LOG("Finished encoding");
+	if(checked) {
+		storage = chunk_frame(data);
+		data = storage;
+		flags |= STEG_FLAG_CHECKED;
+	}
 	
-	return orig_file;
+	return flags;
+
+}
+
+void hide_data(pixel_view pixels, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked) {
+	
+	std::vector<uint8_t> storage;
+	uint8_t flags = pack_data(data, storage, compression, checked);
+	
+	if(!bits)
+		bits = minimum_bits(pixels.size(), data.size(), flags);
 	
+	hide_stream(pixels, data, bits, flags);
+
+}
+
+void hide_shard(pixel_view pixels, const shard_header &shard, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked) {
+	
+	// The shard header goes in front of the data, so it is compressed and checked along with it
+	std::vector<uint8_t> sharded(STEG_SHARD_BYTES + data.size());
+	write_shard(shard, sharded.data());
+	std::memcpy(sharded.data() + STEG_SHARD_BYTES, data.data(), data.size());
+	
+	std::span<const uint8_t> packed = sharded;
+	std::vector<uint8_t> storage;
+	uint8_t flags = pack_data(packed, storage, compression, checked) | STEG_FLAG_SHARD;
+	
+	if(!bits)
+		bits = minimum_bits(pixels.size(), packed.size(), flags);
+	
+	hide_stream(pixels, packed, bits, flags);
+
+}
+
+void hide_data(bmp_file &image, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked) {
+	hide_data(image.view(), data, bits, compression, checked);
+}
+
+void hide_data(std::span<uint8_t> pixels, std::span<const uint8_t> data, uint8_t bits) {
+	hide_data(pixel_view(pixels), data, bits);
+}
+
+void hide_data(std::span<uint8_t> pixels, std::span<const uint8_t> data) {
+	hide_data(pixel_view(pixels), data);
+}
+
+void hide_data(bmp_file &image, std::span<const uint8_t> data, uint8_t bits) {
+	hide_data(image.view(), data, bits);
+}
+
+void hide_data(bmp_file &image, std::span<const uint8_t> data) {
+	hide_data(image.view(), data);
+}
+
+bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data, uint8_t bits) {
+	
+	hide_data(orig_file.view(), std::span<const uint8_t>(data), bits);
+	
+	return orig_file;
+
 }
 
 bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data) {
+	
+	hide_data(orig_file.view(), std::span<const uint8_t>(data));
+	
+	return orig_file;
 
-	VERBOSE_LOG("Determining minimum bit count");
+}
+
+bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data, lz_level compression) {
+	
+	hide_data(orig_file.view(), std::span<const uint8_t>(data), 0, compression);
+	
+	return orig_file;
 
-	double bit_count = 3 + ((data.size() + 4) << 3);
+}
+
+// Size of the data once checked and decompressed, shard header included
+static uint64_t unpacked_size(const_pixel_view pixels, steg_header header) {
 	
-	VERBOSE_LOG("Total bits: " << bit_count);
+	if(!(header.flags & STEG_FLAG_COMPRESSED)) {
+		
+		if(!(header.flags & STEG_FLAG_CHECKED))
+			return header.data_size;
+		
+		uint64_t raw_size;
+		if(!chunk_raw_size(header.data_size, raw_size))
+			throw std::runtime_error("Chunked data is truncated.");
+		
+		return raw_size;
+	
+	}
 	
-	uint64_t bits_needed = (uint64_t)std::ceil(bit_count / orig_file.size());
+	header = checked_header(pixels);
 	
-	VERBOSE_LOG("Bits needed per byte: " << bits_needed);
+	if(header.data_size < sizeof(uint64_t) + (header.flags & STEG_FLAG_CHECKED ? CHUNK_CRC_BYTES : 0))
+		throw std::runtime_error("Compressed data is corrupt.");
 	
-	if(bits_needed < 8)
-		return hide_data(orig_file, data, bits_needed);
-	else
-		throw std::runtime_error("Image is too small to store this data set.");
+	// The raw size is the first thing in the container, straight after the length bytes and ahead of any CRC
+	uint8_t head[32];
+	size_t length_bytes = header.length_bytes();
+	
+	decode_stream(pixels, header.prefix_bytes(), head, length_bytes + sizeof(uint64_t), header.bits);
+	
+	return lz_raw_size(head + length_bytes);
 
 }
 
-std::vector<uint8_t> extract_data(bmp_file modified_file) {
+uint64_t extracted_size(const_pixel_view pixels) {
 	
-	VERBOSE_LOG("Begin extracting");
+	steg_header header = checked_header(pixels);
+	uint64_t size = unpacked_size(pixels, header);
+	
+	if(size < shard_size(header))
+		throw std::runtime_error("Shard header is truncated.");
+	
+	return size - shard_size(header);
+
+}
+
+uint64_t extracted_size(std::span<const uint8_t> pixels) {
+	return extracted_size(const_pixel_view(pixels));
+}
+
+uint64_t extracted_size(const bmp_file &image) {
+	return extracted_size(image.view());
+}
+
+std::string probe_image(const bmp_file &image, uint8_t channels) {
+	
+	const_pixel_view pixels = image.view(channels);
+	std::stringstream description;
 	
-	uint8_t encoding_bits = 0;
-	size_t byte_cursor = 0;
+	description << "bpp=" << image.bits_per_pixel() << "\twidth=" << image.width() << "\theight=" << image.height();
+	
+	// An image without a readable header, or with one describing more data than fits, holds no encoded data
+	try {
+		
+		steg_header header = read_header(pixels);
+		if(header.data_size > pixels.size() || header.image_bytes() > pixels.size())
+			throw std::runtime_error("Encoded data size exceeds the capacity of this image.");
+		
+		description << "\tbits=" << (uint16_t)header.bits << "\tversion=" << (uint16_t)header.version << "\tflags=" << (uint16_t)header.flags << "\tdata_size=" << header.data_size;
 	
-	while(byte_cursor < 3) {
-		encoding_bits <<= 1;
-		encoding_bits |= modified_file[byte_cursor++] & 1;
 	}
+	catch(const std::runtime_error &) {
+		description << "\tbits=0";
+	}
+	
+	description << "\tcapacity=";
+	for(uint8_t bits = 1; bits < 8; bits++)
+		description << (bits > 1 ? "," : "") << data_capacity(pixels.size(), bits);
 	
-	VERBOSE_LOG("Bits used in encoding: " << (uint16_t)encoding_bits);
+	return description.str();
+
+}
+
+// Pass the embedded bytes to the sink as they are, whatever the header's flags
+static void extract_stored(const_pixel_view pixels, const steg_header &header, const data_sink &sink) {
 	
-	// Initial image bits
-	uint8_t image_bits_remaining = encoding_bits;
+	uint8_t encoding_bits = header.bits;
 	
-	// Start off with as many bits as are needed to store the size of this data set (default 8 * 4 = 32)
-	uint8_t data_bits_remaining = sizeof(uint32_t) << 3;
-	// Bitmask for getting the lowest n bits
-	uint8_t bitmask = (1 << encoding_bits) - 1;
-	// Initialize data_size to 0 so we can shift and OR to get the size from the encoded data
-	uint32_t data_size = 0;
+	uint8_t head[16];
+	size_t head_bytes = head_size(header);
+	size_t length_bytes = header.length_bytes();
 	
-	do {
+	decode_stream(pixels, header.prefix_bytes(), head, head_bytes, encoding_bits);
+	if(head_bytes > length_bytes)
+		sink(head + length_bytes, head_bytes - length_bytes);
+	
+	// Only one block of decoded data is held at a time, whatever the data size
+	// With several threads, the block is made large enough to give each of them a share
+	size_t block = STEG_STAGING_BYTES / 8 * encoding_bits;
+	if(get_thread_count() > 1)
+		block = std::max<size_t>(block, get_thread_count() * (STEG_THREAD_MIN_BYTES / 8 * encoding_bits));
+	
+	size_t cover_offset = header.prefix_bytes() + lsb_cover_bytes(head_bytes, encoding_bits);
+	size_t remaining = header.data_size - (head_bytes - length_bytes);
+	
+	std::vector<uint8_t> decoded(std::min(remaining, block));
+	
+	while(remaining) {
 		
-		// Check if the data_size variable can still fit all n least significant bits
-		if(data_bits_remaining >= encoding_bits) {
-			
-			// Shift left by n to make room for the next n bits
-			data_size <<= encoding_bits;
-			
-			// Put the lowest n bits into data_size
-			data_size |= modified_file[byte_cursor++] & bitmask;
-			
-			// Subtract from the remaining data bits
-			data_bits_remaining -= encoding_bits;
-			
-		}
-		else {
-			
-			// Make room for the last bits we need at the end of data_size
-			data_size <<= data_bits_remaining;
-			
-			// Grab only the top n - remaining bits from this image byte into the end of the data_size
-			data_size |= (modified_file[byte_cursor] & bitmask) >> (encoding_bits - data_bits_remaining);
+		size_t stream_bytes = std::min(remaining, block);
+		
+		decode_stream(pixels, cover_offset, decoded.data(), stream_bytes, encoding_bits);
+		sink(decoded.data(), stream_bytes);
+		
+		cover_offset += lsb_cover_bytes(stream_bytes, encoding_bits);
+		remaining -= stream_bytes;
+	
+	}
+
+}
+
+payload_decoder::payload_decoder(const steg_header &header, data_sink sink, shard_header *shard) : input(std::move(sink)), data_size(header.data_size) {
+	
+	// Chain the decoders back to front, checking comes before decompressing, which comes before taking off the shard header
+	if(header.flags & STEG_FLAG_SHARD) {
+		
+		this->sharded = true;
+		this->shard_pending = STEG_SHARD_BYTES;
+		
+		this->input = [this, shard, sink = std::move(this->input)](const uint8_t *data, size_t len) {
 			
-			// Subtract the last used bits from our remaining image bits so we don't grab them again in the start of the first data byte
-			image_bits_remaining -= data_bits_remaining;
+			size_t taken = std::min(len, this->shard_pending);
+			std::memcpy(this->shard_bytes + STEG_SHARD_BYTES - this->shard_pending, data, taken);
+			this->shard_pending -= taken;
 			
-			data_bits_remaining = 0;
+			if(taken && !this->shard_pending && shard)
+				*shard = read_shard(this->shard_bytes);
 			
-		}
+			if(len > taken)
+				sink(data + taken, len - taken);
 		
-	// Loop until we have filled our data_size
-	} while(data_bits_remaining);
+		};
 	
-	VERBOSE_LOG("Data size: " << data_size);
+	}
 	
-	// Set our vector to the size of our data to extract
-	std::vector<uint8_t> extracted_data(data_size);
+	if(header.flags & STEG_FLAG_COMPRESSED) {
+		this->decompressor.emplace(this->input);
+		this->input = [this](const uint8_t *data, size_t len) { this->decompressor->feed(data, len); };
+	}
 	
-	// Decode every data byte
-	for(size_t c = 0; c < data_size; c++) {
+	if(header.flags & STEG_FLAG_CHECKED) {
 		
-		// This should already be 0, maybe unnecessary
-		extracted_data[c] = 0;
-		// Reset the number of data bits remaining
-		data_bits_remaining = 8;	
+		uint64_t raw_size;
+		if(!chunk_raw_size(header.data_size, raw_size))
+			throw std::runtime_error("Chunked data is truncated.");
 		
-		// Grab any leftover image bits from the last data byte
-		if(image_bits_remaining < encoding_bits) {
-			
-			extracted_data[c] |= modified_file[byte_cursor++] & ((1 << image_bits_remaining) - 1);
-			
-			data_bits_remaining -= image_bits_remaining;
-			
-			image_bits_remaining = encoding_bits;
-			
-		}
+		this->verifier.emplace(this->input);
+		this->input = [this](const uint8_t *data, size_t len) { this->verifier->feed(data, len); };
+	
+	}
+
+}
+
+void payload_decoder::feed(const uint8_t *data, size_t len) {
+	this->input(data, len);
+}
+
+uint64_t payload_decoder::finish() {
+	
+	uint64_t size = this->data_size;
+	
+	if(this->verifier)
+		size = this->verifier->finish();
+	
+	if(this->decompressor)
+		size = this->decompressor->finish();
+	
+	if(this->sharded) {
 		
-		do {
-			
-			// If there is enough room in this data byte to store the remainder of this image byte's data, extract it and move to the next image byte
-			if(data_bits_remaining >= image_bits_remaining) {
-				
-				if(image_bits_remaining) {
-					
-					extracted_data[c] <<= image_bits_remaining;	
-					extracted_data[c] |= modified_file[byte_cursor] & bitmask;
-					
-					data_bits_remaining -= image_bits_remaining;
-					
-				}
-				
-				byte_cursor++;
-				image_bits_remaining = encoding_bits;
-				
-			}
-			// Otherwise, extract the top k bits that will fit in this data byte and move onto the next data byte
-			else {
-				
-				extracted_data[c] <<= data_bits_remaining;
-				extracted_data[c] |= (modified_file[byte_cursor] & bitmask) >> (image_bits_remaining - data_bits_remaining);
-				
-				image_bits_remaining -= data_bits_remaining;
-				
-				data_bits_remaining = 0;
-				
-			}
-			
-		} while(data_bits_remaining);
+		if(this->shard_pending)
+			throw std::runtime_error("Shard header is truncated.");
 		
+		size -= STEG_SHARD_BYTES;
+	
 	}
 	
+	return size;
+
+}
+
+// Pass the raw data to the sink a block at a time, checking and decompressing it on the way as the header says
+static uint64_t extract_payload(const_pixel_view pixels, const steg_header &header, const data_sink &sink, shard_header *shard = nullptr) {
+	
+	payload_decoder decoder(header, sink, shard);
+	
+	extract_stored(pixels, header, [&decoder](const uint8_t *data, size_t len) { decoder.feed(data, len); });
+	
+	return decoder.finish();
+
+}
+
+size_t extract_data(const_pixel_view pixels, std::span<uint8_t> out) {
+	
+	VERBOSE_LOG("Begin extracting");
+	
+	steg_header header = checked_header(pixels);
+	trace_span trace(trace_phase::extract, header.data_size);
+	
+	if(header.flags) {
+		
+		if(extracted_size(pixels) > out.size())
+			throw std::runtime_error("Output buffer is too small for the encoded data set.");
+		
+		size_t written = 0;
+		uint64_t raw_size = extract_payload(pixels, header, [out, &written](const uint8_t *data, size_t len) {
+			std::memcpy(out.data() + written, data, len);
+			written += len;
+		});
+		
+		VERBOSE_LOG("Finished extracting");
+		
+		return raw_size;
+	
+	}
+	
+	if(header.data_size > out.size())
+		throw std::runtime_error("Output buffer is too small for the encoded data set.");
+	
+	// Decode the prologue and drop the length bytes from the front of it
+	uint8_t head[16];
+	size_t head_bytes = head_size(header);
+	size_t length_bytes = header.length_bytes();
+	size_t head_data = head_bytes - length_bytes;
+	
+	decode_stream(pixels, header.prefix_bytes(), head, head_bytes, header.bits);
+	std::memcpy(out.data(), head + length_bytes, head_data);
+	
+	// Then decode everything else straight into the output buffer
+	decode_stream(pixels, header.prefix_bytes() + lsb_cover_bytes(head_bytes, header.bits), out.data() + head_data, header.data_size - head_data, header.bits);
+	
+	VERBOSE_LOG("Finished extracting");
+	
+	return header.data_size;
+
+}
+
+size_t extract_data(std::span<const uint8_t> pixels, std::span<uint8_t> out) {
+	return extract_data(const_pixel_view(pixels), out);
+}
+
+size_t extract_data(const bmp_file &image, std::span<uint8_t> out) {
+	return extract_data(image.view(), out);
+}
+
+size_t extract_data(const_pixel_view pixels, const data_sink &sink) {
+	
+	VERBOSE_LOG("Begin extracting");
+	
+	steg_header header = checked_header(pixels);
+	trace_span trace(trace_phase::extract, header.data_size);
+	uint64_t data_size = extract_payload(pixels, header, sink);
+	
 	VERBOSE_LOG("Finished extracting");
 	
+	return data_size;
+
+}
+
+size_t extract_shard(const_pixel_view pixels, const data_sink &sink, shard_header &shard) {
+	
+	steg_header header = checked_header(pixels);
+	if(!(header.flags & STEG_FLAG_SHARD))
+		throw std::runtime_error("Image doesn't hold part of a sharded payload.");
+	
+	trace_span trace(trace_phase::extract, header.data_size);
+	
+	return extract_payload(pixels, header, sink, &shard);
+
+}
+
+size_t extract_data(std::span<const uint8_t> pixels, const data_sink &sink) {
+	return extract_data(const_pixel_view(pixels), sink);
+}
+
+size_t extract_data(const bmp_file &image, const data_sink &sink) {
+	return extract_data(image.view(), sink);
+}
+
+// Copies the part of the data passing through it that falls within [offset, offset + out.size()), position being the
+// data offset of the next byte it is given
+static data_sink range_sink(uint64_t offset, std::span<uint8_t> out, uint64_t &position) {
+	
+	return [offset, out, &position](const uint8_t *data, size_t len) {
+		
+		uint64_t start = std::max(position, offset);
+		uint64_t end = std::min<uint64_t>(position + len, offset + out.size());
+		
+		if(start < end)
+			std::memcpy(out.data() + (start - offset), data + (start - position), end - start);
+		
+		position += len;
+	
+	};
+
+}
+
+size_t extract_range(const_pixel_view pixels, uint64_t offset, std::span<uint8_t> out) {
+	
+	steg_header header = checked_header(pixels);
+	trace_span trace(trace_phase::extract, out.size());
+	uint64_t data_size = extracted_size(pixels);
+	
+	if(offset > data_size || out.size() > data_size - offset)
+		throw std::runtime_error("Requested range is outside the encoded data set.");
+	
+	if(out.empty())
+		return 0;
+	
+	size_t length_bytes = header.length_bytes();
+	
+	// A shard header only moves the data along, without stopping it being read in place
+	uint8_t flags = header.flags & ~STEG_FLAG_SHARD;
+	uint64_t data_offset = shard_size(header) + offset;
+	
+	if(!flags) {
+		decode_stream_at(pixels, header.prefix_bytes(), length_bytes + data_offset, out.data(), out.size(), header.bits);
+		return out.size();
+	}
+	
+	uint64_t position = 0;
+	
+	// Checked data is read a whole chunk at a time, so every byte returned has been checked
+	if(flags == STEG_FLAG_CHECKED) {
+		
+		uint64_t first_chunk = data_offset / CHUNK_BYTES;
+		uint64_t end_chunk = (data_offset + out.size() + CHUNK_BYTES - 1) / CHUNK_BYTES;
+		
+		uint64_t frame_start = first_chunk * CHUNK_FRAME_BYTES;
+		std::vector<uint8_t> frames(std::min(end_chunk * CHUNK_FRAME_BYTES, header.data_size) - frame_start);
+		
+		decode_stream_at(pixels, header.prefix_bytes(), length_bytes + frame_start, frames.data(), frames.size(), header.bits);
+		
+		position = first_chunk * CHUNK_BYTES;
+		
+		chunk_decoder verifier(range_sink(data_offset, out, position), first_chunk);
+		verifier.feed(frames.data(), frames.size());
+		verifier.finish();
+		
+		return out.size();
+	
+	}
+	
+	// There's no telling where compressed blocks start without decompressing everything ahead of them
+	extract_payload(pixels, header, range_sink(offset, out, position));
+	
+	return out.size();
+
+}
+
+size_t extract_range(std::span<const uint8_t> pixels, uint64_t offset, std::span<uint8_t> out) {
+	return extract_range(const_pixel_view(pixels), offset, out);
+}
+
+size_t extract_range(const bmp_file &image, uint64_t offset, std::span<uint8_t> out) {
+	return extract_range(image.view(), offset, out);
+}
+
+std::vector<uint8_t> extract_range(const bmp_file &image, uint64_t offset, size_t length) {
+	
+	std::vector<uint8_t> extracted_data(length);
+	
+	extract_range(image, offset, extracted_data);
+	
 	return extracted_data;
+
+}
+
+std::vector<uint8_t> extract_data(bmp_file modified_file) {
+	
+	// Set our vector to the size of our data to extract
+	std::vector<uint8_t> extracted_data(extracted_size(modified_file));
 	
+	extract_data(modified_file, extracted_data);
+	
+	return extracted_data;
+
 }
@@ -1,22 +1,202 @@
 #ifndef STEG_HPP
 #define STEG_HPP
 
-#include <cmath>
+#include <span>
+#include <functional>
+#include <optional>
 
 #include "bmp.hpp"
+#include "lz.hpp"
+#include "chunk.hpp"
 
-// Include logging headers and a logging macro only when PROG_VERBOSE is defined
-#ifdef PROG_VERBOSE
-	#include <iostream>
-	#include <bitset>
-	#define VERBOSE_LOG(a) (std::cout << a << '\n')
-#else
-	#define VERBOSE_LOG(a) {}
-#endif
+// Phase spans and the VERBOSE_LOG progress messages
+#include "trace.hpp"
 
+// Copying interface, returns a modified copy of the image
 bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data, uint8_t bits);
 bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data);
+// Compresses the data first, picking the minimum bit count for the compressed size
+bmp_file hide_data(bmp_file orig_file, std::vector<uint8_t> data, lz_level compression);
 
 std::vector<uint8_t> extract_data(bmp_file modified_file);
+// Extract length data bytes starting at offset
+std::vector<uint8_t> extract_range(const bmp_file &image, uint64_t offset, size_t length);
+
+/*/
+ *	Header layout
+ *
+ *	Version 0 (the original layout): the bit count in the least significant bits of image bytes 0..2, most significant
+ *	bit first, then from image byte 3 on a stream of the 32-bit data size followed by the data.
+ *
+ *	Version 1: 000 in the least significant bits of image bytes 0..2, which version 0 never writes, the bit count in
+ *	those of image bytes 3..5, and bytes 6..10 reserved as 0. From image byte 11 on, one group after version 0's start,
+ *	a stream of the version, a flags byte, the 64-bit data size, and the data. All sizes are most significant byte first.
+ *
+ *	Version 0 is written whenever the data size fits in 32 bits and no flags are set, so existing images are unchanged.
+ *
+ *	Flags:
+ *		STEG_FLAG_COMPRESSED -> the data is an lz container (see lz.hpp), the data size being that of the container
+ *		STEG_FLAG_CHECKED -> the data is split into chunks each followed by a CRC (see chunk.hpp), the data size being
+ *			that of the framed data. When both are set the lz container is what was framed.
+ *		STEG_FLAG_SHARD -> the data, once checked and decompressed, starts with a shard header and holds one part of a
+ *			payload spread over several images (see shard.hpp). Extracting it gives that part without the header.
+ *
+/*/
+
+#define STEG_HEADER_VERSION 1
+
+#define STEG_FLAG_COMPRESSED 0x01
+#define STEG_FLAG_CHECKED 0x02
+#define STEG_FLAG_SHARD 0x04
+// Flags this version understands, a header with any others is not treated as one
+#define STEG_KNOWN_FLAGS (STEG_FLAG_COMPRESSED | STEG_FLAG_CHECKED | STEG_FLAG_SHARD)
+
+struct steg_header {
+	
+	uint8_t bits{0};
+	uint8_t version{0};
+	uint8_t flags{0};
+	uint64_t data_size{0};
+	
+	// Image bytes holding the bit count, the stream starts right after them
+	size_t prefix_bytes() const;
+	// Stream bytes ahead of the data
+	size_t length_bytes() const;
+	// Image bytes needed to hold the header and the data
+	size_t image_bytes() const;
+	
+};
+
+// Where one image's part of a sharded payload belongs, stored ahead of that part as 24 bytes, most significant byte first
+struct shard_header {
+	
+	// Picked at random when the payload is split, the same in every part of it
+	uint64_t set_id{0};
+	uint32_t index{0};
+	uint32_t count{0};
+	// Payload offset of the first byte of this part
+	uint64_t offset{0};
+
+};
+
+#define STEG_SHARD_BYTES 24
+
+void write_shard(const shard_header &shard, uint8_t *dst);
+shard_header read_shard(const uint8_t *src);
+
+// Header for a data set of the given size, in the oldest version able to describe it
+steg_header make_header(uint64_t data_size, uint8_t bits, uint8_t flags = 0);
+
+// Set the bit count prefix in the first prefix_bytes() image bytes
+void write_prefix(pixel_view pixels, const steg_header &header);
+// Write the start of the stream (the data size and, for version 1, the version and flags), returns length_bytes()
+size_t write_length(const steg_header &header, uint8_t *stream);
+// Stream bytes handled ahead of the kernels: the length bytes plus enough data to end on a group boundary
+size_t head_size(const steg_header &header);
+// Read the header from the start of the pixels, throws if no encoded data is found
+// The pixels need only cover the header, checking the data size against the image is left to the caller
+steg_header read_header(const_pixel_view pixels);
+
+// Image bytes needed to hide a data set of the given size at n bits per image byte
+size_t image_bytes_needed(uint64_t data_size, uint8_t bits, uint8_t flags = 0);
+// Smallest bit count that fits a data set of the given size into an image, throws if none does
+uint8_t minimum_bits(size_t image_bytes, uint64_t data_size, uint8_t flags = 0);
+// Largest data set that fits into an image at n bits per image byte, under a header with the given flags
+uint64_t data_capacity(size_t image_bytes, uint8_t bits, uint8_t flags = 0);
+
+// Compress and/or frame data the way hide_data does, returning the header flags describing the result
+// data is pointed into storage whenever it is changed
+uint8_t pack_data(std::span<const uint8_t> &data, std::vector<uint8_t> &storage, lz_level compression, bool checked);
+
+// Image bytes staged at a time when encoding into or decoding from padded rows
+#define STEG_STAGING_BYTES (64 * 1024)
+// Fewest image bytes given to each thread when an encode/decode is split across threads
+#define STEG_THREAD_MIN_BYTES (1024 * 1024)
+
+// Encode len stream bytes, starting at the start of a group, into the pixels from image byte cover_offset on
+// Split over the worker threads, for encoders that only hold part of an image at a time
+void encode_stream(pixel_view pixels, size_t cover_offset, const uint8_t *src, size_t len, uint8_t bits);
+
+// In-place interface, embeds directly into a caller-owned image or pixel buffer
+void hide_data(bmp_file &image, std::span<const uint8_t> data, uint8_t bits);
+void hide_data(bmp_file &image, std::span<const uint8_t> data);
+void hide_data(std::span<uint8_t> pixels, std::span<const uint8_t> data, uint8_t bits);
+void hide_data(std::span<uint8_t> pixels, std::span<const uint8_t> data);
+void hide_data(pixel_view pixels, std::span<const uint8_t> data, uint8_t bits);
+void hide_data(pixel_view pixels, std::span<const uint8_t> data);
+
+// Compress the data and/or add a CRC to every chunk of it before embedding it, flagged in the header so extract_data
+// undoes both again. Data that doesn't get any smaller is embedded uncompressed, a bit count of 0 picks the minimum
+// for the size embedded
+void hide_data(bmp_file &image, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked = false);
+void hide_data(pixel_view pixels, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked = false);
+// Embed one part of a sharded payload behind its shard header, compressed and/or checked like hide_data does
+void hide_shard(pixel_view pixels, const shard_header &shard, std::span<const uint8_t> data, uint8_t bits, lz_level compression = lz_level::none, bool checked = false);
+
+// Size of the data set encoded in an image once decompressed, used to size the buffer given to extract_data
+// Throws if the image holds no encoded data, or a header describing more data than fits in it
+uint64_t extracted_size(const bmp_file &image);
+uint64_t extracted_size(std::span<const uint8_t> pixels);
+uint64_t extracted_size(const_pixel_view pixels);
+
+// Tab-separated description of an image's format, any encoded header, and its capacity at each bit count, as printed
+// by --probe. Only the header bytes of the pixels are read, from the channels given (see convert.hpp)
+std::string probe_image(const bmp_file &image, uint8_t channels = CHANNELS_ALL);
+
+// Decode into a caller-provided buffer, returns the number of bytes written
+size_t extract_data(const bmp_file &image, std::span<uint8_t> out);
+size_t extract_data(std::span<const uint8_t> pixels, std::span<uint8_t> out);
+size_t extract_data(const_pixel_view pixels, std::span<uint8_t> out);
+
+// Decode out.size() data bytes starting at offset into a caller-provided buffer, returns the number of bytes written
+// Only the image bytes holding that range are touched, plus the whole chunks around it for checked data, so a lazily
+// opened or mapped image only reads those rows. Compressed data has to be decompressed from the start
+size_t extract_range(const bmp_file &image, uint64_t offset, std::span<uint8_t> out);
+size_t extract_range(std::span<const uint8_t> pixels, uint64_t offset, std::span<uint8_t> out);
+size_t extract_range(const_pixel_view pixels, uint64_t offset, std::span<uint8_t> out);
+
+// Receives decoded data in order, one block at a time
+using data_sink = std::function<void(const uint8_t *data, size_t len)>;
+
+// Decode a block at a time into a sink instead of a buffer holding the whole data set, returns the data size
+// Chunks that fail their CRC check throw before they reach the sink
+size_t extract_data(const bmp_file &image, const data_sink &sink);
+size_t extract_data(std::span<const uint8_t> pixels, const data_sink &sink);
+size_t extract_data(const_pixel_view pixels, const data_sink &sink);
+// Decode one part of a sharded payload into a sink, shard being filled in before any data reaches the sink
+// Throws if the image doesn't hold a shard
+size_t extract_shard(const_pixel_view pixels, const data_sink &sink, shard_header &shard);
+
+// Undoes whatever a header's flags say was done to the data before it was embedded, fed the embedded bytes in order
+class payload_decoder {
+
+public:
+
+	// The shard header of sharded data is taken off the front of it and stored in shard, when given
+	payload_decoder(const steg_header &header, data_sink sink, shard_header *shard = nullptr);
+	
+	payload_decoder(const payload_decoder &) = delete;
+	payload_decoder &operator=(const payload_decoder &) = delete;
+	
+	void feed(const uint8_t *data, size_t len);
+	
+	// Throws if the data was incomplete, returns its size once decoded
+	uint64_t finish();
+
+private:
+
+	data_sink input;
+	
+	std::optional<lz_decoder> decompressor;
+	std::optional<chunk_decoder> verifier;
+	
+	// Bytes of the shard header still to come, collected in shard_bytes
+	bool sharded{false};
+	size_t shard_pending{0};
+	uint8_t shard_bytes[STEG_SHARD_BYTES];
+	
+	uint64_t data_size;
+
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,582 @@
+#include <future>
+#include <optional>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "stream.hpp"
+#include "lsb.hpp"
+#include "async_io.hpp"
+
+// Reads an image's pixel rows one window at a time, fetching the next window in the background
+// Every window after the first starts on a group boundary, the first one also carries the 3 bitness bytes
+class window_reader {
+
+public:
+
+	window_reader(const bmp_file &image, std::istream &input, size_t window) :
+		image(image), input(input), image_bytes(image.size()), window_bytes(std::max<size_t>(window / 8 * 8, STREAM_MIN_WINDOW_BYTES)) {
+		
+		this->windows[0].resize(this->window_bytes + 3);
+		this->windows[1].resize(this->window_bytes + 3);
+		
+		this->prefetch(0, 0);
+	
+	}
+	
+	// Wait for any read still in flight, the input stream can't be abandoned while it is being read
+	~window_reader() {
+		if(this->pending.valid())
+			this->pending.wait();
+	}
+	
+	// Next window of unpadded pixel bytes, empty once the image is exhausted
+	std::span<uint8_t> next() {
+		
+		if(this->next_position >= this->image_bytes)
+			return {};
+		
+		this->pending.get();
+		
+		this->position = this->next_position;
+		size_t len = this->window_size(this->position);
+		uint8_t *window = this->windows[this->current].data();
+		
+		this->next_position += len;
+		this->current ^= 1;
+		
+		// Read the following window while the caller works on this one
+		if(this->next_position < this->image_bytes)
+			this->prefetch(this->next_position, this->current);
+		
+		return {window, len};
+	
+	}
+	
+	// Image byte index of the window last returned by next()
+	size_t window_position() const {
+		return this->position;
+	}
+	
+	// Stream bytes that fit in the image bytes of a window after any bitness bytes
+	size_t window_stream_bytes(uint8_t bits) const {
+		return this->window_bytes / 8 * bits;
+	}
+
+private:
+
+	const bmp_file &image;
+	std::istream &input;
+	
+	size_t image_bytes;
+	size_t window_bytes;
+	
+	pixel_buffer windows[2];
+	uint8_t current{0};
+	
+	size_t position{0};
+	size_t next_position{0};
+	
+	std::future<void> pending;
+	
+	size_t window_size(size_t window_position) const {
+		return std::min(this->image_bytes - window_position, window_position ? this->window_bytes : this->window_bytes + 3);
+	}
+	
+	void prefetch(size_t window_position, uint8_t buffer) {
+		this->pending = std::async(std::launch::async, [this, window_position, window = this->windows[buffer].data()]() {
+			this->image.read_rows(this->input, window_position, this->window_size(window_position), window);
+		});
+	}
+
+};
+
+// Stream bytes to handle in a window with room for len image bytes
+// Whole groups while the stream continues past this window, the final partial group otherwise
+static size_t window_stream_share(uint64_t stream_remaining, size_t len, uint8_t bits) {
+	
+	if(lsb_cover_bytes(stream_remaining, bits) <= len)
+		return stream_remaining;
+	
+	return len / 8 * bits;
+
+}
+
+uint8_t stream_bits(size_t image_bytes, uint64_t payload_size, uint8_t bits) {
+	
+	if(!bits)
+		bits = minimum_bits(image_bytes, payload_size);
+	
+	if(!bits || bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	size_t needed = make_header(payload_size, bits).image_bytes();
+	if(needed > image_bytes) {
+		
+		std::stringstream err_s_str;
+		
+		err_s_str << "Not enough space in this image (" << image_bytes << ") to store this data set (" << needed << " bytes needed) for " << (uint16_t)bits << " bits.";
+		
+		throw std::runtime_error(err_s_str.str());
+	
+	}
+	
+	return bits;
+
+}
+
+void stream_hide(std::istream &cover_input, std::ostream &output, std::istream &payload, uint64_t payload_size, uint8_t bits, size_t window) {
+	
+	VERBOSE_LOG("Begin stream encoding");
+	
+	// Only the headers are read up front, the pixels follow one window at a time
+	bmp_file image = bmp_file::read_headers(cover_input);
+	size_t image_bytes = image.size();
+	
+	bits = stream_bits(image_bytes, payload_size, bits);
+	
+	steg_header header = make_header(payload_size, bits);
+	size_t needed = header.image_bytes();
+	
+	image.write_headers(output);
+	
+	window_reader reader(image, cover_input, window);
+	std::vector<uint8_t> stream(reader.window_stream_bytes(bits));
+	
+	// The stream is the length bytes followed by the payload
+	uint8_t length[16];
+	size_t length_bytes = write_length(header, length);
+	size_t prefix_bytes = header.prefix_bytes();
+	
+	uint64_t stream_size = length_bytes + payload_size;
+	uint64_t stream_done = 0;
+	
+	// The byte following a completely filled final image byte also has its lowest n bits cleared
+	size_t clear_index = (needed < image_bytes && !((stream_size << 3) % bits)) ? needed : SIZE_MAX;
+	
+	for(std::span<uint8_t> cover = reader.next(); !cover.empty(); cover = reader.next()) {
+		
+		size_t position = reader.window_position();
+		size_t offset = 0;
+		
+		// The first window starts with the prefix, which the minimum window size always fits
+		if(!position) {
+			write_prefix(pixel_view(cover), header);
+			offset = prefix_bytes;
+		}
+		
+		if(stream_done < stream_size) {
+			
+			size_t stream_bytes = window_stream_share(stream_size - stream_done, cover.size() - offset, bits);
+			
+			// Gather this window's share of the stream: any remaining length bytes, then payload
+			size_t filled = 0;
+			for(; stream_done + filled < length_bytes && filled < stream_bytes; filled++)
+				stream[filled] = length[stream_done + filled];
+			
+			if(filled < stream_bytes && !payload.read((char *)stream.data() + filled, stream_bytes - filled))
+				throw std::runtime_error("Payload ended before the given data size.");
+			
+			trace_span trace(trace_phase::embed, stream_bytes);
+			lsb_encode(cover.data() + offset, stream.data(), stream_bytes, bits);
+			stream_done += stream_bytes;
+		
+		}
+		
+		if(clear_index >= position && clear_index < position + cover.size())
+			cover[clear_index - position] &= ~((1 << bits) - 1);
+		
+		image.write_rows(output, position, cover.size(), cover.data());
+	
+	}
+	
+	VERBOSE_LOG("Finished stream encoding");
+
+}
+
+uint64_t stream_extract(std::istream &cover_input, const data_sink &sink, size_t window) {
+	
+	VERBOSE_LOG("Begin stream extracting");
+	
+	bmp_file image = bmp_file::read_headers(cover_input);
+	size_t image_bytes = image.size();
+	
+	if(!image_bytes)
+		throw std::runtime_error("Image is too small to contain encoded data.");
+	
+	window_reader reader(image, cover_input, window);
+	
+	// The first window always holds the whole header
+	std::span<uint8_t> cover = reader.next();
+	steg_header header = read_header(const_pixel_view(std::span<const uint8_t>(cover)));
+	
+	VERBOSE_LOG("Data size: " << header.data_size);
+	
+	if(header.data_size > image_bytes || header.image_bytes() > image_bytes)
+		throw std::runtime_error("Encoded data size exceeds the capacity of this image.");
+	
+	uint8_t encoding_bits = header.bits;
+	size_t length_bytes = header.length_bytes();
+	size_t prefix_bytes = header.prefix_bytes();
+	
+	// Checked or compressed data goes through a decoder on its way to the sink
+	payload_decoder decoder(header, sink);
+	
+	std::vector<uint8_t> stream(reader.window_stream_bytes(encoding_bits));
+	
+	// Decode the first window's share of the stream and skip the length bytes at its front
+	uint64_t stream_size = length_bytes + header.data_size;
+	size_t stream_bytes = window_stream_share(stream_size, cover.size() - prefix_bytes, encoding_bits);
+	
+	// Covers waiting on the reader as well, its reads are traced on their own
+	trace_span trace(trace_phase::extract, header.data_size);
+	
+	lsb_decode(cover.data() + prefix_bytes, stream.data(), stream_bytes, encoding_bits);
+	
+	// Pass on whatever data the first window held, then decode window by window until the data runs out
+	uint64_t stream_done = stream_bytes;
+	
+	if(stream_done > length_bytes)
+		decoder.feed(stream.data() + length_bytes, stream_done - length_bytes);
+	
+	while(stream_done < stream_size) {
+		
+		cover = reader.next();
+		
+		stream_bytes = window_stream_share(stream_size - stream_done, cover.size(), encoding_bits);
+		lsb_decode(cover.data(), stream.data(), stream_bytes, encoding_bits);
+		
+		decoder.feed(stream.data(), stream_bytes);
+		stream_done += stream_bytes;
+	
+	}
+	
+	VERBOSE_LOG("Finished stream extracting");
+	
+	return decoder.finish();
+
+}
+
+// Pixel bytes of one pipeline block, with the blocks split like the windows of window_reader
+struct pipeline_block {
+	
+	size_t start;
+	size_t end;
+	
+	pipeline_block(size_t index, size_t block_bytes, size_t image_bytes) :
+		start(index ? 3 + index * block_bytes : 0), end(std::min(image_bytes, 3 + (index + 1) * block_bytes)) {}
+
+};
+
+void pipeline_hide(const char *cover_filename, const char *output_filename, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked, size_t block) {
+	
+	VERBOSE_LOG("Begin pipelined encoding");
+	
+	std::vector<uint8_t> storage;
+	uint8_t flags = pack_data(data, storage, compression, checked);
+	
+	// Only the headers go through a stream, they also tell where the pixel rows start
+	std::ifstream cover_input(cover_filename, std::ios::binary);
+	if(!cover_input)
+		throw std::runtime_error("Unable to open image file for reading.");
+	
+	bmp_file image = bmp_file::read_headers(cover_input);
+	std::streamoff pixel_offset = cover_input.tellg();
+	if(pixel_offset < 0)
+		throw std::runtime_error("Image file is truncated.");
+	
+	cover_input.close();
+	
+	size_t image_bytes = image.size();
+	
+	if(!bits)
+		bits = minimum_bits(image_bytes, data.size(), flags);
+	
+	if(!bits || bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	steg_header header = make_header(data.size(), bits, flags);
+	
+	size_t needed = header.image_bytes();
+	if(needed > image_bytes) {
+		
+		std::stringstream err_s_str;
+		
+		err_s_str << "Not enough space in this image (" << image_bytes << ") to store this data set (" << needed << " bytes needed) for " << (uint16_t)bits << " bits.";
+		
+		throw std::runtime_error(err_s_str.str());
+	
+	}
+	
+	std::ostringstream headers;
+	image.write_headers(headers);
+	std::string header_bytes = headers.str();
+	
+	size_t row_bytes = image.width() * pixel_format_bytes(image.format());
+	size_t file_stride = ROUNDUP(row_bytes, STRIDE_ALIGN);
+	
+	// File offset of an unpadded pixel byte, relative to the start of the pixel rows
+	auto file_offset = [row_bytes, file_stride](size_t byte_index) {
+		return byte_index / row_bytes * file_stride + byte_index % row_bytes;
+	};
+	
+	// The stream is the length bytes followed by the data
+	uint8_t length[16];
+	size_t length_bytes = write_length(header, length);
+	size_t prefix_bytes = header.prefix_bytes();
+	
+	uint64_t stream_size = length_bytes + data.size();
+	uint64_t stream_done = 0;
+	
+	// The byte following a completely filled final image byte also has its lowest n bits cleared
+	size_t clear_index = (needed < image_bytes && !((stream_size << 3) % bits)) ? needed : SIZE_MAX;
+	
+	size_t block_bytes = std::max<size_t>(block / 8 * 8, STREAM_MIN_WINDOW_BYTES);
+	size_t block_count = (image_bytes - 3 + block_bytes - 1) / block_bytes;
+	
+	int input_fd = open(cover_filename, O_RDONLY);
+	if(input_fd < 0)
+		throw std::runtime_error("Unable to open image file for reading.");
+	
+	// Blocks are read from the cover while earlier ones are being written, so a regular output file is written under a
+	// temporary name next to it and renamed over it once complete. That keeps the cover intact when it is the output
+	// too, and leaves no partial output behind when encoding fails. Anything else, like a device, is written directly
+	struct stat output_stat;
+	std::optional<replacement_file> output_file;
+	int output_fd;
+	
+	try {
+		if(stat(output_filename, &output_stat) || S_ISREG(output_stat.st_mode)) {
+			output_file.emplace(output_filename);
+			output_fd = output_file->descriptor();
+		}
+		else
+			output_fd = open(output_filename, O_WRONLY | O_TRUNC);
+	}
+	catch(...) {
+		close(input_fd);
+		throw;
+	}
+	
+	if(output_fd < 0) {
+		close(input_fd);
+		throw std::runtime_error("Unable to open file for writing.");
+	}
+	
+	try {
+		
+		// Sized up front so the padding after the last row, which no block covers, reads back as zeros
+		if(output_file && ftruncate(output_fd, header_bytes.size() + image_bytes / row_bytes * file_stride))
+			throw std::runtime_error("Unable to write image file.");
+		
+		// Each buffer holds a block's span of the file from the start of its first row, so it can be viewed as rows
+		pixel_buffer buffers[PIPELINE_DEPTH];
+		std::vector<uint8_t> free_buffers;
+		for(uint8_t b = PIPELINE_DEPTH; b--;)
+			free_buffers.push_back(b);
+		
+		std::vector<uint8_t> owner(block_count);
+		std::vector<bool> arrived(block_count);
+		
+		// Declared after the buffers so that it waits for whatever is in flight before they go away
+		async_io io(PIPELINE_DEPTH * 2 + 1);
+		
+		VERBOSE_LOG("Pipelining through " << (io.uring() ? "io_uring" : "I/O threads"));
+		
+		// Reads are tagged 2 * block, writes 2 * block + 1
+		uint64_t header_tag = (uint64_t)block_count << 1;
+		
+		auto read_block = [&](size_t index) {
+			
+			pipeline_block span(index, block_bytes, image_bytes);
+			size_t lead = span.start % row_bytes;
+			size_t file_bytes = file_offset(span.end - 1) + 1 - file_offset(span.start);
+			
+			owner[index] = free_buffers.back();
+			free_buffers.pop_back();
+			
+			pixel_buffer &buffer = buffers[owner[index]];
+			if(buffer.size() < lead + file_bytes)
+				buffer.resize(lead + file_bytes);
+			
+			io.read(input_fd, buffer.data() + lead, file_bytes, pixel_offset + file_offset(span.start), (uint64_t)index << 1);
+		
+		};
+		
+		auto encode_block = [&](size_t index) {
+			
+			pipeline_block span(index, block_bytes, image_bytes);
+			size_t first_row = span.start / row_bytes;
+			size_t base = first_row * row_bytes;
+			size_t lead = span.start - base;
+			size_t file_bytes = file_offset(span.end - 1) + 1 - file_offset(span.start);
+			
+			uint8_t *buffer = buffers[owner[index]].data();
+			pixel_view pixels(buffer, row_bytes, file_stride, (span.end - 1) / row_bytes - first_row + 1);
+			
+			trace_span trace(trace_phase::embed);
+			
+			size_t offset = lead;
+			
+			// The first block starts with the prefix, which the minimum block size always fits
+			if(!index) {
+				write_prefix(pixels, header);
+				offset += prefix_bytes;
+			}
+			
+			if(stream_done < stream_size) {
+				
+				size_t stream_bytes = window_stream_share(stream_size - stream_done, span.end - base - offset, bits);
+				size_t head_bytes = 0;
+				
+				trace.add_bytes(stream_bytes);
+				
+				// The length bytes, which all fall in the first block, go out with data up to a group boundary
+				if(stream_done < length_bytes) {
+					
+					uint8_t head[16];
+					head_bytes = std::min<size_t>((length_bytes + bits - 1) / bits * bits, stream_bytes);
+					
+					std::memcpy(head, length, length_bytes);
+					std::memcpy(head + length_bytes, data.data(), head_bytes - length_bytes);
+					
+					encode_stream(pixels, offset, head, head_bytes, bits);
+				
+				}
+				
+				if(stream_bytes > head_bytes)
+					encode_stream(pixels, offset + lsb_cover_bytes(head_bytes, bits), data.data() + (stream_done + head_bytes - length_bytes), stream_bytes - head_bytes, bits);
+				
+				stream_done += stream_bytes;
+			
+			}
+			
+			if(clear_index >= span.start && clear_index < span.end)
+				pixels[clear_index - base] &= ~((1 << bits) - 1);
+			
+			// Padding is written as zeros, like bmp_file::write does
+			for(size_t pad = row_bytes; pad < lead + file_bytes; pad += file_stride)
+				std::memset(buffer + pad, 0, std::min(file_stride - row_bytes, lead + file_bytes - pad));
+			
+			io.write(output_fd, buffer + lead, file_bytes, header_bytes.size() + file_offset(span.start), ((uint64_t)index << 1) | 1);
+		
+		};
+		
+		io.write(output_fd, (const uint8_t *)header_bytes.data(), header_bytes.size(), 0, header_tag);
+		
+		size_t next_read = 0;
+		size_t next_encode = 0;
+		size_t written = 0;
+		bool header_written = false;
+		
+		for(; next_read < block_count && !free_buffers.empty(); next_read++)
+			read_block(next_read);
+		
+		// Blocks are encoded in order as their reads arrive, each finished write frees a buffer for the next read
+		while(written < block_count || !header_written) {
+			
+			std::chrono::steady_clock::time_point waiting = std::chrono::steady_clock::now();
+			
+			uint64_t tag = io.wait();
+			size_t index = tag >> 1;
+			
+			// Time blocked on I/O is put down to the request that ended the wait, along with the bytes it moved
+			if(trace_enabled()) {
+				
+				uint64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - waiting).count();
+				
+				if(tag == header_tag)
+					trace_add(trace_phase::write, waited, header_bytes.size());
+				else {
+					pipeline_block span(index, block_bytes, image_bytes);
+					trace_add(tag & 1 ? trace_phase::write : trace_phase::read, waited, span.end - span.start);
+				}
+			
+			}
+			
+			if(tag == header_tag)
+				header_written = true;
+			else if(tag & 1) {
+				
+				written++;
+				free_buffers.push_back(owner[index]);
+				
+				if(next_read < block_count)
+					read_block(next_read++);
+			
+			}
+			else {
+				
+				arrived[index] = true;
+				
+				for(; next_encode < next_read && arrived[next_encode]; next_encode++)
+					encode_block(next_encode);
+			
+			}
+		
+		}
+	
+	}
+	catch(...) {
+		close(input_fd);
+		if(!output_file)
+			close(output_fd);
+		throw;
+	}
+	
+	close(input_fd);
+	
+	if(output_file)
+		output_file->commit();
+	else if(close(output_fd))
+		throw std::runtime_error("Unable to write image file.");
+	
+	VERBOSE_LOG("Finished pipelined encoding");
+
+}
+
+data_sink fd_sink(int fd) {
+	
+	return [fd](const uint8_t *data, size_t len) {
+		
+		// Keep writing until everything is out, pipes in particular may take less than we give them
+		while(len) {
+			
+			ssize_t written = write(fd, data, len);
+			
+			if(written < 0) {
+				if(errno == EINTR)
+					continue;
+				throw std::runtime_error("Unable to write decoded data.");
+			}
+			
+			data += written;
+			len -= written;
+		
+		}
+	
+	};
+
+}
+
+void discard_output(int output_fd, const char *output_filename) {
+	
+	struct stat output_stat;
+	if(!fstat(output_fd, &output_stat) && S_ISREG(output_stat.st_mode))
+		unlink(output_filename);
+	
+	close(output_fd);
+
+}
+
+data_sink ostream_sink(std::ostream &output) {
+	
+	return [&output](const uint8_t *data, size_t len) {
+		if(!output.write((const char *)data, len))
+			throw std::runtime_error("Unable to write decoded data.");
+	};
+
+}
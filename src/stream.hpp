@@ -0,0 +1,59 @@
+#ifndef STREAM_HPP
+#define STREAM_HPP
+
+#include <istream>
+#include <ostream>
+
+#include "steg.hpp"
+
+/*/
+ *	Streaming encode/decode for images too large to hold in memory
+ *
+ *	Pixel rows are moved through a fixed-size window: while one window is being encoded and written out,
+ *	the next is already being read in. Memory use depends on the window size, not on the image size.
+ *
+/*/
+
+#define STREAM_WINDOW_BYTES (4 * 1024 * 1024)
+// Smallest window used, so that the whole header always falls in the first one
+#define STREAM_MIN_WINDOW_BYTES 128
+
+// Bit count stream_hide hides payload_size bytes in an image of image_bytes with, the minimum that fits if bits is 0
+// Throws if the payload doesn't fit, so a cover can be checked from its headers before anything is written
+uint8_t stream_bits(size_t image_bytes, uint64_t payload_size, uint8_t bits = 0);
+
+// Hide payload_size bytes read from payload in the image read from cover_input, writing the encoded image to output
+// A bit count of 0 picks the minimum number of bits that fits the payload
+void stream_hide(std::istream &cover_input, std::ostream &output, std::istream &payload, uint64_t payload_size, uint8_t bits = 0, size_t window = STREAM_WINDOW_BYTES);
+
+
+// Extract the data set hidden in the image read from cover_input, passing it to sink a window at a time
+// Checked data is verified and compressed data decompressed on the way, returns the data size once decompressed
+uint64_t stream_extract(std::istream &cover_input, const data_sink &sink, size_t window = STREAM_WINDOW_BYTES);
+
+/*/
+ *	Pipelined file-to-file encoding
+ *
+ *	The cover is read, encoded, and written out a block of pixel bytes at a time with several blocks in flight, so
+ *	reading one block, encoding the one before it, and writing the one before that all overlap. Reads and writes go
+ *	through async_io (see async_io.hpp), so io_uring where the kernel offers it and I/O threads elsewhere.
+ *	The output is byte for byte what hide_data followed by bmp_file::write produces.
+ *
+/*/
+
+#define PIPELINE_BLOCK_BYTES (8 * 1024 * 1024)
+// Blocks in flight at once, each needing a buffer of about PIPELINE_BLOCK_BYTES
+#define PIPELINE_DEPTH 4
+
+// Compress and/or frame the data as hide_data does and hide it in the image in cover_filename, written to output_filename
+// A bit count of 0 picks the minimum number of bits that fits the data
+void pipeline_hide(const char *cover_filename, const char *output_filename, std::span<const uint8_t> data, uint8_t bits = 0, lz_level compression = lz_level::none, bool checked = false, size_t block = PIPELINE_BLOCK_BYTES);
+
+// Sinks writing decoded data to a file descriptor (retrying short writes) or to an output stream
+data_sink fd_sink(int fd);
+data_sink ostream_sink(std::ostream &output);
+
+// Close an output file a failed decode has written part of, removing it if it's a regular file so it isn't taken for the data
+void discard_output(int output_fd, const char *output_filename);
+
+#endif
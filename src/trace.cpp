@@ -0,0 +1,265 @@
+#include <array>
+#include <mutex>
+#include <vector>
+#include <iomanip>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#if __has_include(<linux/perf_event.h>)
+	#include <linux/perf_event.h>
+	#define HAVE_PERF_EVENTS
+#endif
+
+#include "trace.hpp"
+
+namespace trace_detail {
+	std::atomic<bool> enabled{false};
+	std::atomic<bool> verbose{false};
+}
+
+// Per phase totals, added to atomically so spans on any thread can record without a lock
+struct phase_totals {
+	
+	std::atomic<uint64_t> calls{0};
+	std::atomic<uint64_t> nanoseconds{0};
+	std::atomic<uint64_t> bytes{0};
+	std::atomic<uint64_t> counters[3]{};
+
+};
+
+static std::array<phase_totals, TRACE_PHASES> totals;
+
+static const char *phase_names[TRACE_PHASES] = {"header", "read", "compress", "embed", "extract", "write"};
+
+/* Hardware counters */
+
+static std::atomic<bool> hardware{false};
+
+// One file descriptor per counter per thread, kept until exit so counts of threads that have finished still add up
+static std::mutex counter_lock;
+static std::vector<std::array<int, 3>> thread_counters;
+
+#ifdef HAVE_PERF_EVENTS
+
+static int open_counter(uint64_t config, int group_fd) {
+	
+	perf_event_attr attr;
+	std::memset(&attr, 0, sizeof(attr));
+	
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	
+	return syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+
+}
+
+// Returns false if the counters aren't available to this process
+static bool open_thread_counters() {
+	
+	static const uint64_t configs[3] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES};
+	
+	std::array<int, 3> fds;
+	for(uint8_t c = 0; c < 3; c++) {
+		
+		fds[c] = open_counter(configs[c], c ? fds[0] : -1);
+		
+		if(fds[c] < 0) {
+			for(uint8_t opened = 0; opened < c; opened++)
+				close(fds[opened]);
+			return false;
+		}
+	
+	}
+	
+	std::lock_guard<std::mutex> guard(counter_lock);
+	thread_counters.push_back(fds);
+	
+	return true;
+
+}
+
+#else
+
+static bool open_thread_counters() {
+	return false;
+}
+
+#endif
+
+static void read_counters(uint64_t values[3]) {
+	
+	values[0] = values[1] = values[2] = 0;
+	
+	std::lock_guard<std::mutex> guard(counter_lock);
+	
+	for(const std::array<int, 3> &fds : thread_counters) {
+		for(uint8_t c = 0; c < 3; c++) {
+			uint64_t value;
+			if(::read(fds[c], &value, sizeof(value)) == sizeof(value))
+				values[c] += value;
+		}
+	}
+
+}
+
+void trace_thread() {
+	
+	static thread_local bool opened = false;
+	
+	if(opened || !hardware.load(std::memory_order_relaxed))
+		return;
+	
+	opened = true;
+	open_thread_counters();
+
+}
+
+void trace_enable(bool hardware_counters) {
+	
+	// Counters are only kept if the calling thread's can be opened, otherwise no other thread's will be either
+	if(hardware_counters && open_thread_counters())
+		hardware = true;
+	
+	trace_detail::enabled = true;
+
+}
+
+bool trace_hardware_counters() {
+	return hardware.load(std::memory_order_relaxed);
+}
+
+void trace_add(trace_phase phase, uint64_t nanoseconds, uint64_t bytes) {
+	
+	if(!trace_enabled())
+		return;
+	
+	phase_totals &phase_total = totals[(size_t)phase];
+	phase_total.calls.fetch_add(1, std::memory_order_relaxed);
+	phase_total.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+	phase_total.bytes.fetch_add(bytes, std::memory_order_relaxed);
+
+}
+
+void trace_span::begin(trace_phase phase, uint64_t bytes) {
+	
+	this->active = true;
+	this->phase = phase;
+	this->bytes = bytes;
+	
+	if(trace_hardware_counters()) {
+		trace_thread();
+		read_counters(this->counters);
+	}
+	
+	this->start = std::chrono::steady_clock::now();
+
+}
+
+void trace_span::end() {
+	
+	uint64_t nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start).count();
+	trace_add(this->phase, nanoseconds, this->bytes);
+	
+	if(trace_hardware_counters()) {
+		
+		uint64_t counters[3];
+		read_counters(counters);
+		
+		for(uint8_t c = 0; c < 3; c++)
+			totals[(size_t)this->phase].counters[c].fetch_add(counters[c] - this->counters[c], std::memory_order_relaxed);
+	
+	}
+
+}
+
+const char *trace_phase_name(trace_phase phase) {
+	return phase_names[(size_t)phase];
+}
+
+trace_totals trace_get(trace_phase phase) {
+	
+	const phase_totals &phase_total = totals[(size_t)phase];
+	
+	trace_totals result;
+	result.calls = phase_total.calls;
+	result.nanoseconds = phase_total.nanoseconds;
+	result.bytes = phase_total.bytes;
+	result.cycles = phase_total.counters[0];
+	result.instructions = phase_total.counters[1];
+	result.cache_misses = phase_total.counters[2];
+	
+	return result;
+
+}
+
+// MB/s over the time spent in the phase, 0 for a phase too quick to measure (under a microsecond)
+static double phase_throughput(const trace_totals &phase_total) {
+	return phase_total.nanoseconds >= 1000 ? phase_total.bytes * 1e3 / phase_total.nanoseconds : 0;
+}
+
+void trace_report(std::ostream &output, double wall_seconds) {
+	
+	std::ios_base::fmtflags flags = output.flags();
+	output << std::fixed << std::setprecision(3);
+	
+	output << std::left << std::setw(10) << "phase" << std::right << std::setw(8) << "calls" << std::setw(12) << "ms" << std::setw(16) << "bytes" << std::setw(14) << "MB/s";
+	if(trace_hardware_counters())
+		output << std::setw(16) << "cycles" << std::setw(16) << "instructions" << std::setw(8) << "IPC" << std::setw(14) << "cache misses";
+	output << '\n';
+	
+	for(size_t phase = 0; phase < TRACE_PHASES; phase++) {
+		
+		trace_totals phase_total = trace_get((trace_phase)phase);
+		if(!phase_total.calls)
+			continue;
+		
+		output << std::left << std::setw(10) << phase_names[phase] << std::right << std::setw(8) << phase_total.calls << std::setw(12) << phase_total.nanoseconds / 1e6 << std::setw(16) << phase_total.bytes << std::setw(14) << phase_throughput(phase_total);
+		
+		if(trace_hardware_counters())
+			output << std::setw(16) << phase_total.cycles << std::setw(16) << phase_total.instructions << std::setw(8) << (phase_total.cycles ? (double)phase_total.instructions / phase_total.cycles : 0) << std::setw(14) << phase_total.cache_misses;
+		
+		output << '\n';
+	
+	}
+	
+	output << "wall " << wall_seconds * 1e3 << " ms\n";
+	output.flags(flags);
+
+}
+
+void trace_report_json(std::ostream &output, double wall_seconds) {
+	
+	std::ios_base::fmtflags flags = output.flags();
+	output << std::fixed << std::setprecision(6);
+	
+	output << "{\"wall_seconds\":" << wall_seconds << ",\"hardware_counters\":" << (trace_hardware_counters() ? "true" : "false") << ",\"phases\":{";
+	
+	bool first = true;
+	for(size_t phase = 0; phase < TRACE_PHASES; phase++) {
+		
+		trace_totals phase_total = trace_get((trace_phase)phase);
+		if(!phase_total.calls)
+			continue;
+		
+		output << (first ? "" : ",") << '"' << phase_names[phase] << "\":{\"calls\":" << phase_total.calls << ",\"seconds\":" << phase_total.nanoseconds / 1e9 << ",\"bytes\":" << phase_total.bytes << ",\"mb_per_second\":" << phase_throughput(phase_total);
+		
+		if(trace_hardware_counters())
+			output << ",\"cycles\":" << phase_total.cycles << ",\"instructions\":" << phase_total.instructions << ",\"cache_misses\":" << phase_total.cache_misses;
+		
+		output << '}';
+		first = false;
+	
+	}
+	
+	output << "}}\n";
+	output.flags(flags);
+
+}
+
+void trace_set_verbose(bool verbose) {
+	trace_detail::verbose = verbose;
+}
\ No newline at end of file
@@ -0,0 +1,124 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <ostream>
+#include <iostream>
+
+/*/
+ *	Runtime phase tracing
+ *
+ *	Each phase of an encode/decode (parsing headers, reading pixels, compressing, embedding, extracting, writing
+ *	pixels) is timed with a trace_span around it, adding its time and the bytes it handled to that phase's totals.
+ *	Spans sit around whole phases, windows, or blocks, never inside the per-byte loops, and while tracing is off a
+ *	span is a single relaxed load, so tracing can be left compiled in everywhere.
+ *
+ *	Spans on several threads at once (batch jobs, served requests, the stream reader) each add their own time, so a
+ *	phase's time can exceed the wall time. Phases may also nest, extracting includes writing out the decoded data.
+ *
+ *	Hardware counters (cycles, instructions, cache misses) come from perf_event_open, opened for each thread that
+ *	records a span or joins a parallel_for. A span adds the change in the counters of all those threads while it ran,
+ *	so spans overlapping in time share the counts. Where perf_event_open isn't allowed the counters are left out.
+ *
+/*/
+
+enum class trace_phase : uint8_t {
+	header,
+	read,
+	compress,
+	embed,
+	extract,
+	write
+};
+
+#define TRACE_PHASES 6
+
+struct trace_totals {
+	
+	uint64_t calls{0};
+	uint64_t nanoseconds{0};
+	uint64_t bytes{0};
+	
+	// Only filled in when hardware counters are on
+	uint64_t cycles{0};
+	uint64_t instructions{0};
+	uint64_t cache_misses{0};
+
+};
+
+namespace trace_detail {
+	extern std::atomic<bool> enabled;
+	extern std::atomic<bool> verbose;
+}
+
+inline bool trace_enabled() {
+	return trace_detail::enabled.load(std::memory_order_relaxed);
+}
+
+// Start recording spans, with hardware counters if asked for and available
+void trace_enable(bool hardware_counters = false);
+// Whether hardware counters are being recorded
+bool trace_hardware_counters();
+
+// Open hardware counters for the calling thread, for threads doing work on behalf of spans on other threads
+void trace_thread();
+
+// Add time measured some other way, such as time spent waiting on asynchronous I/O
+void trace_add(trace_phase phase, uint64_t nanoseconds, uint64_t bytes);
+
+// Time and bytes for one phase, recorded when the span goes out of scope
+class trace_span {
+
+public:
+
+	trace_span(trace_phase phase, uint64_t bytes = 0) {
+		if(trace_enabled())
+			this->begin(phase, bytes);
+	}
+	
+	~trace_span() {
+		if(this->active)
+			this->end();
+	}
+	
+	trace_span(const trace_span &) = delete;
+	trace_span &operator=(const trace_span &) = delete;
+	
+	// For spans that only learn their size as they go
+	void add_bytes(uint64_t bytes) {
+		this->bytes += bytes;
+	}
+
+private:
+
+	bool active{false};
+	trace_phase phase{trace_phase::header};
+	uint64_t bytes{0};
+	std::chrono::steady_clock::time_point start;
+	uint64_t counters[3]{};
+	
+	void begin(trace_phase phase, uint64_t bytes);
+	void end();
+
+};
+
+const char *trace_phase_name(trace_phase phase);
+trace_totals trace_get(trace_phase phase);
+
+// Print the totals of every phase that was entered, as aligned text or as a JSON object
+void trace_report(std::ostream &output, double wall_seconds);
+void trace_report_json(std::ostream &output, double wall_seconds);
+
+// Progress messages, printed to standard error at -vv and compiled away entirely with PROG_NO_TRACE
+void trace_set_verbose(bool verbose);
+
+#ifdef PROG_NO_TRACE
+	#define VERBOSE_LOG(a) {}
+#else
+	#define VERBOSE_LOG(a) { if(trace_detail::verbose.load(std::memory_order_relaxed)) std::cerr << a << '\n'; }
+#endif
+
+#endif
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "update.hpp"
+#include "lsb.hpp"
+
+// Writes the blocks of a mapped image's bytes that differ from the ones in the mapping back into its file
+class block_writer {
+
+public:
+
+	block_writer(const char *image_filename, const bmp_file &image, const_pixel_view pixels) : image(image), pixels(pixels) {
+		
+		this->fd = open(image_filename, O_WRONLY);
+		if(this->fd < 0)
+			throw std::runtime_error("Unable to open image file for writing.");
+	
+	}
+	
+	~block_writer() {
+		close(this->fd);
+	}
+	
+	block_writer(const block_writer &) = delete;
+	block_writer &operator=(const block_writer &) = delete;
+	
+	// Compare the new image bytes [first, first + len) with the old ones a block at a time, writing out those that differ
+	void write_changes(size_t first, const uint8_t *old_bytes, const uint8_t *new_bytes, size_t len) {
+		
+		for(size_t offset = 0; offset < len; offset += UPDATE_BLOCK_BYTES) {
+			
+			size_t block = std::min<size_t>(UPDATE_BLOCK_BYTES, len - offset);
+			
+			if(std::memcmp(old_bytes + offset, new_bytes + offset, block))
+				this->write_block(first + offset, new_bytes + offset, block);
+		
+		}
+	
+	}
+	
+	// Make sure everything written so far is in the file before anything written after it
+	void flush() {
+		if(fdatasync(this->fd))
+			throw std::runtime_error("Unable to flush image file.");
+	}
+	
+	uint64_t written{0};
+
+private:
+
+	void write_block(size_t first, const uint8_t *new_bytes, size_t len) {
+		
+		const uint8_t *start = this->pixels.address(first);
+		size_t span_bytes = this->pixels.address(first + len - 1) - start + 1;
+		
+		// Padding and unselected channels between the bytes are written back as they are, so the block goes out in one piece
+		if(span_bytes != len) {
+			
+			this->span.assign(start, start + span_bytes);
+			
+			for(size_t byte = 0; byte < len; byte++)
+				this->span[this->pixels.address(first + byte) - start] = new_bytes[byte];
+			
+			new_bytes = this->span.data();
+		
+		}
+		
+		trace_span trace(trace_phase::write, span_bytes);
+		
+		off_t offset = this->image.file_offset(start);
+		
+		while(span_bytes) {
+			
+			ssize_t count = pwrite(this->fd, new_bytes, span_bytes, offset);
+			if(count < 0 && errno == EINTR)
+				continue;
+			
+			if(count <= 0)
+				throw std::runtime_error("Unable to write image file.");
+			
+			new_bytes += count;
+			span_bytes -= count;
+			offset += count;
+			this->written += count;
+		
+		}
+	
+	}
+	
+	const bmp_file &image;
+	const_pixel_view pixels;
+	
+	int fd;
+	std::vector<uint8_t> span;
+
+};
+
+uint64_t update_hide(const char *image_filename, std::span<const uint8_t> data, uint8_t bits, lz_level compression, bool checked, uint8_t channels) {
+	
+	VERBOSE_LOG("Begin updating");
+	
+	const bmp_file image = bmp_file::map(image_filename, bmp_file::map_mode::read);
+	const_pixel_view pixels = image.view(channels);
+	
+	// The image has to hold encoded data already, its bit count is kept unless another is asked for
+	steg_header old_header = read_header(pixels);
+	if(old_header.data_size > pixels.size() || old_header.image_bytes() > pixels.size())
+		throw std::runtime_error("No encoded data found in this image.");
+	
+	if(!bits)
+		bits = old_header.bits;
+	
+	if(bits > 7)
+		throw std::runtime_error("Bit count must be between 1 and 7.");
+	
+	std::vector<uint8_t> storage;
+	uint8_t flags = pack_data(data, storage, compression, checked);
+	
+	steg_header header = make_header(data.size(), bits, flags);
+	
+	size_t image_bytes = pixels.size();
+	size_t needed = header.image_bytes();
+	
+	if(needed > image_bytes) {
+		
+		std::stringstream err_s_str;
+		
+		err_s_str << "Not enough space in this image (" << image_bytes << ") to store this data set (" << needed << " bytes needed) for " << (uint16_t)bits << " bits.";
+		
+		throw std::runtime_error(err_s_str.str());
+	
+	}
+	
+	trace_span trace(trace_phase::embed, data.size());
+	
+	block_writer writer(image_filename, image, pixels);
+	
+	// The prefix and the head of the stream, the length bytes and the data up to a group boundary, are held back
+	uint8_t head[16];
+	size_t head_bytes = head_size(header);
+	size_t length_bytes = write_length(header, head);
+	size_t head_data = head_bytes - length_bytes;
+	
+	std::memcpy(head + length_bytes, data.data(), head_data);
+	
+	size_t prefix_bytes = header.prefix_bytes();
+	size_t header_cover = prefix_bytes + lsb_cover_bytes(head_bytes, bits);
+	
+	std::vector<uint8_t> old_header_bytes(header_cover);
+	pixels.copy_to(0, header_cover, old_header_bytes.data());
+	
+	std::vector<uint8_t> new_header_bytes = old_header_bytes;
+	
+	write_prefix(pixel_view(std::span<uint8_t>(new_header_bytes)), header);
+	lsb_encode(new_header_bytes.data() + prefix_bytes, head, head_bytes, bits);
+	
+	// Everything after the head is group aligned, so each staging region encodes a whole number of groups
+	std::vector<uint8_t> old_bytes(STEG_STAGING_BYTES), new_bytes(STEG_STAGING_BYTES);
+	size_t block = STEG_STAGING_BYTES / 8 * bits;
+	
+	size_t cover_offset = header_cover;
+	const uint8_t *src = data.data() + head_data;
+	size_t remaining = data.size() - head_data;
+	
+	while(remaining) {
+		
+		size_t stream_bytes = std::min(remaining, block);
+		size_t cover_bytes = lsb_cover_bytes(stream_bytes, bits);
+		
+		pixels.copy_to(cover_offset, cover_bytes, old_bytes.data());
+		std::memcpy(new_bytes.data(), old_bytes.data(), cover_bytes);
+		lsb_encode(new_bytes.data(), src, stream_bytes, bits);
+		
+		writer.write_changes(cover_offset, old_bytes.data(), new_bytes.data(), cover_bytes);
+		
+		cover_offset += cover_bytes;
+		src += stream_bytes;
+		remaining -= stream_bytes;
+	
+	}
+	
+	// The byte following a completely filled final image byte also has its lowest n bits cleared
+	if(needed < image_bytes && !(((length_bytes + data.size()) << 3) % bits)) {
+		uint8_t old_byte = pixels[needed], new_byte = old_byte & ~((1 << bits) - 1);
+		writer.write_changes(needed, &old_byte, &new_byte, 1);
+	}
+	
+	// Only once the data is in the file does the header change to describe it
+	writer.flush();
+	writer.write_changes(0, old_header_bytes.data(), new_header_bytes.data(), header_cover);
+	writer.flush();
+	
+	VERBOSE_LOG("Finished updating, " << writer.written << " bytes written");
+	
+	return writer.written;
+
+}
\ No newline at end of file
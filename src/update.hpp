@@ -0,0 +1,31 @@
+#ifndef UPDATE_HPP
+#define UPDATE_HPP
+
+#include <span>
+#include <cstdint>
+
+#include "steg.hpp"
+
+/*/
+ *	Incremental re-embedding, for replacing the data in an encoded image with a slightly different data set
+ *
+ *	The image file is mapped and the new image bytes are worked out a staging region at a time, exactly as hide_data
+ *	would encode the new data into the image as it stands. Each region is compared with the bytes already there a
+ *	block of UPDATE_BLOCK_BYTES at a time, and only the blocks that differ are written back into the file with pwrite.
+ *	Unchanged data therefore costs a read of its image bytes but no writes, and nothing past the end of the new data
+ *	is touched at all.
+ *
+ *	The image bytes holding the header are written last, once the data blocks have been flushed to the file, so the
+ *	header never describes data that hasn't reached the file. Data blocks written before an interrupted update are
+ *	not rolled back, checked data (see chunk.hpp) makes any such mix show up as a CRC failure instead.
+ *
+/*/
+
+#define UPDATE_BLOCK_BYTES 4096
+
+// Replace the data encoded in the image in image_filename with data, compressed and/or checked as hide_data does,
+// writing only the blocks of image bytes that change. A bit count of 0 keeps the one the image was encoded with.
+// Throws if the image holds no encoded data, returns the number of bytes written to the file
+uint64_t update_hide(const char *image_filename, std::span<const uint8_t> data, uint8_t bits = 0, lz_level compression = lz_level::none, bool checked = false, uint8_t channels = CHANNELS_ALL);
+
+#endif
\ No newline at end of file